@@ -0,0 +1,94 @@
+// bitmap.h: Word-packed bitmap
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+class Bitmap {
+private:
+    std::vector<uint64_t> Words;    // One bit per item
+    std::vector<uint64_t> Summary;  // One bit per word, set if word is non-zero
+    size_t		  Bits;	    // Number of items
+    size_t		  Count;    // Number of set bits
+
+    // Update summary bit for word
+    void summarize(size_t word) {
+    	if (Words[word]) {
+    	    Summary[word/64] |=  (1ULL << (word%64));
+	} else {
+    	    Summary[word/64] &= ~(1ULL << (word%64));
+	}
+    }
+
+public:
+    // Returned by searches that find nothing
+    const static size_t NPOS = (size_t)-1;
+
+    // Constructor
+    // @param	bits	    Number of items
+    // @param	value	    Initial value of every bit
+    Bitmap(size_t bits = 0, bool value = false) { resize(bits, value); }
+
+    // Reset bitmap to new size with all bits set to value
+    // @param	bits	    Number of items
+    // @param	value	    Initial value of every bit
+    void resize(size_t bits, bool value);
+
+    // Return number of items
+    size_t size() const { return Bits; }
+
+    // Return number of set bits
+    size_t count() const { return Count; }
+
+    // Return number of set bits in [start, end)
+    // @param	start	    First bit to count
+    // @param	end	    Bit to stop counting at
+    size_t count(size_t start, size_t end) const;
+
+    // Return whether or not bit is set
+    bool test(size_t bit) const { return (Words[bit/64] >> (bit%64)) & 1; }
+
+    // Set bit
+    void set(size_t bit) {
+    	uint64_t mask = 1ULL << (bit%64);
+    	if (!(Words[bit/64] & mask)) {
+    	    Words[bit/64] |= mask;
+    	    summarize(bit/64);
+    	    Count++;
+	}
+    }
+
+    // Clear bit
+    void clear(size_t bit) {
+    	uint64_t mask = 1ULL << (bit%64);
+    	if (Words[bit/64] & mask) {
+    	    Words[bit/64] &= ~mask;
+    	    summarize(bit/64);
+    	    Count--;
+	}
+    }
+
+    // Return number of 64-bit words backing bitmap
+    size_t words() const { return Words.size(); }
+
+    // Return word of bitmap
+    uint64_t word(size_t index) const { return Words[index]; }
+
+    // Replace word of bitmap (used to load a bitmap saved with word())
+    // @param	index	    Word to replace
+    // @param	value	    New contents of word
+    void set_word(size_t index, uint64_t value);
+
+    // Return first set bit at or after start (NPOS if none)
+    // @param	start	    Bit to start searching from
+    size_t find_first(size_t start = 0) const;
+
+    // Return first bit at or after start that begins a run of at least
+    // length set bits (NPOS if none)
+    // @param	start	    Bit to start searching from
+    // @param	length	    Number of consecutive set bits wanted
+    size_t find_run(size_t start, size_t length) const;
+};
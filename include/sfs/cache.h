@@ -0,0 +1,197 @@
+// cache.h: Block cache
+
+#pragma once
+
+#include "sfs/checksum.h"
+#include "sfs/disk.h"
+
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Every public operation is atomic with respect to the others, so a cache may
+// be shared by threads. Given a checksum table, every block read from disk is
+// verified against it (a mismatch throws like a failed read) and every block
+// written to disk has its checksum recorded by the time the write completes.
+// Checks of read ahead and of asynchronous writes run on the disk workers.
+
+class Cache {
+private:
+    struct Entry {
+    	int	BlockNumber;		// Block cached by this entry
+    	bool	Dirty;			// Whether or not block must be written back
+    	bool	Prefetched;		// Whether or not block was read ahead and not used yet
+    	bool	Pinned;			// Whether or not block holds uncommitted metadata
+    	bool	Logged;			// Whether or not block is committed to the journal
+    	char	Data[Disk::BLOCK_SIZE];	// Cached block contents
+    };
+
+    struct Prefetch {
+    	Disk::Request	  Request;	// Asynchronous read of run
+    	std::vector<char> Buffer;	// Contents of run once read
+    	std::vector<bool> Failed;	// Blocks failing their checksum (checked by the worker)
+    };
+
+    typedef std::list<Entry> EntryList;
+
+    Disk *	Device;	    // Disk cache sits in front of
+    Checksums *	Sums;	    // Checksum table of disk (optional)
+    size_t	Capacity;   // Maximum number of cached blocks
+    size_t	Hits;	    // Number of lookups served from cache
+    size_t	Misses;	    // Number of lookups that went to disk
+    size_t	Evictions;  // Number of blocks evicted to make room
+    size_t	ReadaheadHits;	    // Number of prefetched blocks later used
+    size_t	ReadaheadWasted;    // Number of prefetched blocks dropped unused
+    size_t	PinnedBlocks;	    // Number of pinned entries
+
+    std::mutex	Lock;	    // Serializes every public operation
+
+    EntryList	Entries;    // Cached blocks, most recently used first
+    std::unordered_map<int, EntryList::iterator> Index;	// Block to entry map
+    std::unordered_map<int, std::shared_ptr<Prefetch>> Pending;	// Blocks being read ahead
+
+    // Return cached entry for block (moving it to the front of the LRU
+    // list), or nullptr if block is not cached
+    // @param	blocknum    Block to find
+    Entry *find(int blocknum);
+
+    // Insert entry for block, evicting the least recently used entry if full
+    // @param	blocknum    Block to insert
+    Entry *insert(int blocknum);
+
+    // Wait for prefetch covering block (if any) and insert its blocks
+    // @param	blocknum    Block about to be accessed
+    void reap(int blocknum);
+
+    // Return entry for block, loading it from disk if necessary
+    // @param	blocknum    Block to lookup
+    // @param	load	    Whether or not to read block contents on a miss
+    Entry *lookup(int blocknum, bool load);
+
+    // Evict least recently used entry that is not pinned, writing it back if
+    // dirty; returns false if every entry is pinned
+    bool evict();
+
+
+    // Record checksums of blocks about to be written to disk, marking them
+    // unsettled first unless they were committed to the journal
+    void record(int blocknum, size_t nblocks, const char *data, bool logged = false) {
+    	if (Sums) {
+    	    if (!logged) {
+    	    	Sums->unsettle(blocknum, nblocks);
+	    }
+    	    Sums->update(blocknum, nblocks, data);
+	}
+    }
+
+    // Mark entry as holding uncommitted metadata
+    // @param	entry	    Entry to pin
+    void pin(Entry *entry);
+
+public:
+    // Default number of cached blocks
+    const static size_t DEFAULT_CAPACITY = 64;
+
+    // Constructor
+    // @param	disk	    Disk to cache
+    // @param	capacity    Maximum number of cached blocks (0 disables caching)
+    // @param	checksums   Checksum table to verify and update (optional)
+    Cache(Disk *disk, size_t capacity = DEFAULT_CAPACITY, Checksums *checksums = nullptr);
+
+    // Destructor (writes back all dirty blocks)
+    ~Cache();
+
+    // Verify blocks just read from disk, throwing if one fails its checksum
+    // (also for blocks read around the cache)
+    // @param	blocknum    First block read
+    // @param	nblocks	    Number of blocks read
+    // @param	data	    Contents read
+    void check(int blocknum, size_t nblocks, const char *data);
+
+    // Read block through cache
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void read(int blocknum, char *data);
+
+    // Read part of block through cache straight into caller's buffer
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    // @param	offset	    Offset within block to start copying from
+    // @param	length	    Number of bytes to copy
+    void read(int blocknum, char *data, size_t offset, size_t length);
+
+    // Read run of contiguous blocks, serving cached blocks from the cache
+    // and reading each run of uncached blocks with one disk request
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to read into
+    // @param	pending	    If given, disk requests are submitted asynchronously
+    //			    and appended here for the caller to wait on
+    void read_blocks(int blocknum, size_t nblocks, char *data, std::deque<Disk::Request> *pending = nullptr);
+
+    // Write block into cache (written back on eviction or sync)
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    // @param	pin	    Whether or not block is metadata that must stay in
+    //			    the cache until committed to the journal
+    void write(int blocknum, char *data, bool pin = false);
+
+    // Write part of block into cache, reading the rest of it on a miss
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    // @param	offset	    Offset within block to start copying to
+    // @param	length	    Number of bytes to copy
+    // @param	pin	    Whether or not block must stay until committed
+    void write(int blocknum, char *data, size_t offset, size_t length, bool pin = false);
+
+    // Write run of contiguous blocks straight to disk with one request,
+    // refreshing any cached copies
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to write from
+    // @param	pending	    If given, the disk request is submitted asynchronously
+    //			    and appended here for the caller to wait on
+    void write_blocks(int blocknum, size_t nblocks, char *data, std::deque<Disk::Request> *pending = nullptr);
+
+    // Start asynchronous read of blocks not already cached; they are
+    // inserted into the cache when first accessed
+    // @param	blocknum    First block to read ahead
+    // @param	nblocks	    Number of contiguous blocks to read ahead
+    void prefetch(int blocknum, size_t nblocks);
+
+    // Wait for outstanding read ahead and drop it (counted as wasted)
+    void discard_prefetches();
+
+    // Write back dirty blocks that are not pinned, coalescing contiguous blocks
+    // @param	logged	    Whether or not to include blocks already committed to
+    //			    the journal (false writes back only file data)
+    void sync(bool logged = true);
+
+    // Copy every pinned block, in block order
+    // @param	blocks	    Filled in with pinned block numbers
+    // @param	data	    Filled in with their contents, BLOCK_SIZE bytes each
+    void pinned_blocks(std::vector<int> *blocks, std::vector<char> *data);
+
+    // Drop cached copy of a freed block without writing it back
+    // @param	blocknum    Block to drop
+    void forget(int blocknum);
+
+    // Release pinned blocks once committed, leaving them dirty and logged
+    // @param	blocks	    Blocks to release
+    void unpin(const std::vector<int> &blocks);
+
+    // Clear cache statistics
+    void reset_stats();
+
+    // Return cache statistics
+    size_t capacity() const  { return Capacity; }
+    size_t hits() const	     { return Hits; }
+    size_t misses() const    { return Misses; }
+    size_t evictions() const { return Evictions; }
+    size_t readahead_hits() const   { return ReadaheadHits; }
+    size_t readahead_wasted() const { return ReadaheadWasted; }
+    size_t pinned() const    { return PinnedBlocks; }
+};
@@ -0,0 +1,164 @@
+// checksum.h: CRC32C checksums of disk blocks
+
+#pragma once
+
+#include "sfs/bitmap.h"
+#include "sfs/disk.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// The checksum table is a region of the disk holding one CRC32C per block of
+// the disk, ENTRIES_PER_BLOCK to a table block. An entry of 0 means the block
+// has no checksum yet (a block whose checksum is 0 is recorded as ~0). Only
+// covered blocks are checksummed: the caller decides which, and a block
+// with an entry in the table is covered once the table is loaded.
+//
+// Data blocks go home between commits, before the table holding their new
+// checksums commits. So that a crash cannot leave such a block failing the
+// checksum it had before, the table is followed by the unsettled map, one
+// bit per GROUP_BLOCKS blocks: before a tracked block with a committed
+// checksum is written outside a commit, its group is marked on disk, and the
+// map is cleared once a commit holds the new checksums. After a crash,
+// recover() takes the blocks of marked groups as they are.
+//
+// Every public operation is atomic with respect to the others, so the table
+// may be shared by threads (checksums themselves are computed unlocked).
+
+class Checksums {
+public:
+    const static uint32_t ENTRIES_PER_BLOCK = Disk::BLOCK_SIZE/sizeof(uint32_t);
+    const static uint32_t GROUP_BLOCKS	    = 64;
+    const static uint32_t GROUPS_PER_BLOCK  = Disk::BLOCK_SIZE*8;
+
+    // Return CRC32C (Castagnoli) of buffer, continuing from crc; uses the
+    // SSE4.2 crc32 instruction when the processor has it
+    // @param	data	    Bytes to checksum
+    // @param	length	    Number of bytes
+    // @param	crc	    Checksum of the bytes before data
+    static uint32_t crc32c(const char *data, size_t length, uint32_t crc = 0);
+
+    // Return whether or not crc32c runs on the SSE4.2 crc32 instruction
+    static bool accelerated();
+
+    // Return number of table blocks needed for disk of given size
+    static uint32_t table_blocks(uint32_t blocks) {
+    	return (blocks + ENTRIES_PER_BLOCK - 1)/ENTRIES_PER_BLOCK;
+    }
+
+    // Return number of blocks needed for table and unsettled map of disk of
+    // given size
+    static uint32_t blocks_for(uint32_t blocks) {
+    	uint32_t groups = (blocks + GROUP_BLOCKS - 1)/GROUP_BLOCKS;
+    	return table_blocks(blocks) + (groups + GROUPS_PER_BLOCK - 1)/GROUPS_PER_BLOCK;
+    }
+
+private:
+    Disk *	Device;	    // Disk holding table
+    uint32_t	Start;	    // First table block on disk
+    uint32_t	Blocks;	    // Number of disk blocks described by table
+    std::vector<uint32_t> Sums;	    // Checksum of every block (0 if none)
+    std::vector<bool>	  Dirty;    // Table blocks changed since last saved
+    std::atomic<size_t>	  DirtyBlocks;	// Number of them
+    Bitmap	Covered;    // Blocks whose writes are checksummed
+    Bitmap	Durable;    // Blocks whose committed entry is not 0
+    Bitmap	Unsettled;  // Groups marked in the unsettled map
+    std::vector<bool> MapDirty;	    // Map blocks changed since last written
+    uint32_t	TrackStart; // First block whose writes mark the map
+    uint32_t	TrackEnd;   // Block after the last one
+
+    std::mutex	Lock;	    // Serializes every public operation
+    std::atomic<size_t> Verified;   // Number of blocks checked against the table
+    std::atomic<size_t> Mismatches; // Number of blocks that failed their check
+    std::atomic<size_t> Updated;    // Number of checksums recorded
+
+    // Set entry of block, marking its table block dirty if it changes (Lock
+    // must be held)
+    void set(uint32_t block, uint32_t sum);
+
+    // Write map blocks changed since last written (Lock must be held)
+    // @param	flush	    Whether or not to wait for them to reach the disk
+    void write_map(bool flush);
+
+public:
+    // Constructor (the table starts out empty until loaded)
+    // @param	disk	    Disk holding table
+    // @param	start	    First table block on disk
+    // @param	blocks	    Number of disk blocks described by table
+    Checksums(Disk *disk, uint32_t start, uint32_t blocks);
+
+    // Read table and unsettled map from disk, covering every block that
+    // has an entry
+    void load();
+
+    // Take the blocks of every group marked in the unsettled map as they
+    // are, giving a new checksum to each that fails its old one (after a
+    // crash, before any block is read); returns the number of new checksums
+    size_t recover();
+
+    // Drop every entry (and save the empty table with the next dirty_blocks)
+    void clear();
+
+    // Checksum writes of blocks from now on
+    // @param	first	    First block to cover
+    // @param	count	    Number of blocks to cover
+    void cover(uint32_t first, uint32_t count = 1);
+
+    // Mark map before writes of blocks outside a commit from now on
+    // @param	first	    First block to track
+    // @param	count	    Number of blocks to track
+    void track(uint32_t first, uint32_t count);
+
+    // Mark groups of tracked blocks about to be written outside a commit
+    // in the unsettled map, on disk, unless their committed entries are 0
+    // @param	blocknum    First block about to be written
+    // @param	nblocks	    Number of blocks
+    void unsettle(uint32_t blocknum, size_t nblocks);
+
+    // Clear unsettled map once a commit holds the checksums of every block
+    // written before it
+    void settle();
+
+    // Drop entry of a freed block
+    // @param	block	    Block freed
+    // @param	uncover	    Whether or not to stop checksumming its writes
+    void forget(uint32_t block, bool uncover);
+
+    // Record checksums of covered blocks about to be written
+    // @param	blocknum    First block written
+    // @param	nblocks	    Number of blocks written
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes being written
+    void update(uint32_t blocknum, size_t nblocks, const char *data);
+
+    // Return whether or not block has an entry
+    bool has(uint32_t block);
+
+    // Check blocks just read against their entries, returning false if one
+    // does not match
+    // @param	blocknum    First block read
+    // @param	nblocks	    Number of blocks read
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes read
+    // @param	bad	    If given, set to the first block that does not match
+    bool verify(uint32_t blocknum, size_t nblocks, const char *data, uint32_t *bad = nullptr);
+
+    // Copy every table block changed since the last call, for the caller to
+    // write (through the cache or straight to disk) and commit
+    // @param	blocks	    Filled in with table block numbers
+    // @param	data	    Filled in with their contents, BLOCK_SIZE bytes each
+    void dirty_blocks(std::vector<uint32_t> *blocks, std::vector<char> *data);
+
+    // Return number of table blocks changed since the last dirty_blocks
+    size_t dirty() const { return DirtyBlocks; }
+
+    // Clear statistics
+    void reset_stats();
+
+    // Return statistics
+    size_t verified() const   { return Verified; }
+    size_t mismatches() const { return Mismatches; }
+    size_t updated() const    { return Updated; }
+};
@@ -2,28 +2,104 @@
 
 #pragma once
 
+#include "sfs/stats.h"
+#include "sfs/trace.h"
+
 #include <stdlib.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 class Disk {
+public:
+    // Asynchronous request for a run of contiguous blocks
+    struct Request {
+    	int	    BlockNumber;    // First block to transfer
+    	size_t	    Blocks;	    // Number of blocks to transfer
+    	char *	    Data;	    // Buffer of Blocks*BLOCK_SIZE bytes
+    	bool	    Write;	    // Whether to write (true) or read (false)
+    	std::function<void(Request *)> Callback;   // Run on completion (optional)
+    	bool	    Done;	    // Set once request has completed
+    	std::string Error;	    // Error message if request failed
+
+    	Request(int blocknum = 0, size_t nblocks = 0, char *data = nullptr, bool write = false)
+    	    : BlockNumber(blocknum), Blocks(nblocks), Data(data), Write(write), Done(false) {}
+    };
+
+    struct Stats {		// Instrumentation of block transfers
+    	OpStats Read;		// Read requests (bytes read, time per request)
+    	OpStats Write;		// Write requests (bytes written, time per request)
+    };
+
 private:
     int	    FileDescriptor; // File descriptor of disk image
     size_t  Blocks;	    // Number of blocks in disk image
-    size_t  Reads;	    // Number of reads performed
-    size_t  Writes;	    // Number of writes performed
+    std::atomic<size_t> Reads;	// Number of reads performed
+    std::atomic<size_t> Writes;	// Number of writes performed
     size_t  Mounts;	    // Number of mounts
+    char *  Mapping;	    // Memory mapping of disk image (mmap backend only)
+    Stats   IOStats;	    // Transfer counts and latencies
+    Trace * Tracer;	    // Trace transfers are recorded into (optional)
+
+    size_t  QueueWorkers;   // Number of threads serving asynchronous requests
+    size_t  QueueDepth;	    // Maximum number of requests in flight
+    size_t  InFlight;	    // Number of requests queued or being served
+    bool    Stopping;	    // Whether or not workers should exit
+    std::deque<Request *>    Queue;	    // Requests waiting for a worker
+    std::vector<std::thread> Workers;	    // Worker threads
+    std::mutex		     QueueLock;	    // Protects queue state
+    std::condition_variable  QueueReady;    // Signalled when a request is queued
+    std::condition_variable  QueueSpace;    // Signalled when a request completes
+
+    // Serve queued requests until stopped
+    void worker();
+
+    // Stop and join worker threads
+    void stop_queue();
 
     // Check parameters
-    // @param	blocknum    Block to operate on
+    // @param	blocknum    First block to operate on
+    // @param	nblocks	    Number of blocks to operate on
     // @param	data	    Buffer to operate on
     // Throws invalid_argument exception on error.
-    void sanity_check(int blocknum, char *data);
+    void sanity_check(int blocknum, size_t nblocks, const void *data);
+
+    // Transfer run of contiguous blocks with a single positional syscall
+    // @param	blocknum    First block to transfer
+    // @param	nblocks	    Number of blocks to transfer
+    // @param	iov	    Buffers covering nblocks*BLOCK_SIZE bytes
+    // @param	iovcnt	    Number of buffers
+    // @param	write	    Whether to write (true) or read (false)
+    // Throws runtime_error exception on error.
+    void transfer(int blocknum, size_t nblocks, struct iovec *iov, int iovcnt, bool write);
 
 public:
     // Number of bytes per block
     const static size_t BLOCK_SIZE = 4096;
+
+    // Number of zero blocks written per request when holes are unsupported
+    const static size_t DISCARD_RUN = 256;
+
+    // Default asynchronous queue configuration
+    const static size_t DEFAULT_QUEUE_WORKERS = 4;
+    const static size_t DEFAULT_QUEUE_DEPTH   = 32;
+
+    // Ways of accessing the disk image
+    enum Backend {
+    	BACKEND_FILE,	    // pread/pwrite on the image file
+    	BACKEND_MMAP,	    // memory map image and copy blocks from the mapping
+    };
     
     // Default constructor
-    Disk() : FileDescriptor(0), Blocks(0), Reads(0), Writes(0), Mounts(0) {}
+    Disk() : FileDescriptor(0), Blocks(0), Reads(0), Writes(0), Mounts(0), Mapping(nullptr), Tracer(nullptr),
+    	QueueWorkers(DEFAULT_QUEUE_WORKERS), QueueDepth(DEFAULT_QUEUE_DEPTH), InFlight(0), Stopping(false) {}
     
     // Destructor
     ~Disk();
@@ -31,12 +107,29 @@ public:
     // Open disk image
     // @param	path	    Path to disk image
     // @param	nblocks	    Number of blocks in disk image
+    // @param	backend	    How to access the disk image
     // Throws runtime_error exception on error.
-    void open(const char *path, size_t nblocks);
+    void open(const char *path, size_t nblocks, Backend backend = BACKEND_FILE);
 
     // Return size of disk (in terms of blocks)
     size_t size() const { return Blocks; }
 
+    // Return number of blocks read and written since the image was opened
+    size_t reads() const  { return Reads; }
+    size_t writes() const { return Writes; }
+
+    // Return transfer statistics
+    const Stats &stats() const { return IOStats; }
+
+    // Clear transfer statistics (the read and write totals are kept)
+    void reset_stats() { IOStats.Read.reset(); IOStats.Write.reset(); }
+
+    // Record every block transfer into trace (nullptr stops tracing)
+    void set_trace(Trace *trace) { Tracer = trace; }
+
+    // Return whether or not disk image is memory mapped
+    bool mapped() const { return Mapping != nullptr; }
+
     // Return whether or not disk is mounted
     bool mounted() const { return Mounts > 0; }
 
@@ -55,4 +148,53 @@ public:
     // @param	blocknum    Block to write to
     // @param	data	    Buffer to write from
     void write(int blocknum, char *data);
+
+    // Read run of contiguous blocks into one buffer
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to read into
+    void read_blocks(int blocknum, size_t nblocks, char *data);
+
+    // Read run of contiguous blocks into one buffer per block
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	buffers	    Buffers of BLOCK_SIZE bytes to read into
+    void read_blocks(int blocknum, size_t nblocks, char **buffers);
+
+    // Write run of contiguous blocks from one buffer
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to write from
+    void write_blocks(int blocknum, size_t nblocks, char *data);
+
+    // Write run of contiguous blocks from one buffer per block
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	buffers	    Buffers of BLOCK_SIZE bytes to write from
+    void write_blocks(int blocknum, size_t nblocks, char **buffers);
+
+    // Release run of contiguous blocks so they read back as zeros, punching
+    // a hole in the image file where supported and writing zeros otherwise
+    // @param	blocknum    First block to release
+    // @param	nblocks	    Number of blocks to release
+    // Throws runtime_error exception on error.
+    void discard(int blocknum, size_t nblocks);
+
+    // Configure asynchronous queue (workers are started on first submit)
+    // @param	workers	    Number of worker threads
+    // @param	depth	    Maximum number of requests in flight
+    void configure_queue(size_t workers, size_t depth);
+
+    // Submit asynchronous request, blocking while the queue is full
+    // @param	request	    Request to serve (must stay valid until waited on)
+    void submit(Request *request);
+
+    // Wait for asynchronous request to complete
+    // @param	request	    Request previously submitted
+    // Throws runtime_error exception if the request failed.
+    void wait(Request *request);
+
+    // Flush written blocks to stable storage (msync for the mmap backend)
+    // Throws runtime_error exception on error.
+    void flush();
 };
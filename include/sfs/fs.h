@@ -2,9 +2,69 @@
 
 #pragma once
 
+#include "sfs/bitmap.h"
+#include "sfs/cache.h"
+#include "sfs/checksum.h"
 #include "sfs/disk.h"
+#include "sfs/journal.h"
+#include "sfs/lz.h"
+#include "sfs/stats.h"
+#include "sfs/trace.h"
 
+#include <pthread.h>
 #include <stdint.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Holds an inode lock until the end of the enclosing scope
+class InodeGuard {
+public:
+    InodeGuard(pthread_rwlock_t *lock, bool exclusive) : Lock(lock) {
+    	if (exclusive) {
+    	    pthread_rwlock_wrlock(Lock);
+	} else {
+	    pthread_rwlock_rdlock(Lock);
+	}
+    }
+    ~InodeGuard() { pthread_rwlock_unlock(Lock); }
+
+private:
+    pthread_rwlock_t *Lock;
+};
+
+// File operations (create, remove, stat, read, write) may be called from
+// several threads at once: each inode is guarded by a reader/writer lock
+// (striped over INODE_LOCKS locks), while the block allocator, the free
+// inode index, read ahead state and the block cache each have their own
+// mutex. Changes to directories (link, unlink, mkdir) are serialized by one
+// more mutex, and take the lock of each inode they change in turn. mount,
+// unmount and format must not overlap other calls.
+//
+// From version 6 on, disks of at least 512 blocks reserve a journal after
+// the free block bitmap. Every change to metadata then joins a running
+// transaction: its blocks stay pinned in the cache until a group commit
+// writes them to the journal in one request, and are written home later.
+// Calls hold the transaction lock shared; a commit takes it exclusively.
+// A call joins the running transaction only while the journal has room for
+// CALL_BLOCKS more blocks per call in it, and is otherwise committed first,
+// so a transaction always fits in the journal: large writes commit every
+// WRITE_PIECE bytes, and blocks freed beyond the room left in a commit are
+// freed by transactions of their own (a crash in between leaks them).
+//
+// From version 8 on, a checksum table follows the journal, holding a CRC32C
+// of every inode, bitmap, pointer and directory block (and, if the disk was
+// formatted with data checksums, of every data block). Blocks are verified
+// as they are read through the cache. With a journal, the checksums of
+// metadata commit along with it; without one, the table is only trusted
+// after a clean unmount. Data blocks go home before their transaction
+// commits, so after a crash the data blocks written since the last commit
+// are taken as they are, with new checksums.
 
 class FileSystem {
 public:
@@ -12,6 +72,89 @@ public:
     const static uint32_t INODES_PER_BLOCK   = 128;
     const static uint32_t POINTERS_PER_INODE = 5;
     const static uint32_t POINTERS_PER_BLOCK = 1024;
+    const static uint32_t WORDS_PER_BLOCK    = 512;
+    const static uint32_t BITS_PER_BLOCK     = WORDS_PER_BLOCK*64;
+    const static uint32_t FORMAT_VERSION     = 8;
+    const static uint32_t STATE_DIRTY	     = 0;
+    const static uint32_t STATE_CLEAN	     = 1;
+    const static uint32_t UNSCANNED	     = (uint32_t)-1;
+    const static uint32_t FORMAT_RUN	     = 256;
+    const static uint32_t MAX_READAHEAD	     = 32;
+    const static uint32_t REGION_BLOCKS	     = 1024;
+    const static uint32_t INODE_LOCKS	     = 64;
+    const static uint32_t SCAN_BATCH	     = 32;
+    const static uint32_t SCAN_MIN_BLOCKS    = 64;
+    const static uint32_t COMMIT_INTERVAL    = 5;	// Seconds a transaction may stay open
+    const static uint32_t CALL_BLOCKS	     = 16;	// Journal blocks kept free for each call in a transaction
+    const static uint32_t WRITE_PIECE	     = POINTERS_PER_BLOCK*Disk::BLOCK_SIZE;	// Most bytes one transaction of a write covers
+
+    // Bits of Inode.Valid (the name count lives in the high bits)
+    const static uint32_t INODE_VALID	     = 1;
+    const static uint32_t INODE_DIRECTORY    = 2;
+    const static uint32_t INODE_INLINE	     = 4;	// Data kept in pointer space (version 5)
+    const static uint32_t INODE_COMPRESSED   = 8;	// Data kept in compressed clusters (version 7)
+    const static uint32_t LINK_SHIFT	     = 16;
+    const static uint32_t MAX_LINKS	     = 0xffff;
+    const static uint32_t INLINE_SIZE	     = (POINTERS_PER_INODE + 1)*sizeof(uint32_t);
+
+    // A compressed file is stored in clusters of CLUSTER_BLOCKS file blocks,
+    // cluster c covering file blocks c*CLUSTER_BLOCKS on: a cluster either
+    // maps every block its bytes of the file need (all of them, but for the
+    // last cluster) and holds them as they are, or, when that saves a block,
+    // maps only the first few and holds the length of an LZ stream followed
+    // by the stream; a cluster that maps no block is a hole
+    const static uint32_t CLUSTER_BLOCKS     = 4;
+    const static uint32_t CLUSTER_SIZE	     = CLUSTER_BLOCKS*Disk::BLOCK_SIZE;
+
+    // Directories are extendible hash tables: file block 0 holds the header
+    // and the start of the bucket table, which grows through the following
+    // blocks up to 2^MAX_DEPTH entries, and bucket b is file block
+    // BUCKET_START + b
+    const static uint32_t NO_ROOT	     = (uint32_t)-1;
+    const static uint32_t NAME_LENGTH	     = 56;
+    const static uint32_t ENTRIES_PER_BUCKET = 63;
+    const static uint32_t MAX_DEPTH	     = 16;
+    const static uint32_t TABLE_START	     = 4;
+    const static uint32_t BUCKET_START	     = (TABLE_START + (1 << MAX_DEPTH) + POINTERS_PER_BLOCK - 1)/POINTERS_PER_BLOCK;
+
+    struct FsckReport {		// Problems found (and fixed) by fsck
+    	size_t Files;		// Number of valid inodes
+    	size_t Blocks;		// Number of blocks referenced by files
+    	size_t OutOfRange;	// Pointers outside the data region
+    	size_t Duplicates;	// Blocks referenced more than once
+    	size_t PastEnd;		// Blocks mapped past the end of their file
+    	size_t Leaked;		// Blocks marked used in bitmap but not referenced
+    	size_t Unmarked;	// Blocks marked free in bitmap but referenced
+    	size_t Cleared;		// Pointers cleared by repair
+    	size_t Replayed;	// Journal transactions replayed before checking
+    	size_t BadChecksums;	// Blocks failing their checksum
+    	size_t BadEntries;	// Directory entries naming no valid inode
+    	size_t LinkCounts;	// Inodes whose link count differs from their names
+
+    	size_t errors() const {
+    	    return OutOfRange + Duplicates + PastEnd + Leaked + Unmarked + BadChecksums + BadEntries + LinkCounts;
+	}
+    };
+
+    struct Stats {		// Instrumentation of file system calls
+    	OpStats	  Mount;
+    	OpStats	  Create;
+    	OpStats	  Remove;
+    	OpStats	  Stat;
+    	OpStats	  Read;		// Includes readv
+    	OpStats	  Write;
+    	OpStats	  Compress;
+    	OpStats	  Lookup;
+    	OpStats	  Link;
+    	OpStats	  Unlink;
+    	OpStats	  Mkdir;
+    	Histogram AllocSearch;	// Blocks skipped past the goal by each allocation
+    };
+
+    struct Link {		// Name within a directory
+    	std::string Name;	// Name (at most NAME_LENGTH bytes, no '/')
+    	size_t	    Inumber;	// Inode it names
+    };
 
 private:
     struct SuperBlock {		// Superblock structure
@@ -19,47 +162,551 @@ private:
     	uint32_t Blocks;	// Number of blocks in file system
     	uint32_t InodeBlocks;	// Number of blocks reserved for inodes
     	uint32_t Inodes;	// Number of inodes in file system
+    	uint32_t Version;	// On-disk format version (0 for original images)
+    	uint32_t State;		// Whether or not file system was cleanly unmounted
+    	uint32_t BitmapBlocks;	// Number of blocks reserved for free block bitmap
+    	uint32_t InodeHighWater;	// Number of inode blocks ever used (from
+    				// version 3 on; later blocks are never read)
+    	uint32_t RootInode;	// Root directory (from version 4 on; NO_ROOT
+    				// until the first directory is made)
+    	uint32_t JournalBlocks;	// Number of blocks reserved for the journal
+    				// (from version 6 on; 0 for small disks)
+    	uint32_t ChecksumBlocks;	// Number of blocks reserved for the
+    				// checksum table (from version 8 on)
+    	uint32_t DataChecksums;	// Whether or not data blocks are checksummed
+    				// too (from version 8 on)
     };
 
     struct Inode {
-    	uint32_t Valid;		// Whether or not inode is valid
+    	uint32_t Valid;		// Whether or not inode is valid (INODE_VALID,
+    				// flags and number of names)
     	uint32_t Size;		// Size of file
-    	uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
+    	uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers (from version 2
+    					     // on, the last one is the double
+    					     // indirect pointer)
     	uint32_t Indirect;	// Indirect pointer
     };
 
+    // Return data of an INODE_INLINE inode, which fills Direct and Indirect
+    static char *inline_data(Inode *node) { return (char *)node->Direct; }
+
+    struct Stream {		// Sequential access state of an inode
+    	uint32_t NextBlock;	// Block a sequential read would start at
+    	uint32_t Window;	// Number of blocks to read ahead (0 if random)
+    };
+
+    struct Entry {		// Name in a directory bucket (64 bytes)
+    	uint32_t Inumber;	// Inode it names
+    	uint32_t Length;	// Length of name
+    	char	 Name[NAME_LENGTH]; // Name (not terminated)
+    };
+
+    enum {			// Slots of the header at the start of directory file block 0
+    	HEADER_DEPTH   = 0,	// Global depth: the table has 2^depth entries
+    	HEADER_BUCKETS = 1,	// Number of buckets allocated
+    	HEADER_ENTRIES = 2,	// Number of names in directory
+    };
+
+    struct Bucket {		// Directory bucket
+    	uint32_t Depth;		// Number of low hash bits its names share
+    	uint32_t Count;		// Number of entries in use
+    	Entry	 Entries[ENTRIES_PER_BUCKET];
+    };
+
     union Block {
     	SuperBlock  Super;			    // Superblock
     	Inode	    Inodes[INODES_PER_BLOCK];	    // Inode block
     	uint32_t    Pointers[POINTERS_PER_BLOCK];   // Pointer block
+    	uint64_t    Words[WORDS_PER_BLOCK];	    // Bitmap block
+    	Bucket	    Names;			    // Directory bucket
     	char	    Data[Disk::BLOCK_SIZE];	    // Data block
     };
 
-    // TODO: Internal helper functions
+    struct Checker;		// State of one fsck run (see fsck.cpp)
+    struct Directory;		// Directory opened by one call (see directory.cpp)
+
+    struct MapBlock {		// Pointer block loaded during one call
+    	uint32_t BlockNumber;	// Block held in Contents (0 if none)
+    	bool	 Dirty;		// Whether or not Contents must be written back
+    	Block	 Contents;	// Pointers
+    };
+
+    struct Extent {		// Blocks reserved for one write
+    	uint32_t Next;		// Next reserved block to hand out
+    	uint32_t End;		// Block after last reserved block
+    };
+
+    struct Mapping {		// Pointer blocks of an inode loaded during one call
+    	MapBlock Indirect;	// Indirect block
+    	MapBlock Double;	// Double indirect block
+    	MapBlock Second;	// Most recent block pointed to by Double
+
+    	Mapping() { Indirect.BlockNumber = Double.BlockNumber = Second.BlockNumber = 0; }
+    };
+
+    // Return number of bitmap blocks needed for disk of given size
+    static uint32_t bitmap_blocks(uint32_t blocks) {
+    	return (blocks + BITS_PER_BLOCK - 1)/BITS_PER_BLOCK;
+    }
+
+    // Return number of file blocks an inode may map: its size rounded up to
+    // a block, or to a cluster if it is compressed
+    static uint32_t mapped_blocks(const Inode &node) {
+    	uint32_t blocks = ((size_t)node.Size + Disk::BLOCK_SIZE - 1)/Disk::BLOCK_SIZE;
+    	if (node.Valid & INODE_COMPRESSED) {
+    	    blocks = (blocks + CLUSTER_BLOCKS - 1)/CLUSTER_BLOCKS*CLUSTER_BLOCKS;
+	}
+	return blocks;
+    }
+
+    // Return number of blocks cluster of a compressed file needs to hold its
+    // bytes of the file as they are
+    // @param	size	    Size of file
+    // @param	cluster	    Cluster index within file
+    static uint32_t raw_blocks(size_t size, uint32_t cluster) {
+    	size_t start = (size_t)cluster*CLUSTER_SIZE;
+    	size_t bytes = size <= start ? 0 : size - start < CLUSTER_SIZE ? size - start : CLUSTER_SIZE;
+    	return (bytes + Disk::BLOCK_SIZE - 1)/Disk::BLOCK_SIZE;
+    }
+
+    // Return whether or not superblock describes a disk of given size
+    static bool valid_super(const SuperBlock &super, size_t blocks);
+
+    // Rebuild free block bitmap and free inode index by walking every
+    // inode, splitting the inode table across threads (throws if a block
+    // fails its checksum)
+    void scan_free_blocks();
+
+    // Walk a range of the inode table straight from disk, checking every
+    // block read against its checksum (safe to run on several ranges at
+    // once; throws if a block fails its checksum)
+    // @param	first	    First inode block to walk
+    // @param	last	    Inode block after the last one to walk
+    // @param	used	    Set for every block the inodes point to
+    // @param	valid	    Set for every valid inode, two words per inode block
+    void scan_inode_blocks(uint32_t first, uint32_t last, Bitmap *used, std::vector<uint64_t> *valid);
+
+    // Load free block bitmap from bitmap blocks (returns false if one fails
+    // its checksum)
+    bool load_free_blocks();
+
+    // Save free block bitmap to bitmap blocks (with a journal, only the
+    // blocks changed since the last commit, pinned)
+    void save_free_blocks();
+
+    // Save checksum table (with a journal, after taking the checksums of the
+    // pinned blocks about to commit, and pinned along with them)
+    void save_checksums();
+
+    // Record free inodes of inode block in free inode index
+    // @param	block	    Index of inode block within inode table
+    // @param	inodeBlock  Contents of inode block
+    void index_inode_block(uint32_t block, const Block &inodeBlock);
+
+    // Recount free blocks of every allocation region from the bitmap
+    void count_free_regions();
+
+    // Return block to free block bitmap (with a journal, once the running
+    // transaction commits, so a crash cannot leave a block that was freed
+    // and reused still named by the file that freed it)
+    // @param	block	    Block to free
+    void release_block(uint32_t block);
+
+    // Mark block free in free block bitmap (allocLock must be held)
+    // @param	block	    Block to free
+    void free_block(uint32_t block);
+
+    // Mark block used in free block bitmap (allocLock must be held)
+    // @param	block	    Block to take
+    void take_free_block(uint32_t block);
+
+    // Return start of first region with at least the average share of free
+    // blocks, where files with no blocks to follow are placed
+    uint32_t region_goal();
+
+    // Reserve first free run of count blocks at or after goal (wrapping
+    // around); if no run is long enough nothing is reserved and blocks are
+    // taken one at a time from goal on
+    // @param	goal	    Preferred first block (0 picks a region)
+    // @param	count	    Number of blocks needed
+    Extent reserve_extent(uint32_t goal, uint32_t count);
+
+    // Return next block of extent, allocating past it once it runs out
+    // (returns 0 if the disk is full)
+    // @param	extent	    Blocks reserved for the current write
+    uint32_t take_block(Extent *extent);
+
+    // Free blocks of extent that were never handed out
+    // @param	extent	    Blocks reserved for the current write
+    void release_extent(Extent *extent);
+
+    // Return first free inode, scanning inode blocks not indexed yet
+    ssize_t allocate_free_inode();
+
+    // Zero inode blocks from the high-water mark up to end, then raise the
+    // mark in the superblock
+    // @param	end	    Inode block after the last one to initialize
+    void initialize_inode_blocks(uint32_t end);
+
+    // Return number of direct pointers in each inode
+    uint32_t direct_pointers() const {
+    	return this->version >= 2 ? POINTERS_PER_INODE - 1 : POINTERS_PER_INODE;
+    }
+
+    // Return largest number of blocks a file can map
+    size_t max_file_blocks() const;
+
+    // Return contents of pointer block, loading it into map if necessary
+    // (writing back the block it held before if dirty)
+    // @param	map	    Slot to load block into
+    // @param	block	    Pointer block to load
+    Block *load_map(MapBlock *map, uint32_t block);
+
+    // Allocate zeroed pointer block from extent and load it into map
+    // @param	map	    Slot to load block into
+    // @param	extent	    Blocks reserved for the current write
+    uint32_t allocate_map(MapBlock *map, Extent *extent);
+
+    // Write back dirty pointer blocks of mapping
+    void flush_mapping(Mapping *mapping);
+
+    // Write bytes within one WRITE_PIECE of a file as one transaction
+    // (returns number of bytes written, or -1 on error)
+    ssize_t write_piece(size_t inumber, char *data, size_t length, size_t offset);
+
+    // Move data of an inline inode into the first block of the file
+    // (returns false, leaving the inode unchanged, if the disk is full)
+    bool migrate_inline(Inode *node);
+
+    // Return data block holding given block of inode (0 if unallocated)
+    // @param	node	    Inode to map
+    // @param	index	    Block index within file
+    // @param	mapping	    Pointer blocks loaded so far
+    uint32_t lookup_block(Inode *node, uint32_t index, Mapping *mapping);
+
+    // Allocate data block for given block of inode, allocating any missing
+    // pointer blocks first (returns 0 if the disk is full)
+    // @param	node	    Inode to map
+    // @param	index	    Block index within file
+    // @param	mapping	    Pointer blocks loaded so far
+    // @param	extent	    Blocks reserved for the current write
+    uint32_t allocate_block(Inode *node, uint32_t index, Mapping *mapping, Extent *extent);
+
+    // Clear pointer to given block of inode, returning the block it named
+    // (0 if unallocated); the block is not freed
+    // @param	node	    Inode to unmap from
+    // @param	index	    Block index within file
+    // @param	mapping	    Pointer blocks loaded so far
+    uint32_t unmap_block(Inode *node, uint32_t index, Mapping *mapping);
+
+    // Return number of pointer blocks missing to map blocks first to last
+    uint32_t missing_maps(Inode *node, uint32_t first, uint32_t last, Mapping *mapping);
+
+    // Free pointer block and every block it points to
+    // @param	block	    Pointer block
+    // @param	depth	    1 for an indirect block, 2 for a double indirect block
+    void release_tree(uint32_t block, uint32_t depth);
+
+    // Mark pointer block and every block it points to as used
+    // @param	block	    Pointer block
+    // @param	depth	    1 for an indirect block, 2 for a double indirect block
+    // @param	used	    Set for every block visited
+    void scan_tree(uint32_t block, uint32_t depth, Bitmap *used);
+
+    // Detect sequential access and read ahead the blocks after a read
+    // @param	inumber		Inode that was read
+    // @param	node		Inode contents
+    // @param	first		First block of the read
+    // @param	last		Last block of the read
+    // @param	mapping		Pointer blocks loaded so far
+    void readahead(size_t inumber, Inode *node, uint32_t first, uint32_t last, Mapping *mapping);
+
+    // Wait for asynchronous disk requests, rethrowing the first error
+    // @param	pending	    Requests submitted by the current call
+    void wait_all(std::deque<Disk::Request> &pending);
+
+    // Write superblock with given state
+    void write_state(uint32_t state);
+
+    // Write superblock with new inode high-water mark
+    // @param	end	    First inode block never used
+    void write_high_water(uint32_t end);
+
+    // Write superblock with new root directory
+    // @param	inumber	    Root directory (or NO_ROOT)
+    void write_root(uint32_t inumber);
+
+    // Read block of file, zero filled if it is a hole
+    // @param	node	    Inode of file
+    // @param	index	    Block index within file
+    // @param	block	    Filled in with contents
+    // @param	mapping	    Pointer blocks loaded so far
+    void read_file_block(Inode *node, uint32_t index, Block *block, Mapping *mapping);
+
+    // Write whole block of file, allocating it if needed and growing the
+    // file to cover it (returns false if the disk is full)
+    // @param	node	    Inode of file
+    // @param	index	    Block index within file
+    // @param	block	    Contents to write
+    // @param	mapping	    Pointer blocks loaded so far
+    bool write_file_block(Inode *node, uint32_t index, Block *block, Mapping *mapping);
+
+    // Read whole cluster of a compressed file, zero filled if it is a hole
+    // (returns false if its stream is corrupt)
+    // @param	node	    Inode of file
+    // @param	cluster	    Cluster index within file
+    // @param	data	    Buffer of CLUSTER_SIZE bytes to read into
+    // @param	mapping	    Pointer blocks loaded so far
+    bool read_cluster(Inode *node, uint32_t cluster, char *data, Mapping *mapping);
+
+    // Write whole cluster of a compressed file, compressed if that saves a
+    // block at the size of the file both before and after the write, so it
+    // reads back whichever size the write leaves (returns false, leaving the
+    // cluster as it was, if the disk is full)
+    // @param	node	    Inode of file (at its size before the write)
+    // @param	cluster	    Cluster index within file
+    // @param	data	    CLUSTER_SIZE bytes to write
+    // @param	mapping	    Pointer blocks loaded so far
+    // @param	size	    Size of file once the write is done
+    bool write_cluster(Inode *node, uint32_t cluster, char *data, Mapping *mapping, size_t size);
+
+    // Copy bytes of a compressed file into buffers, decompressing each
+    // cluster the range touches once (returns -1 if a cluster is corrupt)
+    ssize_t read_compressed(Inode *node, const struct iovec *iov, int iovcnt, size_t offset, Mapping *mapping);
+
+    // Write bytes of a compressed file, rebuilding every cluster the range
+    // touches (returns number of bytes written before the disk filled up)
+    size_t write_compressed(Inode *node, char *data, size_t length, size_t offset, Mapping *mapping);
+
+    // Free inode and every block it maps
+    // @param	inumber	    Inode to remove
+    // @param	force	    Whether or not to remove it even if it is a
+    //			    directory or still has names (unlink and mkdir
+    //			    keep names in step themselves)
+    bool remove_inode(size_t inumber, bool force);
+
+    // Create empty file, as create does but without counting or tracing
+    // the call (for calls that make inodes)
+    ssize_t create_inode();
+
+    // Create empty directory that no name refers to yet
+    ssize_t make_directory();
+
+    // Add name for inode to directory, counting it in the inode (any inode,
+    // so mkdir can name a new directory)
+    bool add_link(size_t dir, const char *name, size_t inumber);
+
+    // Return inode named in directory (-1 if not found), as lookup does but
+    // without counting or tracing the call (for calls that look names up)
+    ssize_t find_name(size_t dir, const char *name);
+
+    // Add delta to number of names of inode, returning the new number (or
+    // -1 if the inode is invalid or the number would overflow)
+    ssize_t adjust_links(size_t inumber, int delta);
+
+    // Return whether or not name can be stored in a directory
+    static bool valid_name(const char *name);
+
+    // Return hash of name that picks its bucket
+    static uint32_t hash_name(const char *name, size_t length);
+
+    // Return whether or not blocks written to the cache must stay pinned
+    // until the next commit
+    bool journaled() const { return this->journal != nullptr; }
+
+    // Commit running transaction (transactionLock must be held exclusively)
+    void commit_locked();
+
+    // Return number of pinned blocks at which a transaction is committed
+    size_t commit_threshold() const;
+
+    // Return whether or not the journal has room for the running
+    // transaction with the given number of calls in it
+    bool transaction_fits(size_t calls) const;
+
+    // Free as many blocks released by the running transaction as change at
+    // most room bitmap and checksum table blocks (allocLock must be held)
+    void free_released(size_t room);
+
+    // Return reader/writer lock guarding inode
+    pthread_rwlock_t *inode_lock(size_t inumber) {
+    	return &this->inodeLocks[inumber%INODE_LOCKS];
+    }
 
     // TODO: Internal member variables
     uint32_t    numBlocks;
     uint32_t    inodeBlocks;
     uint32_t    inodes;
-    bool*       freeBlocks;
+    uint32_t    version;
+    uint32_t    bitmapBlocks;
+    uint32_t    journalBlocks;
+    uint32_t    checksumBlocks;
+    bool        dataChecksums;                // Whether or not data blocks are checksummed
+    Bitmap      freeBlocks;
+    std::vector<bool> bitmapDirty;          // Bitmap blocks changed since the last commit
+    std::atomic<size_t> dirtyBitmapBlocks;  // Number of them
+    std::vector<uint32_t> releasedBlocks;   // Blocks freed by the running transaction
+    std::vector<uint32_t> regionFree;       // Free blocks per allocation region
+    Bitmap      freeInodes;
+    std::vector<uint32_t> freeInodeCounts;  // Free inodes per inode block (or UNSCANNED)
+    uint32_t    nextUnscanned;              // First inode block not indexed yet
+    uint32_t    inodeHighWater;             // First inode block never used
+    uint32_t    rootInode;                  // Root directory (or NO_ROOT)
+    Block       superBlock;                 // Superblock as last written
+    std::unordered_map<size_t, Stream> streams; // Sequential access state per inode
+
+    pthread_rwlock_t inodeLocks[INODE_LOCKS];   // Inode locks, by inumber%INODE_LOCKS
+    std::mutex  allocLock;                      // Guards freeBlocks and regionFree
+    std::mutex  inodeIndexLock;                 // Guards free inode index
+    std::mutex  streamLock;                     // Guards streams
+    std::mutex  namespaceLock;                  // Serializes directory changes
+    std::mutex  superLock;                      // Guards superBlock and its writes
+    pthread_rwlock_t transactionLock;           // Held shared by calls, exclusively by commit
+    std::atomic<uint64_t> lastCommit;           // Steady clock nanoseconds at the last commit
+    std::atomic<size_t> activeCalls;            // Calls in the running transaction
+    Stats       opStats;                        // Call counts and latencies
     
     Disk *      disk = {0};
+    Cache *     cache = {0};
+    Journal *   journal = {0};
+    Checksums * checksums = {0};
+    Trace *     tracer = {0};
+    size_t      cacheBlocks;
 
 public:
+    // Constructor
+    // @param	cacheBlocks Number of blocks to keep in the block cache
+    FileSystem(size_t cacheBlocks = Cache::DEFAULT_CAPACITY);
+
+    // Destructor (unmounts file system)
+    ~FileSystem();
+
     static void debug(Disk *disk);
-    static bool format(Disk *disk);
+
+    // Format disk; a lazy format punches out every block instead of zeroing
+    // it, leaving only the superblock and free block bitmap to be written
+    // @param	disk	    Disk to format
+    // @param	lazy	    Whether or not to release blocks instead of zeroing
+    // @param	data	    Whether or not to checksum data blocks as well as
+    //			    metadata
+    static bool format(Disk *disk, bool lazy = false, bool data = false);
+
+    // Check consistency of an unmounted file system, optionally repairing it
+    // by clearing bad pointers and rewriting the free block bitmap
+    // @param	disk	    Disk holding file system
+    // @param	repair	    Whether or not to fix problems found
+    // @param	report	    Filled in with problems found
+    static bool fsck(Disk *disk, bool repair, FsckReport *report);
 
     bool mount(Disk *disk);
+    void unmount();
+
+    // Commit running transaction, then write every cached block home (with
+    // a journal, does nothing within a transaction)
+    void sync();
+
+    // Open a transaction (or join the one the calling thread has open on
+    // this file system): changes made until the matching end_transaction
+    // commit together
+    void begin_transaction();
+
+    // Close transaction; the outermost close commits once enough blocks
+    // are waiting, so many calls share one journal write
+    void end_transaction();
+
+    // Commit running transaction to the journal now (without a journal,
+    // write every cached block home); must not be called within a
+    // transaction
+    void commit();
     
     void initialize_inode(Inode* node);
     bool load_inode(size_t inumber, Inode *node);   
     bool save_inode(size_t inumber, Inode *node);
-    size_t allocate_free_block();
+    size_t allocate_free_block(size_t goal = 0);
  
     ssize_t create();
+
+    // Remove inode and free its blocks; fails for a directory or an inode
+    // that still has names, which only unlink removes
     bool    remove(size_t inumber);
     ssize_t stat(size_t inumber);
 
     ssize_t read(size_t inumber, char *data, size_t length, size_t offset);
+    ssize_t readv(size_t inumber, const struct iovec *iov, int iovcnt, size_t offset);
     ssize_t write(size_t inumber, char *data, size_t length, size_t offset);
+
+    // Store data of an empty file in compressed clusters from now on (needs
+    // a version 7 file system; directories are never compressed)
+    // @param	inumber	    File to compress
+    bool compress(size_t inumber);
+
+    // Return average extent length (in blocks) over all files, counting a
+    // new extent wherever a file's next block does not follow its last one
+    // @param	files	    If given, set to number of files
+    // @param	blocks	    If given, set to number of data blocks
+    // @param	extents	    If given, set to number of extents
+    double fragmentation(size_t *files = nullptr, size_t *blocks = nullptr, size_t *extents = nullptr);
+
+    // Return root directory (-1 if there is none), making an empty one first
+    // if asked; directories need a version 4 file system
+    // @param	create	    Whether or not to make the root if missing
+    ssize_t root(bool create = false);
+
+    // Return inode named in directory (-1 if not found)
+    // @param	dir	    Directory inode
+    // @param	name	    Name within directory
+    ssize_t lookup(size_t dir, const char *name);
+
+    // Add another name for an inode; every name counts toward the inode
+    // @param	dir	    Directory inode
+    // @param	name	    Name to add (fails if already present)
+    // @param	inumber	    Inode to name (must not be a directory)
+    bool link(size_t dir, const char *name, size_t inumber);
+
+    // Remove name from directory, removing the inode along with its last
+    // name (a directory must be empty)
+    // @param	dir	    Directory inode
+    // @param	name	    Name to remove
+    bool unlink(size_t dir, const char *name);
+
+    // Make empty directory and name it in dir, returning its inode
+    // @param	dir	    Directory inode
+    // @param	name	    Name of new directory
+    ssize_t mkdir(size_t dir, const char *name);
+
+    // Return every name in directory, in hash order
+    // @param	dir	    Directory inode
+    // @param	links	    Filled in with names
+    bool readdir(size_t dir, std::vector<Link> *links);
+
+    // Return whether or not inode is a valid directory
+    bool is_directory(size_t inumber);
+
+    // Return call statistics (kept across mounts)
+    const Stats &stats() const { return this->opStats; }
+
+    // Return block cache of mounted file system (nullptr if not mounted)
+    const Cache *block_cache() const { return this->cache; }
+
+    // Return journal of mounted file system (nullptr if it has none)
+    const Journal *metadata_journal() const { return this->journal; }
+
+    // Return checksum table of mounted file system (nullptr if it has none)
+    const Checksums *checksum_table() const { return this->checksums; }
+
+    // Clear call statistics and those of the block cache and checksum table
+    void reset_stats();
+
+    // Record every file system call into trace (nullptr stops tracing)
+    void set_trace(Trace *trace) { this->tracer = trace; }
+};
+
+// Holds a transaction open until the end of the enclosing scope
+class TransactionGuard {
+public:
+    TransactionGuard(FileSystem *fs) : FS(fs) { FS->begin_transaction(); }
+    ~TransactionGuard() { FS->end_transaction(); }
+
+private:
+    FileSystem *FS;
 };
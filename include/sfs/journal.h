@@ -0,0 +1,123 @@
+// journal.h: Write-ahead journal of metadata blocks
+
+#pragma once
+
+#include "sfs/cache.h"
+#include "sfs/disk.h"
+
+#include <stdint.h>
+
+#include <unordered_set>
+#include <vector>
+
+// The journal is a region of the disk: its first block is a header naming
+// the oldest transaction that may not have reached home yet, and every
+// transaction after it is a descriptor block followed by the images of the
+// blocks it changes, written with one sequential request. Once the journal
+// fills up, every logged block is written home (a checkpoint) and the
+// journal starts over from its first transaction slot.
+//
+// A journal is not safe to share between threads; the file system calls it
+// with its transaction lock held exclusively (or under its allocator lock
+// for revoke).
+
+class Journal {
+public:
+    const static uint32_t MAGIC_NUMBER	     = 0x4a534653;	// "SFSJ"
+    const static uint32_t MIN_BLOCKS	     = 16;
+    const static uint32_t MAX_BLOCKS	     = 1024;
+    const static uint32_t DESCRIPTOR_ENTRIES = (Disk::BLOCK_SIZE - 24)/sizeof(uint32_t);
+
+private:
+    struct Header {		// First block of journal
+    	uint32_t MagicNumber;	// Journal magic number
+    	uint32_t Start;		// Offset of the first transaction to replay
+    	uint64_t Sequence;	// Sequence number of the transaction at Start
+    };
+
+    struct Descriptor {		// First block of every transaction
+    	uint32_t MagicNumber;	// Journal magic number
+    	uint32_t Count;		// Number of block images after the descriptor
+    	uint64_t Sequence;	// Sequence number of transaction
+    	uint32_t Revoked;	// Number of revoked blocks after the targets
+    	uint32_t Checksum;	// Checksum of descriptor and block images
+    	uint32_t Blocks[DESCRIPTOR_ENTRIES];	// Home of each image, then
+    						// blocks revoked by transaction
+    };
+
+    union Block {
+    	Header	   Head;
+    	Descriptor Describe;
+    	char	   Data[Disk::BLOCK_SIZE];
+    };
+
+    Disk *	Device;	    // Disk holding journal
+    uint32_t	Start;	    // First block of journal on disk
+    uint32_t	Size;	    // Number of blocks in journal (header included)
+    uint32_t	Head;	    // Offset the next transaction is written at
+    uint64_t	Sequence;   // Sequence number of the next transaction
+    std::unordered_set<uint32_t> Logged;    // Blocks logged since the last checkpoint
+    std::vector<uint32_t>	 Revokes;   // Blocks revoked by the next transaction
+
+    size_t	Commits;	// Number of transactions committed
+    size_t	LoggedBlocks;	// Number of block images written to the journal
+    size_t	Checkpoints;	// Number of checkpoints
+    size_t	Replayed;	// Number of transactions replayed by recover
+
+    // Return checksum of descriptor (with its checksum field zeroed) and of
+    // the block images following it
+    static uint32_t checksum(const Block &descriptor, const char *images, size_t count);
+
+    // Write header naming the transaction at offset as the first to replay
+    void write_header(uint32_t offset, uint64_t sequence);
+
+public:
+    // Return number of journal blocks for a disk of given size (0 if the
+    // disk is too small to be worth journaling)
+    static uint32_t blocks_for(uint32_t blocks);
+
+    // Write an empty journal
+    // @param	disk	    Disk to write journal to
+    // @param	start	    First block of journal
+    // @param	blocks	    Number of blocks in journal
+    static void format(Disk *disk, uint32_t start, uint32_t blocks);
+
+    // Constructor
+    // @param	disk	    Disk holding journal
+    // @param	start	    First block of journal
+    // @param	blocks	    Number of blocks in journal
+    Journal(Disk *disk, uint32_t start, uint32_t blocks);
+
+    // Write the blocks of every complete transaction home, skipping blocks
+    // a later transaction revoked, then empty the journal; returns the
+    // number of transactions replayed
+    // Throws runtime_error exception if the header is not a journal's.
+    size_t recover();
+
+    // Write every pinned block of cache to the journal as one transaction,
+    // after the file data the cache holds, then release them to be written
+    // home by a later checkpoint
+    // @param	cache	    Cache holding the transaction
+    //
+    // Throws runtime_error exception if the transaction holds more blocks
+    // than capacity(); the caller must commit before that.
+    void commit(Cache *cache);
+
+    // Write every committed block home and empty the journal
+    // @param	cache	    Cache holding committed blocks
+    void checkpoint(Cache *cache);
+
+    // Keep an image of block logged by an earlier transaction from being
+    // replayed over its next contents, once it is freed
+    // @param	block	    Block being freed
+    void revoke(uint32_t block);
+
+    // Return number of blocks one transaction can hold
+    uint32_t capacity() const { return Size - 2 < DESCRIPTOR_ENTRIES ? Size - 2 : DESCRIPTOR_ENTRIES; }
+
+    // Return journal statistics
+    size_t commits() const	 { return Commits; }
+    size_t logged_blocks() const { return LoggedBlocks; }
+    size_t checkpoints() const	 { return Checkpoints; }
+    size_t replayed() const	 { return Replayed; }
+};
@@ -0,0 +1,36 @@
+// lz.h: Fast LZ77 compression of buffers
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+// The compressed stream is a series of sequences, each a token byte (the
+// number of literals in its high four bits and the match length less
+// MIN_MATCH in its low four, 15 meaning more length bytes follow), the
+// literals, then a two byte little endian offset back into the output. The
+// last sequence has literals only and ends the stream.
+
+class LZ {
+public:
+    const static size_t MIN_MATCH  = 4;
+    const static size_t MAX_OFFSET = 65535;
+    const static size_t HASH_BITS  = 12;
+
+    // Compress buffer, returning length of the stream (0 if it would not
+    // fit in capacity bytes)
+    // @param	source	    Bytes to compress
+    // @param	length	    Number of bytes to compress
+    // @param	destination Buffer to hold stream
+    // @param	capacity    Size of destination
+    static size_t compress(const char *source, size_t length, char *destination, size_t capacity);
+
+    // Decompress stream, returning number of bytes produced (-1 if the
+    // stream is corrupt or would overflow capacity bytes)
+    // @param	source	    Compressed stream
+    // @param	length	    Length of stream
+    // @param	destination Buffer to hold bytes
+    // @param	capacity    Size of destination
+    static ssize_t decompress(const char *source, size_t length, char *destination, size_t capacity);
+};
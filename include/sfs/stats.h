@@ -0,0 +1,82 @@
+// stats.h: Call counters and latency histograms
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+
+// Every counter is a relaxed atomic, so recording from several threads
+// needs no lock and costs a few uncontended increments
+
+class Histogram {
+public:
+    // Number of buckets (bucket 0 holds zero)
+    const static size_t BUCKETS = 64;
+
+private:
+    std::atomic<uint64_t> Buckets[BUCKETS];	// Bucket i counts values in [2^(i-1), 2^i)
+    std::atomic<uint64_t> Count;	// Number of values recorded
+    std::atomic<uint64_t> Total;	// Sum of values recorded
+    std::atomic<uint64_t> Max;		// Largest value recorded
+
+public:
+    // Constructor
+    Histogram() { reset(); }
+
+    // Record one value
+    // @param	value	    Value to count
+    void record(uint64_t value);
+
+    // Clear all buckets
+    void reset();
+
+    // Return upper bound of the bucket holding the given percentile (the
+    // exact maximum for 100)
+    // @param	p	    Percentile between 0 and 100
+    uint64_t percentile(double p) const;
+
+    // Return histogram contents
+    uint64_t count() const  { return Count.load(std::memory_order_relaxed); }
+    uint64_t total() const  { return Total.load(std::memory_order_relaxed); }
+    uint64_t max() const    { return Max.load(std::memory_order_relaxed); }
+    uint64_t bucket(size_t i) const { return Buckets[i].load(std::memory_order_relaxed); }
+};
+
+struct OpStats {		// Calls to one operation
+    std::atomic<uint64_t> Calls;	// Number of calls
+    std::atomic<uint64_t> Bytes;	// Bytes moved by calls
+    Histogram		  Latency;	// Nanoseconds per call
+
+    OpStats() { reset(); }
+
+    // Record one call
+    // @param	nanoseconds Time the call took
+    // @param	bytes	    Bytes the call moved
+    void record(uint64_t nanoseconds, uint64_t bytes);
+
+    // Clear counters and histogram
+    void reset();
+};
+
+// Times the enclosing scope and records it as one call
+class OpTimer {
+private:
+    OpStats *	Stats;
+    uint64_t	Bytes;
+    std::chrono::steady_clock::time_point Start;
+
+public:
+    OpTimer(OpStats *stats, uint64_t bytes = 0)
+    	: Stats(stats), Bytes(bytes), Start(std::chrono::steady_clock::now()) {}
+
+    ~OpTimer() {
+    	auto elapsed = std::chrono::steady_clock::now() - Start;
+    	Stats->record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), Bytes);
+    }
+
+    // Set number of bytes the call moved
+    void set_bytes(uint64_t bytes) { Bytes = bytes; }
+};
@@ -0,0 +1,141 @@
+// trace.h: Binary trace of disk transfers and file system calls
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A call given a name (lookup, link, unlink, mkdir) is followed on disk by
+// the name, Length bytes padded with zeros to a multiple of 8
+
+struct TraceRecord {		// One traced call (40 bytes on disk)
+    uint64_t Time;		// Nanoseconds from start of trace to start of call
+    uint32_t Duration;		// Nanoseconds the call took (saturated)
+    uint16_t Type;		// Kind of call (Trace::DISK_READ, ...)
+    uint16_t Reserved;		// Always zero
+    uint32_t Target;		// Block number, inode number or directory inode
+    uint32_t Length;		// Number of blocks or bytes requested, or length of name
+    uint64_t Offset;		// Byte offset within file (inode to name for link)
+    int64_t  Result;		// Value returned (-1 on failure)
+};
+
+class Trace {
+public:
+    const static uint32_t MAGIC_NUMBER = 0x54534653;	// "SFST"
+    const static uint32_t VERSION      = 2;	// Version 1 has no names
+
+    // Kinds of calls
+    const static uint16_t DISK_READ    = 1;
+    const static uint16_t DISK_WRITE   = 2;
+    const static uint16_t MOUNT	       = 3;
+    const static uint16_t UNMOUNT      = 4;
+    const static uint16_t SYNC	       = 5;
+    const static uint16_t CREATE       = 6;
+    const static uint16_t REMOVE       = 7;
+    const static uint16_t STAT	       = 8;
+    const static uint16_t READ	       = 9;
+    const static uint16_t WRITE	       = 10;
+    const static uint16_t ROOT	       = 11;	// Target is 1 if asked to make the root
+    const static uint16_t LOOKUP       = 12;
+    const static uint16_t LINK	       = 13;
+    const static uint16_t UNLINK       = 14;
+    const static uint16_t MKDIR	       = 15;
+    const static uint16_t COMPRESS     = 16;
+    const static uint16_t TYPES	       = 17;
+
+private:
+    struct Header {		// Start of every trace file
+    	uint32_t MagicNumber;	// Trace magic number
+    	uint32_t Version;	// Trace format version
+    	uint32_t RecordSize;	// Size of each record
+    	uint32_t Reserved;	// Always zero
+    };
+
+    FILE *	Stream;	    // Trace file (nullptr if closed)
+    size_t	Records;    // Number of records written
+    std::mutex	Lock;	    // Serializes writers
+    std::chrono::steady_clock::time_point Start;    // Time trace was opened
+
+public:
+    // Constructor
+    Trace() : Stream(nullptr), Records(0) {}
+
+    // Destructor (closes trace)
+    ~Trace() { close(); }
+
+    // Create trace file, starting the trace clock
+    // @param	path	    Path to trace file
+    // Throws runtime_error exception on error.
+    void open(const char *path);
+
+    // Flush and close trace file
+    void close();
+
+    // Return nanoseconds since the trace was opened
+    uint64_t now() const;
+
+    // Append record to trace (safe to call from several threads)
+    // @param	record	    Record to append
+    // @param	name	    Name the call was given (record.Length bytes), if any
+    void record(const TraceRecord &record, const char *name = nullptr);
+
+    // Return number of records written
+    size_t records() const { return Records; }
+
+    // Return name of kind of call
+    // @param	type	    Kind of call
+    static const char *name(uint16_t type);
+
+    // Return whether or not records of kind of call are followed by a name
+    // @param	type	    Kind of call
+    static bool named(uint16_t type) { return type >= LOOKUP && type <= MKDIR; }
+
+    // Read every record of a trace file
+    // @param	path	    Path to trace file
+    // @param	records	    Filled in with records, in order of completion
+    // @param	names	    If given, filled in with the name of each record
+    //			    (empty for calls given none)
+    // Throws runtime_error exception on error.
+    static void load(const char *path, std::vector<TraceRecord> *records, std::vector<std::string> *names = nullptr);
+};
+
+// Records the enclosing call into a trace, if there is one; without a trace
+// it costs a single test
+class TraceScope {
+private:
+    Trace *	Log;
+    TraceRecord Record;
+    const char *Name;	// Name the call was given (nullptr if none)
+
+public:
+    TraceScope(Trace *trace, uint16_t type, uint32_t target, uint32_t length = 0, uint64_t offset = 0) : Log(trace), Name(nullptr) {
+    	if (Log) {
+    	    Record = TraceRecord{Log->now(), 0, type, 0, target, length, offset, -1};
+	}
+    }
+
+    ~TraceScope() {
+    	if (Log) {
+    	    uint64_t elapsed = Log->now() - Record.Time;
+    	    Record.Duration  = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+    	    Log->record(Record, Name);
+	}
+    }
+
+    // Set value the call returned
+    void set_result(int64_t result) { Record.Result = result; }
+
+    // Set name the call was given (which must outlive the scope)
+    void set_name(const char *name) {
+    	if (Log) {
+    	    Name	  = name;
+    	    Record.Length = strlen(name);
+	}
+    }
+};
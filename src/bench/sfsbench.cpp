@@ -0,0 +1,547 @@
+// sfsbench.cpp: File system benchmarks (results printed as JSON)
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Constants
+
+const size_t IO_SIZES[]	     = {4096, 65536, 1048576};	// Sizes of sequential reads and writes
+const size_t RANDOM_MAX_SIZE = 65536;			// Largest size of random reads and writes
+const size_t FRAGMENT_FILE   = 4*Disk::BLOCK_SIZE;	// Size of files that fragment the disk
+const size_t TINY_FILE	     = 16;			// Size of files small enough to inline
+const size_t TEXT_IO_SIZE    = 65536;			// Size of reads and writes of text files
+const size_t TEXT_LINES	     = 4096;			// Lines of text generated per write
+const size_t STATE_OFFSET    = 5*sizeof(uint32_t);	// Offset of clean flag in superblock
+
+// Amount of work done by one run
+
+struct Scale {
+    const char *	Name;
+    size_t		ImageBlocks;	// Blocks in image used by file benchmarks
+    size_t		Files;		// Files created, stat'ed and removed
+    size_t		FileSize;	// Bytes in file read and written
+    size_t		RandomOps;	// Random reads or writes per size
+    std::vector<size_t> MountBlocks;	// Image sizes mount is timed on
+    size_t		Mounts;		// Mounts timed per image
+    size_t		Names;		// Names linked, looked up and unlinked in one directory
+};
+
+const Scale FULL_SCALE  = {"full",  32768, 4096, 64 << 20, 4096, {4096, 16384, 65536, 262144}, 5, 100000};
+const Scale QUICK_SCALE = {"quick", 4096,  256,  4 << 20,  256,  {1024, 4096},	      2, 4096};
+
+// Measurements of one benchmark
+
+struct Result {
+    std::string		Name;
+    size_t		Ops;
+    size_t		Bytes;		// Bytes read or written
+    double		Seconds;	// Time spent in measured calls
+    std::vector<double> Latencies;	// Microseconds per call
+    size_t		Reads;		// Disk blocks read by measured calls
+    size_t		Writes;		// Disk blocks written by measured calls
+    std::vector<std::pair<std::string, double>> Extra;	// Benchmark specific values
+};
+
+// Globals
+
+std::vector<Result> Results;
+size_t		    Errors = 0;
+
+// Functions
+
+double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Run op ops times, timing each call and counting the disk blocks it moves;
+// setup (if given) runs untimed before each call, and a final sync is
+// charged to the benchmark so written blocks are counted
+Result &measure(const std::string &name, Disk &disk, FileSystem *fs, size_t ops,
+		std::function<ssize_t(size_t)> op, std::function<void(size_t)> setup = nullptr) {
+    Results.emplace_back();
+    Result &result = Results.back();
+    result.Name    = name;
+    result.Ops	   = ops;
+    result.Bytes   = 0;
+    result.Seconds = 0;
+    result.Reads   = 0;
+    result.Writes  = 0;
+
+    for (size_t i = 0; i < ops; i++) {
+    	if (setup) {
+    	    setup(i);
+	}
+
+	size_t	reads  = disk.reads();
+	size_t	writes = disk.writes();
+	double	start  = now();
+	ssize_t bytes  = op(i);
+	double	stop   = now();
+
+	if (bytes < 0) {
+	    Errors++;
+	} else {
+	    result.Bytes += bytes;
+	}
+	result.Latencies.push_back((stop - start)*1e6);
+	result.Seconds += stop - start;
+	result.Reads   += disk.reads() - reads;
+	result.Writes  += disk.writes() - writes;
+    }
+
+    if (fs) {
+	size_t	reads  = disk.reads();
+	size_t	writes = disk.writes();
+	double	start  = now();
+	fs->sync();
+	result.Seconds += now() - start;
+	result.Reads   += disk.reads() - reads;
+	result.Writes  += disk.writes() - writes;
+    }
+    return result;
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+    	return 0;
+    }
+    size_t rank = (size_t)ceil(p/100*sorted.size());
+    return sorted[std::max(rank, (size_t)1) - 1];
+}
+
+void print_results(FILE *stream, const Scale &scale) {
+    fprintf(stream, "{\n");
+    fprintf(stream, "  \"scale\": \"%s\",\n", scale.Name);
+    fprintf(stream, "  \"errors\": %lu,\n", Errors);
+    fprintf(stream, "  \"benchmarks\": [\n");
+    for (size_t i = 0; i < Results.size(); i++) {
+    	Result &result = Results[i];
+    	std::vector<double> sorted(result.Latencies);
+    	std::sort(sorted.begin(), sorted.end());
+
+    	double seconds = result.Seconds > 0 ? result.Seconds : 1e-9;
+    	fprintf(stream, "    {\"name\": \"%s\", \"ops\": %lu, \"bytes\": %lu, \"seconds\": %.6f, ",
+    		result.Name.c_str(), result.Ops, result.Bytes, result.Seconds);
+    	fprintf(stream, "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, ",
+    		result.Ops/seconds, result.Bytes/seconds/(1 << 20));
+    	fprintf(stream, "\"latency_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f}, ",
+    		percentile(sorted, 50), percentile(sorted, 90), percentile(sorted, 99), percentile(sorted, 100));
+    	fprintf(stream, "\"disk_reads\": %lu, \"disk_writes\": %lu", result.Reads, result.Writes);
+    	for (auto &extra : result.Extra) {
+    	    fprintf(stream, ", \"%s\": %.2f", extra.first.c_str(), extra.second);
+	}
+	fprintf(stream, "}%s\n", i + 1 < Results.size() ? "," : "");
+    }
+    fprintf(stream, "  ]\n");
+    fprintf(stream, "}\n");
+}
+
+void open_image(Disk &disk, FileSystem &fs, const std::string &path, size_t blocks, bool dataChecksums = false) {
+    disk.open(path.c_str(), blocks);
+    if (!FileSystem::format(&disk, true, dataChecksums) || !fs.mount(&disk)) {
+    	throw std::runtime_error("unable to format and mount " + path);
+    }
+}
+
+// create, stat and remove, then reads and writes of one file at each size
+void bench_files(const Scale &scale, const std::string &path) {
+    Disk       disk;
+    FileSystem fs;
+    open_image(disk, fs, path, scale.ImageBlocks);
+
+    std::vector<ssize_t> inodes(scale.Files);
+    measure("create", disk, &fs, scale.Files, [&](size_t i) {
+    	inodes[i] = fs.create();
+    	return inodes[i] < 0 ? -1 : 0;
+    });
+    measure("stat", disk, &fs, scale.Files, [&](size_t i) {
+    	return fs.stat(inodes[i]) < 0 ? -1 : 0;
+    });
+    measure("remove", disk, &fs, scale.Files, [&](size_t i) {
+    	return fs.remove(inodes[i]) ? 0 : -1;
+    });
+
+    std::vector<char> buffer(IO_SIZES[sizeof(IO_SIZES)/sizeof(IO_SIZES[0]) - 1]);
+    for (size_t i = 0; i < buffer.size(); i++) {
+    	buffer[i] = (char)(i*7);
+    }
+
+    std::mt19937 random(1);
+    for (size_t size : IO_SIZES) {
+    	std::string suffix = "_" + std::to_string(size/1024) + "k";
+    	size_t	    ops	   = scale.FileSize/size;
+    	ssize_t	    file   = fs.create();
+
+    	measure("write_seq" + suffix, disk, &fs, ops, [&](size_t i) {
+    	    return fs.write(file, buffer.data(), size, i*size);
+	});
+	measure("read_seq" + suffix, disk, &fs, ops, [&](size_t i) {
+	    return fs.read(file, buffer.data(), size, i*size);
+	});
+
+	if (size <= RANDOM_MAX_SIZE) {
+	    measure("write_rand" + suffix, disk, &fs, scale.RandomOps, [&](size_t) {
+	    	return fs.write(file, buffer.data(), size, random() % ops * size);
+	    });
+	    measure("read_rand" + suffix, disk, &fs, scale.RandomOps, [&](size_t) {
+	    	return fs.read(file, buffer.data(), size, random() % ops * size);
+	    });
+	}
+
+	fs.remove(file);
+    }
+}
+
+// Files small enough to live in their inode, written and then read back
+// with a cold cache by a stat and a read each
+void bench_tiny(const Scale &scale, const std::string &path) {
+    Disk       disk;
+    FileSystem fs;
+    open_image(disk, fs, path, scale.ImageBlocks);
+
+    char		 data[TINY_FILE];
+    std::vector<ssize_t> inodes(scale.Files);
+    Result &write = measure("write_tiny", disk, &fs, scale.Files, [&](size_t i) {
+    	memset(data, 'a' + i%26, sizeof(data));
+    	return fs.write(inodes[i], data, sizeof(data), 0);
+    }, [&](size_t i) {
+    	inodes[i] = fs.create();
+    });
+    size_t blocks;
+    fs.fragmentation(nullptr, &blocks, nullptr);
+    write.Extra.emplace_back("data_blocks", blocks);
+
+    fs.unmount();
+    if (!fs.mount(&disk)) {
+    	throw std::runtime_error("unable to mount " + path);
+    }
+    measure("read_tiny", disk, &fs, scale.Files, [&](size_t i) {
+    	ssize_t size = fs.stat(inodes[i]);
+    	return size < 0 ? -1 : fs.read(inodes[i], data, size, 0);
+    });
+}
+
+// Large file written after every other small file was removed, so free
+// space is split into holes the allocator should skip
+void bench_fragmented(const Scale &scale, const std::string &path) {
+    Disk       disk;
+    FileSystem fs;
+    open_image(disk, fs, path, scale.ImageBlocks);
+
+    std::vector<char>	 buffer(FRAGMENT_FILE, 'x');
+    std::vector<ssize_t> inodes;
+    size_t		 fill = scale.ImageBlocks*3/4*Disk::BLOCK_SIZE/FRAGMENT_FILE;
+    for (size_t i = 0; i < fill; i++) {
+    	inodes.push_back(fs.create());
+    	fs.write(inodes.back(), buffer.data(), buffer.size(), 0);
+    }
+    for (size_t i = 0; i < inodes.size(); i += 2) {
+    	fs.remove(inodes[i]);
+    }
+
+    size_t files, blocks, extents;
+    fs.fragmentation(&files, &blocks, &extents);
+
+    size_t  size = scale.ImageBlocks/8*Disk::BLOCK_SIZE;
+    size_t  ops	 = size/buffer.size();
+    ssize_t file = fs.create();
+    Result &result = measure("alloc_fragmented", disk, &fs, ops, [&](size_t i) {
+    	return fs.write(file, buffer.data(), buffer.size(), i*buffer.size());
+    });
+
+    size_t fileBlocks, fileExtents;
+    fs.fragmentation(&files, &fileBlocks, &fileExtents);
+    fileBlocks  -= blocks;
+    fileExtents -= extents;
+    result.Extra.emplace_back("file_blocks", fileBlocks);
+    result.Extra.emplace_back("extents", fileExtents);
+    result.Extra.emplace_back("blocks_per_extent", fileExtents ? (double)fileBlocks/fileExtents : 0);
+}
+
+// Names linked into, looked up in and unlinked from one large directory
+void bench_directory(const Scale &scale, const std::string &path) {
+    Disk       disk;
+    FileSystem fs;
+    open_image(disk, fs, path, scale.ImageBlocks);
+
+    ssize_t		     dir = fs.mkdir(fs.root(true), "bench");
+    std::vector<ssize_t>     inodes(scale.Names);
+    std::vector<std::string> names(scale.Names);
+    for (size_t i = 0; i < scale.Names; i++) {
+    	names[i] = "file." + std::to_string(i);
+    }
+
+    Result &link = measure("link", disk, &fs, scale.Names, [&](size_t i) {
+    	return fs.link(dir, names[i].c_str(), inodes[i]) ? 0 : -1;
+    }, [&](size_t i) {
+    	inodes[i] = fs.create();
+    });
+    size_t directoryBlocks = (fs.stat(dir) + Disk::BLOCK_SIZE - 1)/Disk::BLOCK_SIZE;
+    link.Extra.emplace_back("directory_blocks", directoryBlocks);
+
+    std::mt19937 random(1);
+    measure("lookup", disk, &fs, scale.Names, [&](size_t) {
+    	size_t i = random() % scale.Names;
+    	return fs.lookup(dir, names[i].c_str()) == inodes[i] ? 0 : -1;
+    });
+    measure("unlink", disk, &fs, scale.Names, [&](size_t i) {
+    	return fs.unlink(dir, names[i].c_str()) ? 0 : -1;
+    });
+}
+
+// Files of one block each created and written, so every call changes an
+// inode, a bitmap word and a data block; the journal batches the metadata
+// of many calls into each commit
+void bench_small(const Scale &scale, const std::string &path) {
+    Disk       disk;
+    FileSystem fs;
+    open_image(disk, fs, path, scale.ImageBlocks);
+
+    std::vector<char> buffer(Disk::BLOCK_SIZE, 'x');
+    Result &result = measure("create_small", disk, &fs, scale.Files, [&](size_t) {
+    	ssize_t inumber = fs.create();
+    	return inumber < 0 ? -1 : fs.write(inumber, buffer.data(), buffer.size(), 0);
+    });
+
+    const Journal *journal = fs.metadata_journal();
+    result.Extra.emplace_back("journal_commits", journal ? journal->commits() : 0);
+    result.Extra.emplace_back("journal_blocks", journal ? journal->logged_blocks() : 0);
+}
+
+// Fill buffer with log lines, starting at given line: compressible, though
+// not trivially so
+void fill_text(std::vector<char> &buffer, size_t line) {
+    size_t length = 0;
+    for (; length < buffer.size(); line++) {
+    	char text[64];
+    	int  n = snprintf(text, sizeof(text), "%08lu GET /item/%lu 200 %lu bytes\n", line, line*7919%100000, line*37%4096);
+    	size_t chunk = std::min((size_t)n, buffer.size() - length);
+    	memcpy(buffer.data() + length, text, chunk);
+    	length += chunk;
+    }
+}
+
+// Text file written sequentially, then read back sequentially and at
+// random with a cold cache, either as a plain or as a compressed file
+void bench_text(const Scale &scale, const std::string &path, bool compressed) {
+    Disk       disk;
+    FileSystem fs;
+    open_image(disk, fs, path, scale.ImageBlocks);
+
+    std::string	      suffix = compressed ? "_lz" : "_plain";
+    std::vector<char> buffer(TEXT_IO_SIZE);
+    size_t	      ops  = scale.FileSize/buffer.size();
+    ssize_t	      file = fs.create();
+    if (compressed && !fs.compress(file)) {
+    	throw std::runtime_error("unable to compress file on " + path);
+    }
+
+    Result &write = measure("write_text" + suffix, disk, &fs, ops, [&](size_t i) {
+    	return fs.write(file, buffer.data(), buffer.size(), i*buffer.size());
+    }, [&](size_t i) {
+    	fill_text(buffer, i*TEXT_LINES);
+    });
+    size_t blocks;
+    fs.fragmentation(nullptr, &blocks, nullptr);
+    write.Extra.emplace_back("data_blocks", blocks);
+
+    fs.unmount();
+    if (!fs.mount(&disk)) {
+    	throw std::runtime_error("unable to mount " + path);
+    }
+    measure("read_text" + suffix, disk, &fs, ops, [&](size_t i) {
+    	return fs.read(file, buffer.data(), buffer.size(), i*buffer.size());
+    });
+
+    std::mt19937 random(1);
+    size_t	 blocksInFile = scale.FileSize/Disk::BLOCK_SIZE;
+    measure("read_rand_text" + suffix, disk, &fs, scale.RandomOps, [&](size_t) {
+    	return fs.read(file, buffer.data(), Disk::BLOCK_SIZE, random() % blocksInFile * Disk::BLOCK_SIZE);
+    });
+}
+
+// File written sequentially, then read back sequentially and at random with
+// a cold cache, on an image checksumming only metadata or data blocks too;
+// the data run also times the checksum of one block on its own
+void bench_checksums(const Scale &scale, const std::string &path, bool data) {
+    Disk       disk;
+    FileSystem fs;
+    open_image(disk, fs, path, scale.ImageBlocks, data);
+
+    std::string	      suffix = data ? "_data" : "_meta";
+    std::vector<char> buffer(TEXT_IO_SIZE);
+    for (size_t i = 0; i < buffer.size(); i++) {
+    	buffer[i] = (char)(i*7);
+    }
+    size_t  ops  = scale.FileSize/buffer.size();
+    ssize_t file = fs.create();
+
+    Result &write = measure("write_sums" + suffix, disk, &fs, ops, [&](size_t i) {
+    	return fs.write(file, buffer.data(), buffer.size(), i*buffer.size());
+    });
+    write.Extra.emplace_back("checksums_updated", fs.checksum_table()->updated());
+
+    fs.unmount();
+    if (!fs.mount(&disk)) {
+    	throw std::runtime_error("unable to mount " + path);
+    }
+    Result &read = measure("read_sums" + suffix, disk, &fs, ops, [&](size_t i) {
+    	return fs.read(file, buffer.data(), buffer.size(), i*buffer.size());
+    });
+    read.Extra.emplace_back("blocks_verified", fs.checksum_table()->verified());
+
+    fs.unmount();
+    if (!fs.mount(&disk)) {
+    	throw std::runtime_error("unable to mount " + path);
+    }
+    std::mt19937 random(1);
+    size_t	 blocksInFile = scale.FileSize/Disk::BLOCK_SIZE;
+    measure("read_rand_sums" + suffix, disk, &fs, scale.RandomOps, [&](size_t) {
+    	return fs.read(file, buffer.data(), Disk::BLOCK_SIZE, random() % blocksInFile * Disk::BLOCK_SIZE);
+    });
+
+    if (data) {
+    	Result &crc = measure("crc32c_4k", disk, nullptr, scale.RandomOps*16, [&](size_t i) {
+    	    buffer[0] = (char)Checksums::crc32c(buffer.data(), Disk::BLOCK_SIZE);
+    	    return Disk::BLOCK_SIZE;
+	});
+	crc.Extra.emplace_back("accelerated", Checksums::accelerated());
+    }
+}
+
+// Mount of populated images of growing size, from the saved bitmap and by
+// scanning the inode table
+void bench_mount(const Scale &scale, const std::string &path, size_t blocks) {
+    Disk       disk;
+    FileSystem fs;
+    open_image(disk, fs, path, blocks);
+
+    // One single block file per 64 blocks
+    std::vector<char> buffer(Disk::BLOCK_SIZE, 'x');
+    for (size_t i = 0; i < blocks/64; i++) {
+    	fs.write(fs.create(), buffer.data(), buffer.size(), 0);
+    }
+    fs.unmount();
+
+    std::string suffix = "_" + std::to_string(blocks);
+    Result &clean = measure("mount_clean" + suffix, disk, nullptr, scale.Mounts, [&](size_t) {
+    	return fs.mount(&disk) ? 0 : -1;
+    }, [&](size_t i) {
+    	if (i) fs.unmount();
+    });
+    fs.unmount();
+    clean.Extra.emplace_back("blocks", blocks);
+
+    // Clearing the clean flag makes the next mount rebuild the bitmap (or,
+    // with a journal, replay it and trust the bitmap)
+    Result &scan = measure("mount_scan" + suffix, disk, nullptr, scale.Mounts, [&](size_t) {
+    	return fs.mount(&disk) ? 0 : -1;
+    }, [&](size_t i) {
+    	if (i) fs.unmount();
+    	char	 block[Disk::BLOCK_SIZE];
+    	uint32_t state = FileSystem::STATE_DIRTY;
+    	disk.read(0, block);
+    	memcpy(block + STATE_OFFSET, &state, sizeof(state));
+    	disk.write(0, block);
+    });
+    fs.unmount();
+    scan.Extra.emplace_back("blocks", blocks);
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-q] [directory]\n", program);
+    fprintf(stderr, "    -q	Run a quick, small scale pass\n");
+}
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+    const Scale *scale = &FULL_SCALE;
+
+    int option;
+    while ((option = getopt(argc, argv, "q")) != -1) {
+    	switch (option) {
+    	    case 'q':
+    	    	scale = &QUICK_SCALE;
+    	    	break;
+	    default:
+	    	usage(argv[0]);
+	    	return EXIT_FAILURE;
+	}
+    }
+
+    if (argc - optind > 1) {
+    	usage(argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    std::string directory = argc > optind ? argv[optind] : "/tmp";
+    std::string path	  = directory + "/sfsbench." + std::to_string(getpid()) + ".img";
+
+    // Statistics printed by unmount and the disk destructor would corrupt
+    // the JSON, so they are thrown away
+    fflush(stdout);
+    int output = dup(STDOUT_FILENO);
+    int null   = open("/dev/null", O_WRONLY);
+    if (output < 0 || null < 0 || dup2(null, STDOUT_FILENO) < 0) {
+    	perror("Unable to redirect standard output");
+    	return EXIT_FAILURE;
+    }
+    close(null);
+
+    bool failed = false;
+    try {
+    	bench_files(*scale, path);
+    	unlink(path.c_str());
+    	bench_tiny(*scale, path);
+    	unlink(path.c_str());
+    	bench_fragmented(*scale, path);
+    	unlink(path.c_str());
+    	bench_directory(*scale, path);
+    	unlink(path.c_str());
+    	bench_small(*scale, path);
+    	unlink(path.c_str());
+    	bench_text(*scale, path, false);
+    	unlink(path.c_str());
+    	bench_text(*scale, path, true);
+    	unlink(path.c_str());
+    	bench_checksums(*scale, path, false);
+    	unlink(path.c_str());
+    	bench_checksums(*scale, path, true);
+    	unlink(path.c_str());
+    	for (size_t blocks : scale->MountBlocks) {
+    	    bench_mount(*scale, path, blocks);
+    	    unlink(path.c_str());
+	}
+    } catch (std::exception &e) {
+    	fprintf(stderr, "Benchmark failed: %s\n", e.what());
+    	unlink(path.c_str());
+    	failed = true;
+    }
+
+    fflush(stdout);
+    dup2(output, STDOUT_FILENO);
+    close(output);
+
+    if (failed) {
+    	return EXIT_FAILURE;
+    }
+    print_results(stdout, *scale);
+    return Errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+// bitmap.cpp: Word-packed bitmap
+
+#include "sfs/bitmap.h"
+
+#include <algorithm>
+
+void Bitmap::resize(size_t bits, bool value) {
+    size_t words = (bits + 63)/64;
+
+    Bits  = bits;
+    Count = value ? bits : 0;
+    Words.assign(words, value ? ~0ULL : 0);
+    Summary.assign((words + 63)/64, 0);
+
+    // Keep bits past the end clear so searches never return them
+    if (value && bits%64) {
+    	Words[words - 1] = (1ULL << (bits%64)) - 1;
+    }
+
+    for (size_t word = 0; word < words; word++) {
+    	summarize(word);
+    }
+}
+
+void Bitmap::set_word(size_t index, uint64_t value) {
+    // Never set bits past the end
+    if (index == Words.size() - 1 && Bits%64) {
+    	value &= (1ULL << (Bits%64)) - 1;
+    }
+
+    Count = Count - __builtin_popcountll(Words[index]) + __builtin_popcountll(value);
+    Words[index] = value;
+    summarize(index);
+}
+
+size_t Bitmap::count(size_t start, size_t end) const {
+    end = std::min(end, Bits);
+    if (start >= end) {
+    	return 0;
+    }
+
+    size_t first = start/64;
+    size_t last  = (end - 1)/64;
+    size_t total = 0;
+    for (size_t word = first; word <= last; word++) {
+    	uint64_t bits = Words[word];
+    	if (word == first) {
+    	    bits &= ~0ULL << (start%64);
+	}
+	if (word == last && end%64) {
+	    bits &= (1ULL << (end%64)) - 1;
+	}
+	total += __builtin_popcountll(bits);
+    }
+    return total;
+}
+
+size_t Bitmap::find_first(size_t start) const {
+    if (start >= Bits) {
+    	return NPOS;
+    }
+
+    // Check remainder of starting word
+    size_t   word = start/64;
+    uint64_t bits = Words[word] & (~0ULL << (start%64));
+    if (bits) {
+    	return word*64 + __builtin_ctzll(bits);
+    }
+
+    // Use summary to skip words with no set bits
+    word++;
+    size_t summary = word/64;
+    if (summary >= Summary.size()) {
+    	return NPOS;
+    }
+
+    uint64_t candidates = Summary[summary] & (~0ULL << (word%64));
+    while (!candidates) {
+    	if (++summary >= Summary.size()) {
+    	    return NPOS;
+	}
+	candidates = Summary[summary];
+    }
+
+    word = summary*64 + __builtin_ctzll(candidates);
+    return word*64 + __builtin_ctzll(Words[word]);
+}
+
+size_t Bitmap::find_run(size_t start, size_t length) const {
+    size_t first = find_first(start);
+    while (first != NPOS) {
+    	// Measure run of set bits, a word at a time (bits past the end are
+    	// clear, so the run always stops there)
+    	size_t end = first;
+    	while (end - first < length) {
+    	    uint64_t clear = ~Words[end/64] >> (end%64);
+    	    if (clear) {
+    	    	end += __builtin_ctzll(clear);
+    	    	break;
+	    }
+	    end += 64 - end%64;
+	    if (end >= Bits) {
+	    	end = Bits;
+	    	break;
+	    }
+	}
+
+	if (end - first >= length) {
+	    return first;
+	}
+	first = find_first(end);
+    }
+    return NPOS;
+}
@@ -0,0 +1,462 @@
+// cache.cpp: Block cache
+
+#include "sfs/cache.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+
+Cache::Cache(Disk *disk, size_t capacity, Checksums *checksums)
+    : Device(disk), Sums(checksums), Capacity(capacity), Hits(0), Misses(0), Evictions(0),
+      ReadaheadHits(0), ReadaheadWasted(0), PinnedBlocks(0) {
+}
+
+Cache::~Cache() {
+    discard_prefetches();
+    sync();
+}
+
+void Cache::discard_prefetches() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    while (!Pending.empty()) {
+    	std::shared_ptr<Prefetch> prefetch = Pending.begin()->second;
+    	try {
+    	    Device->wait(&prefetch->Request);
+	} catch (std::exception &) {
+	}
+    	for (size_t i = 0; i < prefetch->Request.Blocks; i++) {
+    	    if (Pending.erase(prefetch->Request.BlockNumber + i)) {
+    	    	ReadaheadWasted++;
+	    }
+	}
+    }
+}
+
+Cache::Entry *Cache::find(int blocknum) {
+    if (!Pending.empty()) {
+    	reap(blocknum);
+    }
+
+    auto it = Index.find(blocknum);
+    if (it == Index.end()) {
+    	return nullptr;
+    }
+
+    // Move entry to front of LRU list
+    Entries.splice(Entries.begin(), Entries, it->second);
+    Entry *entry = &Entries.front();
+    if (entry->Prefetched) {
+    	entry->Prefetched = false;
+    	ReadaheadHits++;
+    }
+    Hits++;
+    return entry;
+}
+
+Cache::Entry *Cache::insert(int blocknum) {
+    // Pinned entries may hold the cache over capacity until the next commit
+    while (Entries.size() >= Capacity && evict()) {
+    }
+
+    Entries.emplace_front();
+    Entry *entry = &Entries.front();
+    entry->BlockNumber = blocknum;
+    entry->Dirty       = false;
+    entry->Prefetched  = false;
+    entry->Pinned      = false;
+    entry->Logged      = false;
+    Index[blocknum] = Entries.begin();
+    return entry;
+}
+
+void Cache::reap(int blocknum) {
+    auto it = Pending.find(blocknum);
+    if (it == Pending.end()) {
+    	return;
+    }
+
+    std::shared_ptr<Prefetch> prefetch = it->second;
+    bool failed = false;
+    try {
+    	Device->wait(&prefetch->Request);
+    } catch (std::exception &) {
+    	// Read ahead is only a hint; the block is read again on demand
+    	failed = true;
+    }
+
+    for (size_t i = 0; i < prefetch->Request.Blocks; i++) {
+    	int   block = prefetch->Request.BlockNumber + i;
+    	char *data  = prefetch->Buffer.data() + i*Disk::BLOCK_SIZE;
+    	if (!Pending.erase(block) || failed || Index.count(block)) {
+    	    continue;
+	}
+	if (prefetch->Failed[i]) {
+	    continue;
+	}
+
+	Entry *entry = insert(block);
+	memcpy(entry->Data, data, Disk::BLOCK_SIZE);
+	entry->Prefetched = true;
+    }
+}
+
+void Cache::prefetch(int blocknum, size_t nblocks) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    if (Capacity == 0) {
+    	return;
+    }
+
+    size_t i = 0;
+    while (i < nblocks) {
+    	if (Index.count(blocknum + i) || Pending.count(blocknum + i)) {
+    	    i++;
+    	    continue;
+	}
+
+	size_t j = i + 1;
+	while (j < nblocks && !Index.count(blocknum + j) && !Pending.count(blocknum + j)) {
+	    j++;
+	}
+
+	std::shared_ptr<Prefetch> prefetch(new Prefetch);
+	prefetch->Buffer.resize((j - i)*Disk::BLOCK_SIZE);
+	prefetch->Failed.assign(j - i, false);
+	prefetch->Request = Disk::Request(blocknum + i, j - i, prefetch->Buffer.data(), false);
+	if (Sums) {
+	    // Checked by the disk worker, off the path of the read that uses it;
+	    // the prefetch outlives its request, as it is only dropped once waited
+	    Checksums *sums	= Sums;
+	    Prefetch  *fetched	= prefetch.get();
+	    prefetch->Request.Callback = [sums, fetched](Disk::Request *request) {
+	    	for (size_t k = 0; request->Error.empty() && k < request->Blocks; k++) {
+	    	    fetched->Failed[k] = !sums->verify(request->BlockNumber + k, 1, request->Data + k*Disk::BLOCK_SIZE);
+		}
+	    };
+	}
+	Device->submit(&prefetch->Request);
+	for (size_t k = i; k < j; k++) {
+	    Pending[blocknum + k] = prefetch;
+	}
+	i = j;
+    }
+}
+
+Cache::Entry *Cache::lookup(int blocknum, bool load) {
+    Entry *entry = find(blocknum);
+    if (entry) {
+    	return entry;
+    }
+
+    Misses++;
+    entry = insert(blocknum);
+    if (load) {
+    	try {
+    	    Device->read(blocknum, entry->Data);
+    	    check(blocknum, 1, entry->Data);
+	} catch (...) {
+	    Index.erase(blocknum);
+	    Entries.pop_front();
+	    throw;
+	}
+    }
+    return entry;
+}
+
+void Cache::check(int blocknum, size_t nblocks, const char *data) {
+    uint32_t bad;
+    if (Sums && !Sums->verify(blocknum, nblocks, data, &bad)) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Checksum mismatch in block %u", bad);
+    	throw std::runtime_error(what);
+    }
+}
+
+bool Cache::evict() {
+    auto it = Entries.end();
+    do {
+    	if (it == Entries.begin()) {
+    	    return false;
+	}
+	--it;
+    } while (it->Pinned);
+
+    if (it->Dirty) {
+    	record(it->BlockNumber, 1, it->Data, it->Logged);
+    	Device->write(it->BlockNumber, it->Data);
+    }
+    if (it->Prefetched) {
+    	ReadaheadWasted++;
+    }
+    Index.erase(it->BlockNumber);
+    Entries.erase(it);
+    Evictions++;
+    return true;
+}
+
+void Cache::pin(Entry *entry) {
+    if (!entry->Pinned) {
+    	entry->Pinned = true;
+    	PinnedBlocks++;
+    }
+}
+
+void Cache::read(int blocknum, char *data) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    if (Capacity == 0 && !Index.count(blocknum)) {
+    	Misses++;
+    	Device->read(blocknum, data);
+    	check(blocknum, 1, data);
+    	return;
+    }
+
+    Entry *entry = lookup(blocknum, true);
+    memcpy(data, entry->Data, Disk::BLOCK_SIZE);
+}
+
+void Cache::read(int blocknum, char *data, size_t offset, size_t length) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    if (Capacity == 0 && !Index.count(blocknum)) {
+    	char block[Disk::BLOCK_SIZE];
+    	Misses++;
+    	Device->read(blocknum, block);
+    	check(blocknum, 1, block);
+    	memcpy(data, block + offset, length);
+    	return;
+    }
+
+    Entry *entry = lookup(blocknum, true);
+    memcpy(data, entry->Data + offset, length);
+}
+
+void Cache::read_blocks(int blocknum, size_t nblocks, char *data, std::deque<Disk::Request> *pending) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    size_t i = 0;
+    while (i < nblocks) {
+    	Entry *entry = find(blocknum + i);
+    	if (entry) {
+    	    memcpy(data + i*Disk::BLOCK_SIZE, entry->Data, Disk::BLOCK_SIZE);
+    	    i++;
+    	    continue;
+	}
+
+	// Bulk reads bypass the cache so they do not evict metadata
+	size_t j = i + 1;
+	while (j < nblocks && !Index.count(blocknum + j) && !Pending.count(blocknum + j)) {
+	    j++;
+	}
+	if (pending) {
+	    pending->emplace_back(blocknum + i, j - i, data + i*Disk::BLOCK_SIZE, false);
+	    if (Sums) {
+	    	// Verified by the disk worker, so a mismatch fails the request
+	    	Checksums *sums = Sums;
+	    	pending->back().Callback = [sums](Disk::Request *request) {
+	    	    uint32_t bad;
+	    	    if (request->Error.empty() && !sums->verify(request->BlockNumber, request->Blocks, request->Data, &bad)) {
+	    	    	char what[BUFSIZ];
+	    	    	snprintf(what, BUFSIZ, "Checksum mismatch in block %u", bad);
+	    	    	request->Error = what;
+		    }
+		};
+	    }
+	    Device->submit(&pending->back());
+	} else {
+	    Device->read_blocks(blocknum + i, j - i, data + i*Disk::BLOCK_SIZE);
+	    check(blocknum + i, j - i, data + i*Disk::BLOCK_SIZE);
+	}
+	Misses += j - i;
+	i = j;
+    }
+}
+
+void Cache::write(int blocknum, char *data, bool pin) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    if (Capacity == 0 && !pin && !Index.count(blocknum)) {
+    	record(blocknum, 1, data);
+    	Device->write(blocknum, data);
+    	return;
+    }
+
+    // Whole block is overwritten, so there is no need to load it on a miss
+    Entry *entry = lookup(blocknum, false);
+    memcpy(entry->Data, data, Disk::BLOCK_SIZE);
+    entry->Dirty = true;
+    if (pin) {
+    	this->pin(entry);
+    } else {
+    	entry->Logged = false;
+    }
+}
+
+void Cache::write(int blocknum, char *data, size_t offset, size_t length, bool pin) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    if (Capacity == 0 && !pin && !Index.count(blocknum)) {
+    	char block[Disk::BLOCK_SIZE];
+    	Misses++;
+    	Device->read(blocknum, block);
+    	check(blocknum, 1, block);
+    	memcpy(block + offset, data, length);
+    	record(blocknum, 1, block);
+    	Device->write(blocknum, block);
+    	return;
+    }
+
+    Entry *entry = lookup(blocknum, true);
+    memcpy(entry->Data + offset, data, length);
+    entry->Dirty = true;
+    if (pin) {
+    	this->pin(entry);
+    } else {
+    	entry->Logged = false;
+    }
+}
+
+void Cache::write_blocks(int blocknum, size_t nblocks, char *data, std::deque<Disk::Request> *pending) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    // Settle read ahead of these blocks first so stale data is never inserted
+    for (size_t i = 0; i < nblocks && !Pending.empty(); i++) {
+    	reap(blocknum + i);
+    }
+
+    if (pending) {
+    	pending->emplace_back(blocknum, nblocks, data, true);
+    	if (Sums) {
+    	    // Summed by the disk worker; the caller waits for the request
+    	    // before the blocks can be read back or the table committed
+    	    Checksums *sums = Sums;
+    	    sums->unsettle(blocknum, nblocks);
+    	    pending->back().Callback = [sums](Disk::Request *request) {
+    	    	sums->update(request->BlockNumber, request->Blocks, request->Data);
+	    };
+	}
+    	Device->submit(&pending->back());
+    } else {
+    	record(blocknum, nblocks, data);
+    	Device->write_blocks(blocknum, nblocks, data);
+    }
+
+    for (size_t i = 0; i < nblocks; i++) {
+    	auto it = Index.find(blocknum + i);
+    	if (it != Index.end()) {
+    	    Entry *entry = &*it->second;
+    	    memcpy(entry->Data, data + i*Disk::BLOCK_SIZE, Disk::BLOCK_SIZE);
+    	    entry->Dirty  = false;
+    	    entry->Logged = false;
+    	    if (entry->Pinned) {
+    	    	entry->Pinned = false;
+    	    	PinnedBlocks--;
+	    }
+	}
+    }
+}
+
+void Cache::sync(bool logged) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    // Write back in block order so the disk sees mostly sequential writes;
+    // pinned blocks must not reach their home before they are committed
+    std::vector<Entry *> dirty;
+    for (auto &entry : Entries) {
+    	if (entry.Dirty && !entry.Pinned && (logged || !entry.Logged)) {
+    	    dirty.push_back(&entry);
+	}
+    }
+
+    std::sort(dirty.begin(), dirty.end(), [](const Entry *a, const Entry *b) {
+    	return a->BlockNumber < b->BlockNumber;
+    });
+
+    // Each run of consecutive dirty blocks goes out as one disk request
+    std::vector<char *> buffers;
+    size_t start = 0;
+    for (size_t i = 0; i < dirty.size(); i++) {
+    	buffers.push_back(dirty[i]->Data);
+    	record(dirty[i]->BlockNumber, 1, dirty[i]->Data, dirty[i]->Logged);
+
+    	bool last = i + 1 == dirty.size() || dirty[i + 1]->BlockNumber != dirty[i]->BlockNumber + 1;
+    	if (last) {
+    	    Device->write_blocks(dirty[start]->BlockNumber, buffers.size(), buffers.data());
+    	    for (size_t j = start; j <= i; j++) {
+    	    	dirty[j]->Dirty  = false;
+    	    	dirty[j]->Logged = false;
+	    }
+    	    buffers.clear();
+    	    start = i + 1;
+	}
+    }
+}
+
+void Cache::pinned_blocks(std::vector<int> *blocks, std::vector<char> *data) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    std::vector<Entry *> pinned;
+    for (auto &entry : Entries) {
+    	if (entry.Pinned) {
+    	    pinned.push_back(&entry);
+	}
+    }
+    std::sort(pinned.begin(), pinned.end(), [](const Entry *a, const Entry *b) {
+    	return a->BlockNumber < b->BlockNumber;
+    });
+
+    blocks->clear();
+    data->resize(pinned.size()*Disk::BLOCK_SIZE);
+    for (size_t i = 0; i < pinned.size(); i++) {
+    	blocks->push_back(pinned[i]->BlockNumber);
+    	memcpy(data->data() + i*Disk::BLOCK_SIZE, pinned[i]->Data, Disk::BLOCK_SIZE);
+    }
+}
+
+void Cache::forget(int blocknum) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    auto it = Index.find(blocknum);
+    if (it == Index.end()) {
+    	return;
+    }
+    if (it->second->Pinned) {
+    	PinnedBlocks--;
+    }
+    if (it->second->Prefetched) {
+    	ReadaheadWasted++;
+    }
+    Entries.erase(it->second);
+    Index.erase(it);
+}
+
+void Cache::unpin(const std::vector<int> &blocks) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    for (int block : blocks) {
+    	auto it = Index.find(block);
+    	if (it != Index.end() && it->second->Pinned) {
+    	    it->second->Pinned = false;
+    	    it->second->Logged = true;
+    	    PinnedBlocks--;
+	}
+    }
+
+    // Released blocks may now make room for a cache that grew over capacity
+    while (Entries.size() > Capacity && evict()) {
+    }
+}
+
+void Cache::reset_stats() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    Hits	    = 0;
+    Misses	    = 0;
+    Evictions	    = 0;
+    ReadaheadHits   = 0;
+    ReadaheadWasted = 0;
+}
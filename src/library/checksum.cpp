@@ -0,0 +1,391 @@
+// checksum.cpp: CRC32C checksums of disk blocks
+
+#include "sfs/checksum.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+const uint32_t Checksums::ENTRIES_PER_BLOCK;
+const uint32_t Checksums::GROUP_BLOCKS;
+const uint32_t Checksums::GROUPS_PER_BLOCK;
+
+// CRC32C polynomial, bit reflected (as are all the values below)
+static const uint32_t POLYNOMIAL = 0x82f63b78;
+
+// Bytes each of three interleaved streams covers per round: the crc32
+// instruction takes three cycles but can start one every cycle, so three
+// independent streams keep it busy. One round covers all but 16 bytes of a
+// block.
+static const size_t STRIDE = 1360;
+
+// Return a*b modulo the polynomial, where x^0 is the top bit
+static uint32_t multiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t mask = 1u << 31; mask; mask >>= 1) {
+    	if (a & mask) {
+    	    product ^= b;
+	}
+	b = b & 1 ? (b >> 1) ^ POLYNOMIAL : b >> 1;
+    }
+    return product;
+}
+
+// Return x^(8*bytes) modulo the polynomial: multiplying a checksum by it
+// appends that many zero bytes
+static uint32_t zeros_operator(size_t bytes) {
+    uint32_t power = 1u << 31;
+    for (size_t i = 0; i < 8*bytes; i++) {
+    	power = power & 1 ? (power >> 1) ^ POLYNOMIAL : power >> 1;
+    }
+    return power;
+}
+
+struct Tables {
+    uint32_t Slice[8][256];	// Slicing-by-8 tables for the portable loop
+    uint32_t Skip1;		// Operator appending STRIDE zero bytes
+    uint32_t Skip2;		// Operator appending 2*STRIDE zero bytes
+
+    Tables() {
+    	for (uint32_t i = 0; i < 256; i++) {
+    	    uint32_t crc = i;
+    	    for (int bit = 0; bit < 8; bit++) {
+    	    	crc = crc & 1 ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+	    }
+	    Slice[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+	    for (int k = 1; k < 8; k++) {
+	    	Slice[k][i] = (Slice[k - 1][i] >> 8) ^ Slice[0][Slice[k - 1][i] & 0xff];
+	    }
+	}
+	Skip1 = zeros_operator(STRIDE);
+	Skip2 = zeros_operator(2*STRIDE);
+    }
+};
+
+static const Tables &tables() {
+    static Tables instance;
+    return instance;
+}
+
+static uint64_t load64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Checksum without the initial and final inversion, eight bytes at a time
+// (assumes a little endian processor)
+static uint32_t crc_portable(uint32_t crc, const uint8_t *p, size_t length) {
+    const Tables &t = tables();
+    for (; length >= 8; p += 8, length -= 8) {
+    	uint64_t word = load64(p) ^ crc;
+    	crc = t.Slice[7][word & 0xff]	      ^ t.Slice[6][(word >> 8) & 0xff] ^
+    	      t.Slice[5][(word >> 16) & 0xff] ^ t.Slice[4][(word >> 24) & 0xff] ^
+    	      t.Slice[3][(word >> 32) & 0xff] ^ t.Slice[2][(word >> 40) & 0xff] ^
+    	      t.Slice[1][(word >> 48) & 0xff] ^ t.Slice[0][word >> 56];
+    }
+    for (; length; p++, length--) {
+    	crc = t.Slice[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// Checksum without the initial and final inversion on the crc32
+// instruction, joining the three streams of each round by appending zeros
+// to the first two
+__attribute__((target("sse4.2")))
+static uint32_t crc_hardware(uint32_t crc, const uint8_t *p, size_t length) {
+    const Tables &t = tables();
+    for (; length >= 3*STRIDE; p += 3*STRIDE, length -= 3*STRIDE) {
+    	uint64_t a = crc, b = 0, c = 0;
+    	for (size_t i = 0; i < STRIDE; i += 8) {
+    	    a = _mm_crc32_u64(a, load64(p + i));
+    	    b = _mm_crc32_u64(b, load64(p + STRIDE + i));
+    	    c = _mm_crc32_u64(c, load64(p + 2*STRIDE + i));
+	}
+	crc = multiply(t.Skip2, a) ^ multiply(t.Skip1, b) ^ c;
+    }
+
+    uint64_t wide = crc;
+    for (; length >= 8; p += 8, length -= 8) {
+    	wide = _mm_crc32_u64(wide, load64(p));
+    }
+    crc = wide;
+    for (; length; p++, length--) {
+    	crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+bool Checksums::accelerated() {
+#if defined(__x86_64__)
+    static bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+uint32_t Checksums::crc32c(const char *data, size_t length, uint32_t crc) {
+    const uint8_t *p = (const uint8_t *)data;
+#if defined(__x86_64__)
+    if (accelerated()) {
+    	return ~crc_hardware(~crc, p, length);
+    }
+#endif
+    return ~crc_portable(~crc, p, length);
+}
+
+// Return table entry recording checksum of block contents
+static uint32_t entry_for(const char *data) {
+    uint32_t crc = Checksums::crc32c(data, Disk::BLOCK_SIZE);
+    return crc ? crc : ~0u;
+}
+
+// Checksums -------------------------------------------------------------------
+
+Checksums::Checksums(Disk *disk, uint32_t start, uint32_t blocks)
+    : Device(disk), Start(start), Blocks(blocks), Sums(blocks, 0),
+      Dirty(table_blocks(blocks), false), DirtyBlocks(0), Covered(blocks, false), Durable(blocks, false),
+      Unsettled((blocks + GROUP_BLOCKS - 1)/GROUP_BLOCKS, false),
+      MapDirty(blocks_for(blocks) - table_blocks(blocks), false), TrackStart(0), TrackEnd(0),
+      Verified(0), Mismatches(0), Updated(0) {
+}
+
+void Checksums::set(uint32_t block, uint32_t sum) {
+    if (Sums[block] != sum) {
+    	Sums[block] = sum;
+    	if (!Dirty[block/ENTRIES_PER_BLOCK]) {
+    	    Dirty[block/ENTRIES_PER_BLOCK] = true;
+    	    DirtyBlocks++;
+	}
+    }
+}
+
+void Checksums::load() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    std::vector<char> table((size_t)Dirty.size()*Disk::BLOCK_SIZE);
+    Device->read_blocks(Start, Dirty.size(), table.data());
+    memcpy(Sums.data(), table.data(), Sums.size()*sizeof(uint32_t));
+    for (uint32_t block = 0; block < Blocks; block++) {
+    	if (Sums[block]) {
+    	    Covered.set(block);
+    	    Durable.set(block);
+	}
+    }
+    Dirty.assign(Dirty.size(), false);
+    DirtyBlocks = 0;
+
+    std::vector<uint64_t> map(MapDirty.size()*Disk::BLOCK_SIZE/sizeof(uint64_t));
+    Device->read_blocks(Start + Dirty.size(), MapDirty.size(), (char *)map.data());
+    for (size_t w = 0; w < Unsettled.words(); w++) {
+    	Unsettled.set_word(w, map[w]);
+    }
+}
+
+size_t Checksums::recover() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    std::vector<char> data((size_t)GROUP_BLOCKS*Disk::BLOCK_SIZE);
+    size_t resummed = 0;
+    for (size_t group = Unsettled.find_first(); group != Bitmap::NPOS; group = Unsettled.find_first(group + 1)) {
+    	uint32_t first = group*GROUP_BLOCKS;
+    	uint32_t count = std::min(GROUP_BLOCKS, Blocks - first);
+    	Device->read_blocks(first, count, data.data());
+    	for (uint32_t i = 0; i < count; i++) {
+    	    if (!Sums[first + i]) {
+    	    	continue;
+	    }
+	    uint32_t sum = entry_for(data.data() + i*Disk::BLOCK_SIZE);
+	    if (sum != Sums[first + i]) {
+	    	set(first + i, sum);
+	    	resummed++;
+	    }
+	}
+    }
+    return resummed;
+}
+
+void Checksums::clear() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    Sums.assign(Sums.size(), 0);
+    Dirty.assign(Dirty.size(), true);
+    DirtyBlocks = Dirty.size();
+}
+
+void Checksums::cover(uint32_t first, uint32_t count) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    for (uint32_t block = first; block < first + count && block < Blocks; block++) {
+    	Covered.set(block);
+    }
+}
+
+void Checksums::track(uint32_t first, uint32_t count) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    TrackStart = first;
+    TrackEnd   = std::min(first + count, Blocks);
+}
+
+void Checksums::unsettle(uint32_t blocknum, size_t nblocks) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    for (uint32_t block = std::max(blocknum, TrackStart); block < blocknum + nblocks && block < TrackEnd; block++) {
+    	uint32_t group = block/GROUP_BLOCKS;
+    	if (Durable.test(block) && !Unsettled.test(group)) {
+    	    Unsettled.set(group);
+    	    MapDirty[group/GROUPS_PER_BLOCK] = true;
+	}
+    }
+    write_map(true);
+}
+
+void Checksums::settle() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    for (size_t group = Unsettled.find_first(); group != Bitmap::NPOS; group = Unsettled.find_first(group + 1)) {
+    	Unsettled.clear(group);
+    	MapDirty[group/GROUPS_PER_BLOCK] = true;
+    }
+    write_map(false);
+}
+
+void Checksums::write_map(bool flush) {
+    const size_t WORDS = Disk::BLOCK_SIZE/sizeof(uint64_t);
+    uint64_t	 words[WORDS];
+    bool	 written = false;
+    for (uint32_t i = 0; i < MapDirty.size(); i++) {
+    	if (!MapDirty[i]) {
+    	    continue;
+	}
+	for (size_t w = 0; w < WORDS; w++) {
+	    words[w] = i*WORDS + w < Unsettled.words() ? Unsettled.word(i*WORDS + w) : 0;
+	}
+	Device->write(Start + Dirty.size() + i, (char *)words);
+	MapDirty[i] = false;
+	written     = true;
+    }
+    if (written && flush) {
+    	Device->flush();
+    }
+}
+
+void Checksums::forget(uint32_t block, bool uncover) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    if (block >= Blocks) {
+    	return;
+    }
+    set(block, 0);
+    if (uncover) {
+    	Covered.clear(block);
+    }
+}
+
+void Checksums::update(uint32_t blocknum, size_t nblocks, const char *data) {
+    // Table is consulted once for the run, so its lock is not taken per block
+    std::vector<bool> covered(nblocks, false);
+    bool	      any = false;
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	for (size_t i = 0; i < nblocks && blocknum + i < Blocks; i++) {
+    	    covered[i] = Covered.test(blocknum + i);
+    	    any        = any || covered[i];
+	}
+    }
+    if (!any) {
+    	return;
+    }
+
+    std::vector<uint32_t> sums(nblocks, 0);
+    for (size_t i = 0; i < nblocks; i++) {
+    	if (covered[i]) {
+    	    sums[i] = entry_for(data + i*Disk::BLOCK_SIZE);
+	}
+    }
+
+    std::lock_guard<std::mutex> guard(Lock);
+    for (size_t i = 0; i < nblocks; i++) {
+    	if (covered[i]) {
+    	    set(blocknum + i, sums[i]);
+    	    Updated++;
+	}
+    }
+}
+
+bool Checksums::has(uint32_t block) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    return block < Blocks && Sums[block];
+}
+
+bool Checksums::verify(uint32_t blocknum, size_t nblocks, const char *data, uint32_t *bad) {
+    std::vector<uint32_t> expected(nblocks, 0);
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	for (size_t i = 0; i < nblocks && blocknum + i < Blocks; i++) {
+    	    expected[i] = Sums[blocknum + i];
+	}
+    }
+
+    bool matched = true;
+    for (size_t i = 0; i < nblocks; i++) {
+	if (!expected[i]) {
+	    continue;
+	}
+
+	Verified++;
+	if (entry_for(data + i*Disk::BLOCK_SIZE) != expected[i]) {
+	    Mismatches++;
+	    if (matched && bad) {
+	    	*bad = blocknum + i;
+	    }
+	    matched = false;
+	}
+    }
+    return matched;
+}
+
+void Checksums::dirty_blocks(std::vector<uint32_t> *blocks, std::vector<char> *data) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    blocks->clear();
+    data->clear();
+    for (uint32_t i = 0; i < Dirty.size(); i++) {
+    	if (!Dirty[i]) {
+    	    continue;
+	}
+
+	uint32_t first = i*ENTRIES_PER_BLOCK;
+	uint32_t count = std::min(Blocks - first, ENTRIES_PER_BLOCK);
+	data->resize(data->size() + Disk::BLOCK_SIZE, 0);
+	memcpy(data->data() + data->size() - Disk::BLOCK_SIZE, Sums.data() + first, count*sizeof(uint32_t));
+	blocks->push_back(Start + i);
+	Dirty[i] = false;
+	for (uint32_t block = first; block < first + count; block++) {
+	    if (Sums[block]) {
+	    	Durable.set(block);
+	    } else {
+	    	Durable.clear(block);
+	    }
+	}
+    }
+    DirtyBlocks = 0;
+}
+
+void Checksums::reset_stats() {
+    Verified   = 0;
+    Mismatches = 0;
+    Updated    = 0;
+}
@@ -0,0 +1,463 @@
+// directory.cpp: Directories (extendible hash tables of names)
+
+#include "sfs/fs.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+const uint32_t FileSystem::NO_ROOT;
+const uint32_t FileSystem::NAME_LENGTH;
+const uint32_t FileSystem::ENTRIES_PER_BUCKET;
+const uint32_t FileSystem::MAX_DEPTH;
+const uint32_t FileSystem::TABLE_START;
+const uint32_t FileSystem::BUCKET_START;
+
+// Directory inode loaded by one call (with its lock held), keeping the block
+// of the header and bucket table used last
+struct FileSystem::Directory {
+    FileSystem *FS;
+    size_t	Inumber;
+    Inode	Node;
+    Mapping	Map;
+    uint32_t	Loaded;	    // File block held in Table (NO_ROOT if none)
+    bool	Dirty;	    // Whether or not Table must be written back
+    Block	Table;
+
+    Directory(FileSystem *fs, size_t inumber) : FS(fs), Inumber(inumber), Loaded(NO_ROOT), Dirty(false) {}
+
+    // Load inode, returning whether or not it is a directory
+    bool open() {
+        return inumber_valid() && FS->load_inode(Inumber, &Node) && (Node.Valid & INODE_DIRECTORY);
+    }
+
+    bool inumber_valid() const { return Inumber < FS->inodes; }
+
+    // Return header or table slot (slot TABLE_START + i is table entry i)
+    uint32_t get(uint32_t slot) {
+        Block *block = load(slot/POINTERS_PER_BLOCK);
+        return block ? block->Pointers[slot%POINTERS_PER_BLOCK] : 0;
+    }
+
+    bool set(uint32_t slot, uint32_t value) {
+        Block *block = load(slot/POINTERS_PER_BLOCK);
+        if (!block){
+            return false;
+        }
+        block->Pointers[slot%POINTERS_PER_BLOCK] = value;
+        Dirty = true;
+        return true;
+    }
+
+    Block *load(uint32_t index) {
+        if (Loaded != index){
+            if (!flush()){
+                return nullptr;
+            }
+            FS->read_file_block(&Node, index, &Table, &Map);
+            Loaded = index;
+        }
+        return &Table;
+    }
+
+    bool flush() {
+        if (Dirty){
+            if (!FS->write_file_block(&Node, Loaded, &Table, &Map)){
+                return false;
+            }
+            Dirty = false;
+        }
+        return true;
+    }
+
+    // Return bucket holding names of given hash
+    uint32_t bucket_of(uint32_t hash) {
+        uint32_t depth = get(HEADER_DEPTH);
+        return get(TABLE_START + (hash & ((1u << depth) - 1)));
+    }
+
+    // Return slot of name within bucket (-1 if not there)
+    static int find(const Bucket &bucket, const char *name, size_t length) {
+        for (uint32_t i = 0; i < bucket.Count && i < ENTRIES_PER_BUCKET; i++){
+            const Entry &entry = bucket.Entries[i];
+            if (entry.Length == length && memcmp(entry.Name, name, length) == 0){
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Write back table block, pointer blocks and inode
+    bool close() {
+        bool flushed = flush();
+        FS->flush_mapping(&Map);
+        FS->save_inode(Inumber, &Node);
+        return flushed;
+    }
+};
+
+// Names -----------------------------------------------------------------------
+
+bool FileSystem::valid_name(const char *name) {
+    size_t length = strlen(name);
+    return length > 0 && length <= NAME_LENGTH && !strchr(name, '/');
+}
+
+uint32_t FileSystem::hash_name(const char *name, size_t length) {
+    // FNV-1a: cheap, and its low bits are well mixed
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++){
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+ssize_t FileSystem::adjust_links(size_t inumber, int delta) {
+    if (inumber >= this->inodes){
+        return -1;
+    }
+
+    InodeGuard guard(inode_lock(inumber), true);
+    Inode node;
+    if (!load_inode(inumber, &node)){
+        return -1;
+    }
+
+    ssize_t links = (ssize_t)(node.Valid >> LINK_SHIFT) + delta;
+    if (links < 0 || links > MAX_LINKS){
+        return -1;
+    }
+    node.Valid = (node.Valid & ((1u << LINK_SHIFT) - 1)) | ((uint32_t)links << LINK_SHIFT);
+    save_inode(inumber, &node);
+    return links;
+}
+
+// Root directory --------------------------------------------------------------
+
+ssize_t FileSystem::root(bool create) {
+    TraceScope trace(this->tracer, Trace::ROOT, create);
+    TransactionGuard transaction(this);
+    std::lock_guard<std::mutex> guard(this->namespaceLock);
+
+    if (!this->disk || this->version < 4){
+        return -1;
+    }
+    if (this->rootInode != NO_ROOT || !create){
+        ssize_t inumber = this->rootInode == NO_ROOT ? -1 : (ssize_t)this->rootInode;
+        trace.set_result(inumber);
+        return inumber;
+    }
+
+    ssize_t inumber = make_directory();
+    if (inumber < 0){
+        return -1;
+    }
+    this->rootInode = inumber;
+    write_root(inumber);
+    trace.set_result(inumber);
+    return inumber;
+}
+
+ssize_t FileSystem::make_directory() {
+    ssize_t inumber = create_inode();
+    if (inumber < 0){
+        return -1;
+    }
+
+    // An empty directory has a depth 0 table pointing at bucket 0
+    bool made;
+    {
+        InodeGuard guard(inode_lock(inumber), true);
+        Directory directory(this, inumber);
+        load_inode(inumber, &directory.Node);
+        directory.Node.Valid |= INODE_DIRECTORY;
+
+        Block bucket;
+        memset(bucket.Data, 0, Disk::BLOCK_SIZE);
+        made = directory.set(HEADER_DEPTH, 0) && directory.set(HEADER_BUCKETS, 1) &&
+               directory.set(TABLE_START, 0) && directory.flush() &&
+               write_file_block(&directory.Node, BUCKET_START, &bucket, &directory.Map);
+        directory.close();
+    }
+
+    if (!made){
+        remove_inode(inumber, true);
+        return -1;
+    }
+    return inumber;
+}
+
+bool FileSystem::is_directory(size_t inumber) {
+    if (!this->disk || inumber >= this->inodes){
+        return false;
+    }
+
+    InodeGuard guard(inode_lock(inumber), false);
+    Inode node;
+    return load_inode(inumber, &node) && (node.Valid & INODE_DIRECTORY);
+}
+
+// Lookup ----------------------------------------------------------------------
+
+ssize_t FileSystem::lookup(size_t dir, const char *name) {
+    OpTimer    timer(&this->opStats.Lookup);
+    TraceScope trace(this->tracer, Trace::LOOKUP, dir);
+    trace.set_name(name);
+
+    ssize_t inumber = find_name(dir, name);
+    trace.set_result(inumber);
+    return inumber;
+}
+
+ssize_t FileSystem::find_name(size_t dir, const char *name) {
+    if (!this->disk || !valid_name(name)){
+        return -1;
+    }
+
+    Directory directory(this, dir);
+    if (!directory.inumber_valid()){
+        return -1;
+    }
+    InodeGuard guard(inode_lock(dir), false);
+    if (!directory.open()){
+        return -1;
+    }
+
+    // One table block and one bucket, however large the directory
+    size_t   length = strlen(name);
+    uint32_t bucket = directory.bucket_of(hash_name(name, length));
+    Block    block;
+    read_file_block(&directory.Node, BUCKET_START + bucket, &block, &directory.Map);
+    int slot = Directory::find(block.Names, name, length);
+    return slot < 0 ? -1 : (ssize_t)block.Names.Entries[slot].Inumber;
+}
+
+bool FileSystem::readdir(size_t dir, std::vector<Link> *links) {
+    if (!this->disk){
+        return false;
+    }
+
+    Directory directory(this, dir);
+    if (!directory.inumber_valid()){
+        return false;
+    }
+    InodeGuard guard(inode_lock(dir), false);
+    if (!directory.open()){
+        return false;
+    }
+
+    links->clear();
+    uint32_t buckets = directory.get(HEADER_BUCKETS);
+    Block    block;
+    for (uint32_t b = 0; b < buckets; b++){
+        read_file_block(&directory.Node, BUCKET_START + b, &block, &directory.Map);
+        for (uint32_t i = 0; i < block.Names.Count && i < ENTRIES_PER_BUCKET; i++){
+            const Entry &entry = block.Names.Entries[i];
+            links->push_back(Link{std::string(entry.Name, entry.Length), entry.Inumber});
+        }
+    }
+    return true;
+}
+
+// Link ------------------------------------------------------------------------
+
+bool FileSystem::link(size_t dir, const char *name, size_t inumber) {
+    OpTimer    timer(&this->opStats.Link);
+    TraceScope trace(this->tracer, Trace::LINK, dir, 0, inumber);
+    trace.set_name(name);
+    TransactionGuard transaction(this);
+    std::lock_guard<std::mutex> guard(this->namespaceLock);
+
+    // A directory has exactly one name, given by mkdir, so the tree has no
+    // cycles and unlink can always take it apart
+    if (!this->disk || is_directory(inumber) || !add_link(dir, name, inumber)){
+        return false;
+    }
+    trace.set_result(1);
+    return true;
+}
+
+bool FileSystem::add_link(size_t dir, const char *name, size_t inumber) {
+    if (!valid_name(name) || dir >= this->inodes){
+        return false;
+    }
+
+    // Count the name first, so the inode cannot be removed under it; the
+    // inode lock is dropped before the directory's is taken
+    if (adjust_links(inumber, 1) < 0){
+        return false;
+    }
+
+    bool   added  = false;
+    size_t length = strlen(name);
+    uint32_t hash = hash_name(name, length);
+    {
+        InodeGuard guard(inode_lock(dir), true);
+        Directory directory(this, dir);
+        if (directory.open()){
+            while (true){
+                uint32_t depth	= directory.get(HEADER_DEPTH);
+                uint32_t bucket = directory.bucket_of(hash);
+                Block	 block;
+                read_file_block(&directory.Node, BUCKET_START + bucket, &block, &directory.Map);
+                if (Directory::find(block.Names, name, length) >= 0){
+                    break;
+                }
+
+                if (block.Names.Count < ENTRIES_PER_BUCKET){
+                    Entry &entry = block.Names.Entries[block.Names.Count++];
+                    entry.Inumber = inumber;
+                    entry.Length  = length;
+                    memset(entry.Name, 0, NAME_LENGTH);
+                    memcpy(entry.Name, name, length);
+                    added = write_file_block(&directory.Node, BUCKET_START + bucket, &block, &directory.Map) &&
+                            directory.set(HEADER_ENTRIES, directory.get(HEADER_ENTRIES) + 1);
+                    break;
+                }
+
+                // Full bucket: double the table if no other entry points at
+                // the bucket, then split it on its next hash bit
+                uint32_t local = block.Names.Depth;
+                if (local == depth){
+                    if (depth == MAX_DEPTH){
+                        break;
+                    }
+                    // Copy through a buffer so each table block is read
+                    // and written once rather than once per entry
+                    std::vector<uint32_t> table(1u << depth);
+                    for (uint32_t i = 0; i < table.size(); i++){
+                        table[i] = directory.get(TABLE_START + i);
+                    }
+                    bool doubled = true;
+                    for (uint32_t i = 0; i < table.size() && doubled; i++){
+                        doubled = directory.set(TABLE_START + table.size() + i, table[i]);
+                    }
+                    if (!doubled || !directory.set(HEADER_DEPTH, ++depth)){
+                        break;
+                    }
+                }
+
+                uint32_t sibling = directory.get(HEADER_BUCKETS);
+                Block	 split;
+                memset(split.Data, 0, Disk::BLOCK_SIZE);
+                split.Names.Depth = block.Names.Depth = local + 1;
+                uint32_t kept = 0;
+                for (uint32_t i = 0; i < block.Names.Count; i++){
+                    Entry &entry = block.Names.Entries[i];
+                    if (hash_name(entry.Name, entry.Length) & (1u << local)){
+                        split.Names.Entries[split.Names.Count++] = entry;
+                    }else{
+                        block.Names.Entries[kept++] = entry;
+                    }
+                }
+                block.Names.Count = kept;
+
+                // New bucket goes down before any table entry points at it
+                if (!write_file_block(&directory.Node, BUCKET_START + sibling, &split, &directory.Map) ||
+                    !directory.set(HEADER_BUCKETS, sibling + 1)){
+                    break;
+                }
+                bool moved = true;
+                for (uint32_t i = hash & ((1u << local) - 1); i < (1u << depth) && moved; i += 1u << local){
+                    if (i & (1u << local)){
+                        moved = directory.set(TABLE_START + i, sibling);
+                    }
+                }
+                if (!moved || !write_file_block(&directory.Node, BUCKET_START + bucket, &block, &directory.Map)){
+                    break;
+                }
+            }
+            added = directory.close() && added;
+        }
+    }
+
+    if (!added){
+        adjust_links(inumber, -1);
+    }
+    return added;
+}
+
+// Unlink ----------------------------------------------------------------------
+
+bool FileSystem::unlink(size_t dir, const char *name) {
+    OpTimer    timer(&this->opStats.Unlink);
+    TraceScope trace(this->tracer, Trace::UNLINK, dir);
+    trace.set_name(name);
+    TransactionGuard transaction(this);
+    std::lock_guard<std::mutex> guard(this->namespaceLock);
+
+    if (!this->disk){
+        return false;
+    }
+
+    // Directories must be emptied first (changes to directories are
+    // serialized, so it cannot gain a name before its entry is removed)
+    ssize_t inumber = find_name(dir, name);
+    if (inumber < 0){
+        return false;
+    }
+    if (is_directory(inumber)){
+        Directory child(this, inumber);
+        InodeGuard childGuard(inode_lock(inumber), false);
+        if (!child.open() || child.get(HEADER_ENTRIES)){
+            return false;
+        }
+    }
+
+    size_t   length = strlen(name);
+    uint32_t hash   = hash_name(name, length);
+    {
+        InodeGuard dirGuard(inode_lock(dir), true);
+        Directory directory(this, dir);
+        if (!directory.open()){
+            return false;
+        }
+
+        // Buckets are never merged back, so an emptied bucket stays in the
+        // table for names that hash to it later
+        uint32_t bucket = directory.bucket_of(hash);
+        Block	 block;
+        read_file_block(&directory.Node, BUCKET_START + bucket, &block, &directory.Map);
+        int slot = Directory::find(block.Names, name, length);
+        if (slot < 0){
+            return false;
+        }
+        block.Names.Entries[slot] = block.Names.Entries[--block.Names.Count];
+        memset(&block.Names.Entries[block.Names.Count], 0, sizeof(Entry));
+        write_file_block(&directory.Node, BUCKET_START + bucket, &block, &directory.Map);
+        directory.set(HEADER_ENTRIES, directory.get(HEADER_ENTRIES) - 1);
+        directory.close();
+    }
+
+    if (adjust_links(inumber, -1) == 0){
+        remove_inode(inumber, true);
+    }
+    trace.set_result(1);
+    return true;
+}
+
+// Make directory --------------------------------------------------------------
+
+ssize_t FileSystem::mkdir(size_t dir, const char *name) {
+    OpTimer    timer(&this->opStats.Mkdir);
+    TraceScope trace(this->tracer, Trace::MKDIR, dir);
+    trace.set_name(name);
+    TransactionGuard transaction(this);
+    std::lock_guard<std::mutex> guard(this->namespaceLock);
+
+    if (!this->disk || !valid_name(name) || !is_directory(dir) || find_name(dir, name) >= 0){
+        return -1;
+    }
+
+    ssize_t inumber = make_directory();
+    if (inumber < 0){
+        return -1;
+    }
+    if (!add_link(dir, name, inumber)){
+        remove_inode(inumber, true);
+        return -1;
+    }
+    trace.set_result(inumber);
+    return inumber;
+}
@@ -2,14 +2,20 @@
 
 #include "sfs/disk.h"
 
+#include <algorithm>
 #include <stdexcept>
+#include <vector>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
-void Disk::open(const char *path, size_t nblocks) {
+const size_t Disk::DISCARD_RUN;
+
+void Disk::open(const char *path, size_t nblocks, Backend backend) {
     FileDescriptor = ::open(path, O_RDWR|O_CREAT, 0600);
     if (FileDescriptor < 0) {
     	char what[BUFSIZ];
@@ -23,21 +29,37 @@ void Disk::open(const char *path, size_t nblocks) {
     	throw std::runtime_error(what);
     }
 
+    if (backend == BACKEND_MMAP && nblocks > 0) {
+    	void *mapping = mmap(NULL, nblocks*BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, FileDescriptor, 0);
+    	if (mapping == MAP_FAILED) {
+	    char what[BUFSIZ];
+	    snprintf(what, BUFSIZ, "Unable to mmap %s: %s", path, strerror(errno));
+	    throw std::runtime_error(what);
+	}
+	Mapping = (char *)mapping;
+    }
+
     Blocks = nblocks;
     Reads  = 0;
     Writes = 0;
 }
 
 Disk::~Disk() {
+    stop_queue();
+
     if (FileDescriptor > 0) {
-    	printf("%lu disk block reads\n", Reads);
-    	printf("%lu disk block writes\n", Writes);
+    	printf("%lu disk block reads\n", Reads.load());
+    	printf("%lu disk block writes\n", Writes.load());
+    	if (Mapping) {
+    	    munmap(Mapping, Blocks*BLOCK_SIZE);
+    	    Mapping = nullptr;
+	}
     	close(FileDescriptor);
     	FileDescriptor = 0;
     }
 }
 
-void Disk::sanity_check(int blocknum, char *data) {
+void Disk::sanity_check(int blocknum, size_t nblocks, const void *data) {
     char what[BUFSIZ];
 
     if (blocknum < 0) {
@@ -45,8 +67,8 @@ void Disk::sanity_check(int blocknum, char *data) {
     	throw std::invalid_argument(what);
     }
 
-    if (blocknum >= (int)Blocks) {
-    	snprintf(what, BUFSIZ, "blocknum (%d) is too big!", blocknum);
+    if (blocknum + nblocks > Blocks) {
+    	snprintf(what, BUFSIZ, "blocknum (%d) is too big!", (int)(blocknum + nblocks - 1));
     	throw std::invalid_argument(what);
     }
 
@@ -56,38 +78,212 @@ void Disk::sanity_check(int blocknum, char *data) {
     }
 }
 
-void Disk::read(int blocknum, char *data) {
-    sanity_check(blocknum, data);
+void Disk::transfer(int blocknum, size_t nblocks, struct iovec *iov, int iovcnt, bool write) {
+    OpTimer    timer(write ? &IOStats.Write : &IOStats.Read, nblocks*BLOCK_SIZE);
+    TraceScope trace(Tracer, write ? Trace::DISK_WRITE : Trace::DISK_READ, blocknum, nblocks);
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+    if (Mapping) {
+    	char *block = Mapping + blocknum*BLOCK_SIZE;
+    	for (int i = 0; i < iovcnt; i++) {
+    	    if (write) {
+    	    	memcpy(block, iov[i].iov_base, iov[i].iov_len);
+	    } else {
+    	    	memcpy(iov[i].iov_base, block, iov[i].iov_len);
+	    }
+	    block += iov[i].iov_len;
+	}
+    } else {
+	off_t  offset    = (off_t)blocknum*BLOCK_SIZE;
+	size_t remaining = nblocks*BLOCK_SIZE;
+	while (remaining > 0) {
+	    // Large scatter lists are split at IOV_MAX and short transfers resumed
+	    int     count  = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+	    ssize_t result = write ? pwritev(FileDescriptor, iov, count, offset)
+	    			   : preadv(FileDescriptor, iov, count, offset);
+	    if (result <= 0) {
+		char what[BUFSIZ];
+		snprintf(what, BUFSIZ, "Unable to %s %d: %s", write ? "write" : "read", blocknum, result < 0 ? strerror(errno) : "short transfer");
+		throw std::runtime_error(what);
+	    }
+
+	    offset    += result;
+	    remaining -= result;
+	    while (iovcnt > 0 && (size_t)result >= iov->iov_len) {
+	    	result -= iov->iov_len;
+	    	iov++;
+	    	iovcnt--;
+	    }
+	    if (result > 0) {
+	    	iov->iov_base  = (char *)iov->iov_base + result;
+	    	iov->iov_len  -= result;
+	    }
+	}
     }
 
-    if (::read(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to read %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+    if (write) {
+    	Writes += nblocks;
+    } else {
+    	Reads  += nblocks;
     }
+    trace.set_result(nblocks);
+}
 
-    Reads++;
+void Disk::read(int blocknum, char *data) {
+    read_blocks(blocknum, 1, data);
 }
 
 void Disk::write(int blocknum, char *data) {
-    sanity_check(blocknum, data);
+    write_blocks(blocknum, 1, data);
+}
+
+void Disk::read_blocks(int blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, nblocks, data);
+
+    struct iovec iov = {data, nblocks*BLOCK_SIZE};
+    transfer(blocknum, nblocks, &iov, 1, false);
+}
+
+void Disk::read_blocks(int blocknum, size_t nblocks, char **buffers) {
+    sanity_check(blocknum, nblocks, buffers);
+
+    std::vector<struct iovec> iov(nblocks);
+    for (size_t i = 0; i < nblocks; i++) {
+    	iov[i].iov_base = buffers[i];
+    	iov[i].iov_len  = BLOCK_SIZE;
+    }
+    transfer(blocknum, nblocks, iov.data(), nblocks, false);
+}
+
+void Disk::write_blocks(int blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, nblocks, data);
+
+    struct iovec iov = {data, nblocks*BLOCK_SIZE};
+    transfer(blocknum, nblocks, &iov, 1, true);
+}
+
+void Disk::write_blocks(int blocknum, size_t nblocks, char **buffers) {
+    sanity_check(blocknum, nblocks, buffers);
+
+    std::vector<struct iovec> iov(nblocks);
+    for (size_t i = 0; i < nblocks; i++) {
+    	iov[i].iov_base = buffers[i];
+    	iov[i].iov_len  = BLOCK_SIZE;
+    }
+    transfer(blocknum, nblocks, iov.data(), nblocks, true);
+}
+
+void Disk::discard(int blocknum, size_t nblocks) {
+    sanity_check(blocknum, nblocks, this);
+
+    if (nblocks == 0) {
+    	return;
+    }
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // Punching through the file also drops the pages of a shared mapping
+    if (fallocate(FileDescriptor, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+    	    (off_t)blocknum*BLOCK_SIZE, (off_t)nblocks*BLOCK_SIZE) == 0) {
+    	return;
+    }
+    if (errno != EOPNOTSUPP && errno != ENOSYS) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to discard blocks: %s", strerror(errno));
     	throw std::runtime_error(what);
     }
+#endif
+
+    std::vector<char> zeros(std::min(nblocks, DISCARD_RUN)*BLOCK_SIZE, 0);
+    for (size_t i = 0; i < nblocks; ) {
+    	size_t run = std::min(nblocks - i, DISCARD_RUN);
+    	write_blocks(blocknum + i, run, zeros.data());
+    	i += run;
+    }
+}
+
+void Disk::configure_queue(size_t workers, size_t depth) {
+    stop_queue();
+    QueueWorkers = workers > 0 ? workers : 1;
+    QueueDepth   = depth > 0 ? depth : 1;
+}
+
+void Disk::submit(Request *request) {
+    std::unique_lock<std::mutex> lock(QueueLock);
 
-    if (::write(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    if (Workers.empty()) {
+    	Stopping = false;
+    	for (size_t i = 0; i < QueueWorkers; i++) {
+    	    Workers.emplace_back(&Disk::worker, this);
+	}
+    }
+
+    QueueSpace.wait(lock, [this]() { return InFlight < QueueDepth; });
+    request->Done = false;
+    request->Error.clear();
+    Queue.push_back(request);
+    InFlight++;
+    QueueReady.notify_one();
+}
+
+void Disk::wait(Request *request) {
+    std::unique_lock<std::mutex> lock(QueueLock);
+    QueueSpace.wait(lock, [request]() { return request->Done; });
+
+    if (!request->Error.empty()) {
+    	throw std::runtime_error(request->Error);
+    }
+}
+
+void Disk::worker() {
+    while (true) {
+    	std::unique_lock<std::mutex> lock(QueueLock);
+    	QueueReady.wait(lock, [this]() { return Stopping || !Queue.empty(); });
+    	if (Queue.empty()) {
+    	    return;
+	}
+
+	Request *request = Queue.front();
+	Queue.pop_front();
+	lock.unlock();
+
+	try {
+	    if (request->Write) {
+	    	write_blocks(request->BlockNumber, request->Blocks, request->Data);
+	    } else {
+	    	read_blocks(request->BlockNumber, request->Blocks, request->Data);
+	    }
+	} catch (std::exception &e) {
+	    request->Error = e.what();
+	}
+
+	if (request->Callback) {
+	    request->Callback(request);
+	}
+
+	lock.lock();
+	request->Done = true;
+	InFlight--;
+	QueueSpace.notify_all();
+    }
+}
+
+void Disk::stop_queue() {
+    {
+    	std::lock_guard<std::mutex> lock(QueueLock);
+    	Stopping = true;
+    }
+    QueueReady.notify_all();
+
+    for (auto &worker : Workers) {
+    	worker.join();
+    }
+    Workers.clear();
+}
+
+void Disk::flush() {
+    int result = Mapping ? msync(Mapping, Blocks*BLOCK_SIZE, MS_SYNC) : fdatasync(FileDescriptor);
+    if (result < 0) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to write %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to flush: %s", strerror(errno));
     	throw std::runtime_error(what);
     }
-
-    Writes++;
 }
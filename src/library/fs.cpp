@@ -3,13 +3,85 @@
 #include "sfs/fs.h"
 
 #include <algorithm>
+#include <chrono>
 
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
 
 #include <iostream>
+#include <exception>
+#include <stdexcept>
 #include <string>
+#include <thread>
+
+const uint32_t FileSystem::UNSCANNED;
+const uint32_t FileSystem::FORMAT_RUN;
+const uint32_t FileSystem::MAX_READAHEAD;
+const uint32_t FileSystem::REGION_BLOCKS;
+const uint32_t FileSystem::INODE_LOCKS;
+const uint32_t FileSystem::SCAN_BATCH;
+const uint32_t FileSystem::SCAN_MIN_BLOCKS;
+const uint32_t FileSystem::COMMIT_INTERVAL;
+const uint32_t FileSystem::CALL_BLOCKS;
+const uint32_t FileSystem::WRITE_PIECE;
+const uint32_t FileSystem::INLINE_SIZE;
+
+// Transactions the calling thread has open, one per file system it has a
+// call running on (a call on one file system may call into another)
+struct OpenTransaction {
+    const FileSystem *FS;	// File system transaction belongs to
+    uint32_t	      Depth;	// Number of begin_transaction calls not ended yet
+};
+static thread_local std::vector<OpenTransaction> OpenTransactions;
+
+// Return open transaction of calling thread on file system (nullptr if none)
+static OpenTransaction *open_transaction(const FileSystem *fs) {
+    for (auto &open : OpenTransactions){
+        if (open.FS == fs){
+            return &open;
+        }
+    }
+    return nullptr;
+}
+
+// Return nanoseconds on the steady clock
+static uint64_t steady_nanoseconds() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+// Return number of bytes covered by buffers
+static size_t iov_length(const struct iovec *iov, int iovcnt) {
+    size_t length = 0;
+    for (int i = 0; i < iovcnt; i++){
+        length += iov[i].iov_len;
+    }
+    return length;
+}
+
+// Constructor / destructor ----------------------------------------------------
+
+FileSystem::FileSystem(size_t cacheBlocks) : lastCommit(0), activeCalls(0), cacheBlocks(cacheBlocks) {
+    for (uint32_t i = 0; i < INODE_LOCKS; i++){
+        pthread_rwlock_init(&this->inodeLocks[i], nullptr);
+    }
+
+    // Commits must not wait behind a steady stream of calls
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&this->transactionLock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+}
+
+FileSystem::~FileSystem() {
+    unmount();
+    for (uint32_t i = 0; i < INODE_LOCKS; i++){
+        pthread_rwlock_destroy(&this->inodeLocks[i]);
+    }
+    pthread_rwlock_destroy(&this->transactionLock);
+}
 
 // Debug file system -----------------------------------------------------------
 
@@ -26,20 +98,35 @@ void FileSystem::debug(Disk *disk) {
     printf("    %u blocks\n"         , block.Super.Blocks);
     printf("    %u inode blocks\n"   , block.Super.InodeBlocks);
     printf("    %u inodes\n"         , block.Super.Inodes);
+    if (block.Super.Version >= 6 && block.Super.JournalBlocks) {
+        printf("    %u journal blocks\n", block.Super.JournalBlocks);
+    }
+    if (block.Super.Version >= 8) {
+        printf("    %u checksum blocks%s\n", block.Super.ChecksumBlocks, block.Super.DataChecksums ? " (data too)" : "");
+    }
 
     // Read Inode blocks
     Block inodeBlock;
     uint32_t numInodes = sizeof(Block)/sizeof(Inode);
-    for (uint32_t i=0; i < block.Super.InodeBlocks; i++){
+    uint32_t usedBlocks = block.Super.Version >= 3 ? block.Super.InodeHighWater : block.Super.InodeBlocks;
+    for (uint32_t i=0; i < usedBlocks; i++){
         disk->read(i+1, inodeBlock.Data);
         for (uint32_t j=0; j< numInodes; j++){
             if (inodeBlock.Inodes[j].Valid){
                 printf("Inode %d:\n", j+i*numInodes);
                 printf("    size: %d bytes\n", inodeBlock.Inodes[j].Size);
+                if (inodeBlock.Inodes[j].Valid & INODE_COMPRESSED){
+                    printf("    compressed clusters\n");
+                }
+                if (inodeBlock.Inodes[j].Valid & INODE_INLINE){
+                    printf("    inline data\n");
+                    continue;
+                }
                 //uint32_t directCounter = 0;
                 std::string directBlockString = "    direct blocks:";
                 bool directFlag = false;
-                for (uint32_t k=0; k < POINTERS_PER_INODE; k++){
+                uint32_t numDirect = block.Super.Version >= 2 ? POINTERS_PER_INODE - 1 : POINTERS_PER_INODE;
+                for (uint32_t k=0; k < numDirect; k++){
                     if (inodeBlock.Inodes[j].Direct[k]){
                         directFlag = true;
                         directBlockString += " ";
@@ -69,6 +156,35 @@ void FileSystem::debug(Disk *disk) {
                         std::cout << indiString << std::endl;
                     }
                 }
+                if (numDirect < POINTERS_PER_INODE && inodeBlock.Inodes[j].Direct[numDirect]) {
+                    printf("    double indirect block: %d\n", inodeBlock.Inodes[j].Direct[numDirect]);
+                    // Load Double Indirect Block, then each block it points to
+                    Block doubleBlock;
+                    disk->read(inodeBlock.Inodes[j].Direct[numDirect], doubleBlock.Data);
+                    std::string secondString = "    double indirect pointer blocks:";
+                    std::string dataString   = "    double indirect data blocks:";
+                    bool dataFlag = false;
+                    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++){
+                        if (!doubleBlock.Pointers[k]) {
+                            continue;
+                        }
+                        secondString += " ";
+                        secondString += std::to_string(doubleBlock.Pointers[k]);
+                        Block secondBlock;
+                        disk->read(doubleBlock.Pointers[k], secondBlock.Data);
+                        for (uint32_t l = 0; l < POINTERS_PER_BLOCK; l++){
+                            if (secondBlock.Pointers[l]) {
+                                dataFlag = true;
+                                dataString += " ";
+                                dataString += std::to_string(secondBlock.Pointers[l]);
+                            }
+                        }
+                    }
+                    std::cout << secondString << std::endl;
+                    if (dataFlag) {
+                        std::cout << dataString << std::endl;
+                    }
+                }
                 
             }
         }
@@ -77,13 +193,14 @@ void FileSystem::debug(Disk *disk) {
 
 // Format file system ----------------------------------------------------------
 
-bool FileSystem::format(Disk *disk) {
+bool FileSystem::format(Disk *disk, bool lazy, bool data) {
     // Write superblock
     if (disk->mounted()){
         return false;
     }
 
     Block superBlock;
+    memset(superBlock.Data, 0, Disk::BLOCK_SIZE);
     superBlock.Super.MagicNumber    = MAGIC_NUMBER;
     superBlock.Super.Blocks         = disk->size();
     if (disk->size()%10 == 0){
@@ -92,23 +209,113 @@ bool FileSystem::format(Disk *disk) {
         superBlock.Super.InodeBlocks    = disk->size()/10+1;
     }
     superBlock.Super.Inodes = superBlock.Super.InodeBlocks*INODES_PER_BLOCK;
+    superBlock.Super.Version        = FORMAT_VERSION;
+    superBlock.Super.State          = STATE_CLEAN;
+    superBlock.Super.BitmapBlocks   = bitmap_blocks(superBlock.Super.Blocks);
+    superBlock.Super.RootInode      = NO_ROOT;
+    superBlock.Super.JournalBlocks  = Journal::blocks_for(superBlock.Super.Blocks);
+    superBlock.Super.ChecksumBlocks = Checksums::blocks_for(superBlock.Super.Blocks);
+    superBlock.Super.DataChecksums  = data;
     int superBlockLocation = 0;
     disk->write(superBlockLocation, superBlock.Data);
     
-    // Clear all other blocks
-    Block emptyBlock = {0};
-    for (uint32_t i = 1; i < superBlock.Super.Blocks; i++){
-        disk->write(i, emptyBlock.Data);
+    // Clear all other blocks, writing runs of empty blocks with one request
+    // (a lazy format releases them instead: no inode block is read before
+    // it is used, and data blocks are only read once written); an empty
+    // checksum table holds no checksums
+    uint32_t bitmapStart  = superBlock.Super.InodeBlocks + 1;
+    uint32_t journalStart = bitmapStart + superBlock.Super.BitmapBlocks;
+    uint32_t dataStart    = journalStart + superBlock.Super.JournalBlocks + superBlock.Super.ChecksumBlocks;
+    std::vector<char> emptyBlocks(FORMAT_RUN*Disk::BLOCK_SIZE, 0);
+    for (uint32_t i = 1; i < superBlock.Super.Blocks; ){
+        if (i < bitmapStart || i >= journalStart){
+            uint32_t end = i < bitmapStart ? bitmapStart : superBlock.Super.Blocks;
+            if (lazy){
+                disk->discard(i, end - i);
+                i = end;
+                continue;
+            }
+            uint32_t run = std::min(end - i, FORMAT_RUN);
+            disk->write_blocks(i, run, emptyBlocks.data());
+            i += run;
+            continue;
+        }
+
+        // Mark every data block covered by this bitmap block as free
+        Block bitmapBlock = {0};
+        for (uint32_t j = 0; j < BITS_PER_BLOCK; j++){
+            uint32_t block = (i - bitmapStart)*BITS_PER_BLOCK + j;
+            if (block >= dataStart && block < superBlock.Super.Blocks){
+                bitmapBlock.Words[j/64] |= 1ULL << (j%64);
+            }
+        }
+        disk->write(i, bitmapBlock.Data);
+        i++;
     }
 
+    if (superBlock.Super.JournalBlocks){
+        Journal::format(disk, journalStart, superBlock.Super.JournalBlocks);
+    }
     return true;
 }
 
 // Mount file system -----------------------------------------------------------
 
+bool FileSystem::valid_super(const SuperBlock &super, size_t blocks) {
+    if (super.MagicNumber != MAGIC_NUMBER){
+        return false;
+    }   
 
-bool FileSystem::mount(Disk *disk) {
+    if (blocks != super.Blocks){
+        return false;
+    }
+    
+    if (blocks%10 == 0){
+        if (super.InodeBlocks != blocks/10){
+            return false;
+        }
+    }else{
+        if (super.InodeBlocks != blocks/10+1){
+            return false;
+        }
+    }
     
+    if (super.Inodes != INODES_PER_BLOCK*super.InodeBlocks){
+        return false;
+    }
+
+    if (super.Version > FORMAT_VERSION){
+        return false;
+    }
+
+    if (super.Version >= 1 && super.BitmapBlocks != bitmap_blocks(super.Blocks)){
+        return false;
+    }
+
+    if (super.Version >= 3 && super.InodeHighWater > super.InodeBlocks){
+        return false;
+    }
+
+    if (super.Version >= 4 && super.RootInode != NO_ROOT && super.RootInode >= super.Inodes){
+        return false;
+    }
+
+    if (super.Version >= 6 && super.JournalBlocks != Journal::blocks_for(super.Blocks)){
+        return false;
+    }
+
+    if (super.Version >= 8 && super.ChecksumBlocks != Checksums::blocks_for(super.Blocks)){
+        return false;
+    }
+
+    return true;
+}
+
+
+bool FileSystem::mount(Disk *disk) {
+    OpTimer    timer(&this->opStats.Mount);
+    TraceScope trace(this->tracer, Trace::MOUNT, disk->size());
+
     if (this->disk){
         return false;
     }   
@@ -118,392 +325,1728 @@ bool FileSystem::mount(Disk *disk) {
     Block superBlock;
     disk->read(0, superBlock.Data);
     
-    if (superBlock.Super.MagicNumber != MAGIC_NUMBER){
-        return false;
-    }   
-
-    if (disk->size() != superBlock.Super.Blocks){
+    if (!valid_super(superBlock.Super, disk->size())){
         return false;
     }
-    
-    if (disk->size()%10 == 0){
-        if (superBlock.Super.InodeBlocks != disk->size()/10){
-            return false;
-        }
-    }else{
-        if (superBlock.Super.InodeBlocks != disk->size()/10+1){
+
+    // Finish the work of transactions committed before a crash first
+    uint32_t journalBlocks = superBlock.Super.Version >= 6 ? superBlock.Super.JournalBlocks : 0;
+    if (journalBlocks){
+        uint32_t journalStart = 1 + superBlock.Super.InodeBlocks + superBlock.Super.BitmapBlocks;
+        this->journal = new Journal(disk, journalStart, journalBlocks);
+        try {
+            this->journal->recover();
+        } catch (std::runtime_error &) {
+            delete this->journal;
+            this->journal = nullptr;
             return false;
         }
     }
-    
-    if (superBlock.Super.Inodes != INODES_PER_BLOCK*superBlock.Super.InodeBlocks){
-        return false;
+
+    // The checksum table covers the inode table and bitmap, every block that
+    // has a checksum, and with data checksums the whole data region; without
+    // a journal it only matches the disk after a clean unmount, and with one
+    // data blocks written since the last commit are taken as they are
+    uint32_t checksumBlocks = superBlock.Super.Version >= 8 ? superBlock.Super.ChecksumBlocks : 0;
+    if (checksumBlocks){
+        uint32_t checksumStart = 1 + superBlock.Super.InodeBlocks + superBlock.Super.BitmapBlocks + journalBlocks;
+        uint32_t dataStart     = checksumStart + checksumBlocks;
+        this->checksums = new Checksums(disk, checksumStart, superBlock.Super.Blocks);
+        this->checksums->load();
+        if (!this->journal && superBlock.Super.State != STATE_CLEAN){
+            this->checksums->clear();
+        }else if (superBlock.Super.State != STATE_CLEAN){
+            this->checksums->recover();
+        }
+        this->checksums->cover(1, superBlock.Super.InodeBlocks + superBlock.Super.BitmapBlocks);
+        if (superBlock.Super.DataChecksums){
+            this->checksums->cover(dataStart, superBlock.Super.Blocks - dataStart);
+            if (this->journal){
+                this->checksums->track(dataStart, superBlock.Super.Blocks - dataStart);
+            }
+        }
     }
 
     // Set device and mount
     this->disk = disk;
+    this->cache = new Cache(disk, this->cacheBlocks, this->checksums);
     disk->mount();
 
-    // Copy metadata
+    // Copy metadata; from now on the superblock is only written from the
+    // copy kept here
+    this->superBlock    = superBlock;
     this->numBlocks     = superBlock.Super.Blocks;
     this->inodeBlocks   = superBlock.Super.InodeBlocks;
     this->inodes        = superBlock.Super.Inodes;
- 
-    // Allocate free block bitmap
-    this->freeBlocks = new bool[this->numBlocks];
-    for (uint32_t i = 0; i < this->numBlocks; i++){
-        this->freeBlocks[i] = true;
+    this->version       = superBlock.Super.Version;
+    this->bitmapBlocks  = this->version >= 1 ? superBlock.Super.BitmapBlocks : 0;
+    this->inodeHighWater = this->version >= 3 ? superBlock.Super.InodeHighWater : this->inodeBlocks;
+    this->rootInode     = this->version >= 4 ? superBlock.Super.RootInode : NO_ROOT;
+    this->journalBlocks = journalBlocks;
+    this->checksumBlocks = checksumBlocks;
+    this->dataChecksums = checksumBlocks && superBlock.Super.DataChecksums;
+    this->bitmapDirty.assign(this->bitmapBlocks, false);
+    this->dirtyBitmapBlocks = 0;
+    this->releasedBlocks.clear();
+    this->lastCommit    = steady_nanoseconds();
+
+    // Inode blocks are indexed by the scan below or on demand by create
+    this->freeInodes.resize(this->inodes, false);
+    this->freeInodeCounts.assign(this->inodeBlocks, UNSCANNED);
+    this->nextUnscanned = 0;
+
+    // Trust saved bitmap only if the last mount was cleanly unmounted, or
+    // if the journal kept it in step with the inodes, and it is intact
+    bool trusted = this->journal || (this->version >= 1 && superBlock.Super.State == STATE_CLEAN);
+    if (!trusted || !load_free_blocks()){
+        // Blocks of an inode that fails its checksum cannot be told from
+        // free ones, so the disk needs fsck before it can be mounted
+        try {
+            scan_free_blocks();
+        } catch (std::runtime_error &) {
+            delete this->cache;
+            this->cache = nullptr;
+            delete this->journal;
+            this->journal = nullptr;
+            delete this->checksums;
+            this->checksums = nullptr;
+            this->disk->unmount();
+            this->disk = nullptr;
+            return false;
+        }
+        this->bitmapDirty.assign(this->bitmapBlocks, true);
+        this->dirtyBitmapBlocks = this->bitmapBlocks;
     }
-    this->freeBlocks[0] = false;
-    for (uint32_t i = 0; i < this->inodeBlocks; i++){
-        this->freeBlocks[i+1] = false;
+    count_free_regions();
+
+    // The root is written to the superblock before the transaction that
+    // makes it commits, so a crash may leave it naming a free inode
+    if (this->journal && this->rootInode != NO_ROOT && !is_directory(this->rootInode)){
+        this->rootInode = NO_ROOT;
+        this->superBlock.Super.RootInode = NO_ROOT;
     }
 
-    Block inodeBlock;
+    // Mark file system as in use until unmount
+    if (this->version >= 1){
+        write_state(STATE_DIRTY);
+    }
+
+    trace.set_result(1);
+    return true;
+}
+
+void FileSystem::scan_free_blocks() {
+    // Split used part of inode table into one range per thread, keeping
+    // enough inode blocks in each range to pay for starting the thread
+    uint32_t usedBlocks = this->inodeHighWater;
+    uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max(1u, std::min(threads, usedBlocks/SCAN_MIN_BLOCKS));
+    uint32_t perThread = (usedBlocks + threads - 1)/threads;
+
+    // Each thread marks the blocks it finds in a private map, so no locking
+    // is needed until the maps are merged
+    std::vector<Bitmap>   used(threads);
+    std::vector<uint64_t> valid(this->inodeBlocks*INODES_PER_BLOCK/64, 0);
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < threads; t++){
+        uint32_t first = std::min(t*perThread, usedBlocks);
+        uint32_t last  = std::min(first + perThread, usedBlocks);
+        used[t].resize(this->numBlocks, false);
+        auto scan = [this, first, last, &used, &valid, &errors, t]() {
+            try {
+                scan_inode_blocks(first, last, &used[t], &valid);
+            } catch (...) {
+                errors[t] = std::current_exception();
+            }
+        };
+        if (t + 1 < threads){
+            workers.emplace_back(scan);
+        }else{
+            scan();
+        }
+    }
+    for (auto &worker : workers){
+        worker.join();
+    }
+    for (auto &error : errors){
+        if (error){
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Free blocks are those no thread saw, minus the metadata at the front
+    this->freeBlocks.resize(this->numBlocks, true);
+    for (size_t w = 0; w < this->freeBlocks.words(); w++){
+        uint64_t word = this->freeBlocks.word(w);
+        for (uint32_t t = 0; t < threads; t++){
+            word &= ~used[t].word(w);
+        }
+        this->freeBlocks.set_word(w, word);
+    }
+    for (uint32_t i = 0; i <= this->inodeBlocks + this->bitmapBlocks + this->journalBlocks + this->checksumBlocks; i++){
+        this->freeBlocks.clear(i);
+    }
+
+    // Index every inode block at once from the valid inode map (blocks past
+    // the high-water mark hold no valid inodes)
+    for (size_t w = 0; w < valid.size(); w++){
+        this->freeInodes.set_word(w, ~valid[w]);
+    }
     for (uint32_t i = 0; i < this->inodeBlocks; i++){
-        //std::cout << "Block num: " << i << "\n";
-        disk->read(i+1, inodeBlock.Data);
-        for (uint32_t j = 0; j < INODES_PER_BLOCK; j++){
-            if (inodeBlock.Inodes[j].Valid){
-                for (uint32_t k = 0; k < POINTERS_PER_INODE; k++){
-                    if (inodeBlock.Inodes[j].Direct[k]){
-                        this->freeBlocks[inodeBlock.Inodes[j].Direct[k]] = false;
+        this->freeInodeCounts[i] = this->freeInodes.count(i*INODES_PER_BLOCK, (i + 1)*INODES_PER_BLOCK);
+    }
+    this->nextUnscanned = this->inodeBlocks;
+}
+
+void FileSystem::scan_inode_blocks(uint32_t first, uint32_t last, Bitmap *used, std::vector<uint64_t> *valid) {
+    std::vector<Block> inodeBlocks(SCAN_BATCH);
+    for (uint32_t i = first; i < last; i += SCAN_BATCH){
+        uint32_t count = std::min(SCAN_BATCH, last - i);
+        disk->read_blocks(i+1, count, inodeBlocks[0].Data);
+        cache->check(i+1, count, inodeBlocks[0].Data);
+
+        for (uint32_t b = 0; b < count; b++){
+            for (uint32_t j = 0; j < INODES_PER_BLOCK; j++){
+                Inode *node = &inodeBlocks[b].Inodes[j];
+                if (!node->Valid){
+                    continue;
+                }
+
+                size_t inumber = (size_t)(i + b)*INODES_PER_BLOCK + j;
+                (*valid)[inumber/64] |= 1ULL << (inumber%64);
+                if (node->Valid & INODE_INLINE){
+                    continue;
+                }
+                for (uint32_t k = 0; k < direct_pointers(); k++){
+                    if (node->Direct[k] && node->Direct[k] < this->numBlocks){
+                        used->set(node->Direct[k]);
                     }
                 }
-                if (inodeBlock.Inodes[j].Indirect){
-                    this->freeBlocks[inodeBlock.Inodes[j].Indirect] = false;
-                    Block indirectBlock;
-                    disk->read(inodeBlock.Inodes[j].Indirect, indirectBlock.Data);
-                    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++){
-                        if (indirectBlock.Pointers[k]){
-                            this->freeBlocks[indirectBlock.Pointers[k]] = false;
-                        }
-                    } 
+                scan_tree(node->Indirect, 1, used);
+                if (this->version >= 2){
+                    scan_tree(node->Direct[direct_pointers()], 2, used);
                 }
             }
         }
     }
-    
-    return true;
 }
 
-// Create inode ----------------------------------------------------------------
+void FileSystem::scan_tree(uint32_t block, uint32_t depth, Bitmap *used) {
+    if (!block || block >= this->numBlocks){
+        return;
+    }
+    used->set(block);
 
-void FileSystem::initialize_inode(Inode *node) {
-    for (uint32_t i = 0; i < POINTERS_PER_INODE; i++) {
-        node->Direct[i] = 0;
+    Block pointerBlock;
+    disk->read(block, pointerBlock.Data);
+    cache->check(block, 1, pointerBlock.Data);
+    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++){
+        uint32_t pointer = pointerBlock.Pointers[k];
+        if (depth > 1){
+            scan_tree(pointer, depth - 1, used);
+        }else if (pointer && pointer < this->numBlocks){
+            used->set(pointer);
+        }
     }
-    node->Indirect  = 0;
-    node->Size      = 0;
 }
 
-ssize_t FileSystem::create() {
-    // Locate free inode in inode table
-    ssize_t inodeNumber = -1;
-    for (uint32_t i = 0; i < this->inodeBlocks; i++) {
-        Block inodeBlock;
-        disk->read(i+1, inodeBlock.Data);
-        for (uint32_t j = 0; j < INODES_PER_BLOCK; j++){
-            if (!inodeBlock.Inodes[j].Valid){
-                inodeBlock.Inodes[j].Valid = 1;
-                initialize_inode(&inodeBlock.Inodes[j]);
-                this->disk->write(i+1, inodeBlock.Data);
-                inodeNumber = j+INODES_PER_BLOCK*i;
-                break;
-            }
+bool FileSystem::load_free_blocks() {
+    this->freeBlocks.resize(this->numBlocks, false);
+
+    Block bitmapBlock;
+    for (uint32_t i = 0; i < this->bitmapBlocks; i++){
+        disk->read(this->inodeBlocks + 1 + i, bitmapBlock.Data);
+        if (this->checksums && !this->checksums->verify(this->inodeBlocks + 1 + i, 1, bitmapBlock.Data)){
+            return false;
         }
-        if (inodeNumber != -1) {
-            break;
+        for (uint32_t j = 0; j < WORDS_PER_BLOCK; j++){
+            size_t word = i*WORDS_PER_BLOCK + j;
+            if (word < this->freeBlocks.words()){
+                this->freeBlocks.set_word(word, bitmapBlock.Words[j]);
+            }
         }
     }
-    
-    // Record inode if found   
-
-    return inodeNumber;
+    return true;
 }
 
-// Remove inode ----------------------------------------------------------------
+void FileSystem::save_free_blocks() {
+    std::lock_guard<std::mutex> guard(this->allocLock);
 
-bool FileSystem::remove(size_t inumber) {
-    // Load inode information
-    Inode node_to_remove;
-    load_inode(inumber, &node_to_remove);
-    
-    if (!node_to_remove.Valid){
-        return false;
-    }  
- 
-    // Free direct blocks
-    for (uint32_t i = 0; i < POINTERS_PER_INODE; i++){
-        this->freeBlocks[node_to_remove.Direct[i]] = true;
-        node_to_remove.Direct[i] = 0;
-    }   
- 
-    // Free indirect blocks
-    if (node_to_remove.Indirect){
-        Block indirectBlock;
-        this->disk->read(node_to_remove.Indirect, indirectBlock.Data);    
-        for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++){
-            this->freeBlocks[indirectBlock.Pointers[i]] = true;
+    Block bitmapBlock;
+    for (uint32_t i = 0; i < this->bitmapBlocks; i++){
+        if (journaled() && !this->bitmapDirty[i]){
+            continue;
+        }
+        for (uint32_t j = 0; j < WORDS_PER_BLOCK; j++){
+            size_t word = i*WORDS_PER_BLOCK + j;
+            bitmapBlock.Words[j] = word < this->freeBlocks.words() ? this->freeBlocks.word(word) : 0;
         }
-        node_to_remove.Indirect = 0;
+        cache->write(this->inodeBlocks + 1 + i, bitmapBlock.Data, journaled());
+        this->bitmapDirty[i] = false;
     }
+    this->dirtyBitmapBlocks = 0;
+}
 
-    // Clear inode in inode table
-    node_to_remove.Valid = 0;
-    node_to_remove.Size  = 0;
+void FileSystem::save_checksums() {
+    if (journaled()){
+        std::vector<int>  blocks;
+        std::vector<char> images;
+        this->cache->pinned_blocks(&blocks, &images);
+        for (size_t i = 0; i < blocks.size(); i++){
+            this->checksums->update(blocks[i], 1, images.data() + i*Disk::BLOCK_SIZE);
+        }
+    }
 
-    save_inode(inumber, &node_to_remove);
+    std::vector<uint32_t> blocks;
+    std::vector<char>     table;
+    this->checksums->dirty_blocks(&blocks, &table);
+    for (size_t i = 0; i < blocks.size(); i++){
+        cache->write(blocks[i], table.data() + i*Disk::BLOCK_SIZE, journaled());
+    }
+}
 
-    return true;
+void FileSystem::count_free_regions() {
+    uint32_t regions = (this->numBlocks + REGION_BLOCKS - 1)/REGION_BLOCKS;
+    this->regionFree.resize(regions);
+    for (uint32_t i = 0; i < regions; i++){
+        this->regionFree[i] = this->freeBlocks.count((size_t)i*REGION_BLOCKS, (size_t)(i + 1)*REGION_BLOCKS);
+    }
 }
 
-// Inode stat ------------------------------------------------------------------
+void FileSystem::write_state(uint32_t state) {
+    std::lock_guard<std::mutex> guard(this->superLock);
+    this->superBlock.Super.State = state;
+    disk->write(0, this->superBlock.Data);
+}
 
-ssize_t FileSystem::stat(size_t inumber) {
-    // Load inode information
-    if (inumber >= this->inodes){
-        return -1;
+void FileSystem::write_high_water(uint32_t end) {
+    std::lock_guard<std::mutex> guard(this->superLock);
+    if (this->version >= 3){
+        this->superBlock.Super.InodeHighWater = end;
+        disk->write(0, this->superBlock.Data);
     }
+}
 
-    Inode statInode;
-    bool validInode = load_inode(inumber, &statInode);
-    if (!validInode){
-        return -1;
+void FileSystem::write_root(uint32_t inumber) {
+    std::lock_guard<std::mutex> guard(this->superLock);
+    if (this->version >= 4){
+        this->superBlock.Super.RootInode = inumber;
+        disk->write(0, this->superBlock.Data);
     }
-
-    return statInode.Size;
 }
 
-// Read from inode -------------------------------------------------------------
+// Unmount file system ---------------------------------------------------------
 
-ssize_t FileSystem::read(size_t inumber, char *data, size_t length, size_t offset) {
-    
-    if (inumber >= this->inodes){ 
-        return -1;
+void FileSystem::unmount() {
+    if (!this->disk){
+        return;
     }
+    TraceScope trace(this->tracer, Trace::UNMOUNT, 0);
+    trace.set_result(0);
 
-    // Load inode information
-    Inode loadedInode;
-    bool validInode = load_inode(inumber, &loadedInode);
-    if (!validInode) { 
-        return -1; 
+    // Persist free block bitmap, then mark file system clean once everything
+    // it describes is on disk
+    if (this->journal){
+        pthread_rwlock_wrlock(&this->transactionLock);
+        commit_locked();
+        this->journal->checkpoint(this->cache);
+        pthread_rwlock_unlock(&this->transactionLock);
+    }else if (this->version >= 1){
+        save_free_blocks();
+    }
+    this->cache->sync();
+    if (this->checksums && !this->journal){
+        // Checksums of every block written back go last
+        save_checksums();
+        this->cache->sync();
+    }
+    if (this->version >= 1){
+        this->disk->flush();
+        write_state(STATE_CLEAN);
     }
+    this->disk->flush();
 
-    if (loadedInode.Size == offset) { 
-        return -1; 
+    this->cache->discard_prefetches();
+    printf("%lu cache hits\n", this->cache->hits());
+    printf("%lu cache misses\n", this->cache->misses());
+    printf("%lu cache evictions\n", this->cache->evictions());
+    printf("%lu readahead hits\n", this->cache->readahead_hits());
+    printf("%lu readahead wasted\n", this->cache->readahead_wasted());
+    if (this->journal){
+        printf("%lu journal commits\n", this->journal->commits());
+        printf("%lu journal blocks\n", this->journal->logged_blocks());
     }
+    delete this->cache;
+    this->cache = nullptr;
+    delete this->journal;
+    this->journal = nullptr;
+    delete this->checksums;
+    this->checksums = nullptr;
+    this->streams.clear();
 
-    // Adjust length
-    length = std::min(length, loadedInode.Size - offset);
+    this->disk->unmount();
+    this->disk = nullptr;
+}
 
-    uint32_t startBlock = offset/Disk::BLOCK_SIZE;
-    uint32_t startByte  = offset%Disk::BLOCK_SIZE;
-   
-    // Read block and copy to data
-    std::string dataString = "";
-    Block readFromBlock;
-    size_t   readIndex = length;
-    uint32_t dataIndex = 0;
-    while (startBlock < POINTERS_PER_INODE ){
-        if (!loadedInode.Direct[startBlock]){
-            startBlock++;
-            startByte = 0;
-            continue;
-        }
-        
-        disk->read(loadedInode.Direct[startBlock], readFromBlock.Data);
-        size_t blockSizeVar = Disk::BLOCK_SIZE;
-        uint32_t dataSize = std::min(startByte + readIndex, blockSizeVar);
-        uint32_t incrementer = startByte;
-        
-        while (incrementer < dataSize){
-            dataString += readFromBlock.Data[incrementer];
-            incrementer++;
-            dataIndex++;
-        }
-        readIndex = readIndex - dataSize + startByte;
-        startByte = 0;
-        startBlock++;
-    }       
-
-    Block indirectBlock;
-    if (readIndex && loadedInode.Indirect){
-        disk->read(loadedInode.Indirect, indirectBlock.Data);
-        startBlock = startBlock - POINTERS_PER_INODE;
-        while (startBlock < POINTERS_PER_BLOCK){
-            if (!indirectBlock.Pointers[startBlock]){
-                startBlock++;
-                startByte = 0;
-                continue;       
-            }
-            disk->read(indirectBlock.Pointers[startBlock], readFromBlock.Data);
-            size_t blockSizeVar = this->disk->BLOCK_SIZE;
-            uint32_t dataSize = std::min(startByte + readIndex, blockSizeVar);
-            uint32_t incrementer = startByte;
-            while (incrementer < dataSize){
-                dataString += readFromBlock.Data[incrementer];
-                dataIndex++;
-                incrementer++;
-            }
-            readIndex = readIndex - dataSize + startByte;
-            startByte = 0;
-            startBlock++;
-            
-        }
+// Sync file system ------------------------------------------------------------
+
+void FileSystem::sync() {
+    TraceScope trace(this->tracer, Trace::SYNC, 0);
+    trace.set_result(0);
+    if (!this->cache || (this->journal && open_transaction(this))) {
+        return;
     }
 
-    memcpy(data, dataString.c_str(), dataString.size());
-    return dataIndex;
+    if (this->journal) {
+        pthread_rwlock_wrlock(&this->transactionLock);
+        commit_locked();
+        this->journal->checkpoint(this->cache);
+        pthread_rwlock_unlock(&this->transactionLock);
+    } else {
+        this->cache->sync();
+    }
 }
 
-// Write to inode --------------------------------------------------------------
-size_t FileSystem::allocate_free_block(){
-    for (uint32_t i = 0; i < this->numBlocks; i++){
-        if (this->freeBlocks[i]){
-            this->freeBlocks[i] = false;
-            return i;
+// Transactions ----------------------------------------------------------------
+
+void FileSystem::begin_transaction() {
+    OpenTransaction *open = open_transaction(this);
+    if (open){
+        open->Depth++;
+        return;
+    }
+
+    // Join the running transaction only while the journal has room for this
+    // call too; otherwise commit it first, between calls
+    while (true){
+        pthread_rwlock_rdlock(&this->transactionLock);
+        size_t calls = ++this->activeCalls;
+        if (!this->journal || transaction_fits(calls)){
+            OpenTransactions.push_back({this, 1});
+            return;
+        }
+        this->activeCalls--;
+        pthread_rwlock_unlock(&this->transactionLock);
+
+        pthread_rwlock_wrlock(&this->transactionLock);
+        if (!transaction_fits(1)){
+            commit_locked();
         }
+        pthread_rwlock_unlock(&this->transactionLock);
     }
-    return 0;
 }
 
-ssize_t FileSystem::write(size_t inumber, char *data, size_t length, size_t offset) {
-    
-    
-    if (inumber >= this->inodes){ 
-        printf("First check failed\n");
-        return -1;
+void FileSystem::end_transaction() {
+    OpenTransaction *open = open_transaction(this);
+    if (--open->Depth > 0){
+        return;
     }
+    OpenTransactions.erase(OpenTransactions.begin() + (open - OpenTransactions.data()));
+    this->activeCalls--;
+    pthread_rwlock_unlock(&this->transactionLock);
 
-    // Load inode information
-    Inode loadedInode;
-    bool validInode = load_inode(inumber, &loadedInode);
-    if (!validInode) { 
-        return -1;
+    if (!this->journal){
+        return;
     }
-    size_t   readIndex = length;
-    size_t blockSizeVar = Disk::BLOCK_SIZE;
-
-
-    uint32_t startBlock = offset/Disk::BLOCK_SIZE;
-    uint32_t startByte  = offset%Disk::BLOCK_SIZE;
-   
-    // Read block and copy to data
-    std::string dataString = data;
-    Block readFromBlock;
-    uint32_t dataIndex = 0;
-    while (readIndex > 0 && startBlock < POINTERS_PER_INODE ){
-        if (!loadedInode.Direct[startBlock]){
-            loadedInode.Direct[startBlock] = allocate_free_block();
-            if (!loadedInode.Direct[startBlock]){
-                startBlock++;
-                continue;               
-            }
-        }
-            
-        
-        disk->read(loadedInode.Direct[startBlock], readFromBlock.Data);
-        uint32_t dataSize = std::min(startByte + readIndex, blockSizeVar);
-        uint32_t incrementer = startByte;
-        
-        while (incrementer < dataSize){
-            readFromBlock.Data[incrementer] = dataString[dataIndex];
-            incrementer++;
-            dataIndex++;
-        }
-        loadedInode.Size += dataSize - startByte;
-        save_inode(inumber, &loadedInode);
-        this->disk->write(loadedInode.Direct[startBlock], readFromBlock.Data);
-        readIndex = readIndex - dataSize + startByte;
-        startByte = 0;
-        startBlock++;
-    }       
-    
-    Block indirectBlock = {0};
-    if (readIndex || startBlock > POINTERS_PER_INODE){
-        if (!loadedInode.Indirect){
-            loadedInode.Indirect = allocate_free_block();
-            if (!loadedInode.Indirect){
-                loadedInode.Size += dataIndex;
-                return dataIndex;
-            }
-        }else{
-            disk->read(loadedInode.Indirect, indirectBlock.Data);
-        }
-        startBlock = startBlock - POINTERS_PER_INODE;
-        while (startBlock < POINTERS_PER_BLOCK && readIndex > 0){
-            if (!indirectBlock.Pointers[startBlock]){
-                indirectBlock.Pointers[startBlock] = allocate_free_block();
-                if (!indirectBlock.Pointers[startBlock]){
-                    startBlock++;
-                    startByte = 0;
-                    continue;
-                }
-            }
-            disk->read(indirectBlock.Pointers[startBlock], readFromBlock.Data);
-            size_t blockSizeVar = this->disk->BLOCK_SIZE;
-            uint32_t dataSize = std::min(startByte + readIndex, blockSizeVar);
-            uint32_t incrementer = startByte;
-            while (incrementer < dataSize){
-                readFromBlock.Data[incrementer] = dataString[dataIndex];
-                dataIndex++;
-                incrementer++;
-            }
-            loadedInode.Size += dataSize - startByte;
-            this->disk->write(indirectBlock.Pointers[startBlock], readFromBlock.Data);
-            readIndex = readIndex - dataSize + startByte;
-            startByte = 0;
-            startBlock++;
-            
-        }
-        this->disk->write(loadedInode.Indirect, indirectBlock.Data);
+    size_t released;
+    {
+        std::lock_guard<std::mutex> guard(this->allocLock);
+        released = this->releasedBlocks.size();
+    }
+    // Also bound how long a change can wait, as with a commit timer
+    uint64_t age = steady_nanoseconds() - this->lastCommit;
+    if (this->cache->pinned() >= commit_threshold() || released >= commit_threshold()*POINTERS_PER_BLOCK ||
+        age >= COMMIT_INTERVAL*1000000000ULL){
+        commit();
     }
+}
 
-    validInode = save_inode(inumber, &loadedInode);
-    if (!validInode){
-        return -1;
-    }    
+size_t FileSystem::commit_threshold() const {
+    // Commit before the transaction outgrows the journal or holds the
+    // cache at twice its capacity
+    size_t threshold = std::min<size_t>(this->journal->capacity()/2, this->cacheBlocks);
+    return std::max<size_t>(threshold, 1);
+}
 
-    return dataIndex;
-   
+bool FileSystem::transaction_fits(size_t calls) const {
+    // Bitmap and checksum table blocks changed so far join the transaction
+    // when it commits; a call alone always fits once the one before it has
+    // committed
+    size_t pending = this->cache->pinned() + this->dirtyBitmapBlocks + (this->checksums ? this->checksums->dirty() : 0);
+    return pending + calls*CALL_BLOCKS <= this->journal->capacity() || (calls == 1 && this->cache->pinned() == 0);
 }
 
-bool FileSystem::load_inode(size_t inumber, Inode *node) {
-    Block nodeBlock;
-    this->disk->read(inumber/INODES_PER_BLOCK+1, nodeBlock.Data);
-    *node = nodeBlock.Inodes[inumber%INODES_PER_BLOCK];
-    if (node->Valid) {
-        return true;
+void FileSystem::commit() {
+    if (!this->cache || open_transaction(this)){
+        return;
     }
-    return false;
-}   
 
-bool FileSystem::save_inode(size_t inumber, Inode *node){
- 
-    Block nodeBlock;
-    this->disk->read(inumber/INODES_PER_BLOCK+1, nodeBlock.Data);
- 
-    nodeBlock.Inodes[inumber%INODES_PER_BLOCK] = *node;
+    if (!this->journal){
+        this->cache->sync();
+        this->disk->flush();
+        return;
+    }
+    pthread_rwlock_wrlock(&this->transactionLock);
+    commit_locked();
+    pthread_rwlock_unlock(&this->transactionLock);
+}
+
+void FileSystem::commit_locked() {
+    // Blocks freed by the transaction become free as part of it, as far as
+    // half the room left in the journal goes (the rest is kept for the
+    // checksums of the transaction); the others follow in transactions of
+    // their own
+    do {
+        {
+            std::lock_guard<std::mutex> guard(this->allocLock);
+            size_t pending = this->cache->pinned() + this->dirtyBitmapBlocks + (this->checksums ? this->checksums->dirty() : 0);
+            size_t room    = this->journal->capacity();
+            free_released(pending < room ? (room - pending)/2 : 0);
+        }
+        save_free_blocks();
+        if (this->checksums){
+            // Data goes home first, so its checksums commit with the metadata
+            this->cache->sync(false);
+            save_checksums();
+        }
+        this->journal->commit(this->cache);
+    } while (!this->releasedBlocks.empty());
+    if (this->checksums){
+        this->checksums->settle();
+    }
+    this->lastCommit = steady_nanoseconds();
+}
+
+// Create inode ----------------------------------------------------------------
 
-    uint32_t blockCounter = 0;
-    for (uint32_t i = 0; i < POINTERS_PER_INODE; i++){
-        if (node->Direct[i]){
-            blockCounter++;
+void FileSystem::initialize_inode(Inode *node) {
+    for (uint32_t i = 0; i < POINTERS_PER_INODE; i++) {
+        node->Direct[i] = 0;
+    }
+    node->Indirect  = 0;
+    node->Size      = 0;
+}
+
+void FileSystem::index_inode_block(uint32_t block, const Block &inodeBlock) {
+    uint32_t freeCount = 0;
+    for (uint32_t j = 0; j < INODES_PER_BLOCK; j++){
+        if (!inodeBlock.Inodes[j].Valid){
+            this->freeInodes.set(block*INODES_PER_BLOCK + j);
+            freeCount++;
+        }
+    }
+    this->freeInodeCounts[block] = freeCount;
+    this->nextUnscanned = std::max(this->nextUnscanned, block + 1);
+}
+
+ssize_t FileSystem::allocate_free_inode() {
+    std::lock_guard<std::mutex> guard(this->inodeIndexLock);
+
+    // Indexed blocks always form a prefix of the inode table, so any indexed
+    // free inode is lower than every inode in blocks not scanned yet
+    size_t inumber = this->freeInodes.find_first();
+    while (inumber == Bitmap::NPOS && this->nextUnscanned < this->inodeBlocks){
+        Block inodeBlock;
+        if (this->nextUnscanned < this->inodeHighWater){
+            cache->read(this->nextUnscanned+1, inodeBlock.Data);
+        }else{
+            memset(inodeBlock.Data, 0, Disk::BLOCK_SIZE);
         }
+        index_inode_block(this->nextUnscanned, inodeBlock);
+        inumber = this->freeInodes.find_first();
+    }
+
+    if (inumber == Bitmap::NPOS){
+        return -1;
+    }
+
+    if (inumber/INODES_PER_BLOCK >= this->inodeHighWater){
+        initialize_inode_blocks(inumber/INODES_PER_BLOCK + 1);
+    }
+
+    this->freeInodes.clear(inumber);
+    this->freeInodeCounts[inumber/INODES_PER_BLOCK]--;
+    return inumber;
+}
+
+void FileSystem::initialize_inode_blocks(uint32_t end) {
+    // Blocks must read as empty before the superblock says they are in use,
+    // so they go straight to disk rather than through the cache
+    std::vector<char> emptyBlocks((end - this->inodeHighWater)*Disk::BLOCK_SIZE, 0);
+    cache->write_blocks(this->inodeHighWater+1, end - this->inodeHighWater, emptyBlocks.data());
+    this->inodeHighWater = end;
+    write_high_water(end);
+}
+
+ssize_t FileSystem::create() {
+    OpTimer    timer(&this->opStats.Create);
+    TraceScope trace(this->tracer, Trace::CREATE, 0);
+
+    ssize_t inumber = create_inode();
+    trace.set_result(inumber);
+    return inumber;
+}
+
+ssize_t FileSystem::create_inode() {
+    TransactionGuard transaction(this);
+
+    // Locate free inode in inode table
+    ssize_t inodeNumber = allocate_free_inode();
+    if (inodeNumber < 0) {
+        return -1;
+    }
+
+    // Record inode, writing only its own slot since other inodes in the
+    // same block may be changing concurrently
+    InodeGuard guard(inode_lock(inodeNumber), true);
+    Inode newInode;
+    initialize_inode(&newInode);
+    newInode.Valid = 1;
+    save_inode(inodeNumber, &newInode);
+    return inodeNumber;
+}
+
+// Remove inode ----------------------------------------------------------------
+
+bool FileSystem::remove(size_t inumber) {
+    OpTimer    timer(&this->opStats.Remove);
+    TraceScope trace(this->tracer, Trace::REMOVE, inumber);
+
+    if (!remove_inode(inumber, false)){
+        return false;
+    }
+    trace.set_result(1);
+    return true;
+}
+
+bool FileSystem::remove_inode(size_t inumber, bool force) {
+    if (inumber >= this->inodes){
+        return false;
+    }
+
+    // Load inode information
+    TransactionGuard transaction(this);
+    InodeGuard guard(inode_lock(inumber), true);
+    Inode node_to_remove;
+    load_inode(inumber, &node_to_remove);
+    
+    if (!node_to_remove.Valid){
+        return false;
     }  
-    Block indirectBlock;
-    this->disk->read(node->Indirect, indirectBlock.Data);
+
+    // A named inode goes with its last name, and a directory with its
+    // subtree, so only unlink may remove them
+    if (!force && ((node_to_remove.Valid >> LINK_SHIFT) || (node_to_remove.Valid & INODE_DIRECTORY))){
+        return false;
+    }
+ 
+    // Free direct blocks (an inline inode has none, only data)
+    bool hasBlocks = !(node_to_remove.Valid & INODE_INLINE);
+    for (uint32_t i = 0; i < direct_pointers(); i++){
+        if (hasBlocks && node_to_remove.Direct[i]){
+            release_block(node_to_remove.Direct[i]);
+        }
+        node_to_remove.Direct[i] = 0;
+    }   
+ 
+    // Free indirect blocks
+    if (hasBlocks){
+        release_tree(node_to_remove.Indirect, 1);
+        if (this->version >= 2){
+            release_tree(node_to_remove.Direct[direct_pointers()], 2);
+        }
+    }
+    node_to_remove.Indirect = 0;
+    if (this->version >= 2){
+        node_to_remove.Direct[direct_pointers()] = 0;
+    }
+
+    // Clear inode in inode table
+    node_to_remove.Valid = 0;
+    node_to_remove.Size  = 0;
+
+    save_inode(inumber, &node_to_remove);
+
+    // Removing the root directory leaves the file system without one
+    if (inumber == this->rootInode){
+        this->rootInode = NO_ROOT;
+        write_root(NO_ROOT);
+    }
+
+    {
+        std::lock_guard<std::mutex> streamGuard(this->streamLock);
+        this->streams.erase(inumber);
+    }
+
+    // Return inode to free inode index (blocks not scanned yet pick it up
+    // when they are indexed)
+    std::lock_guard<std::mutex> indexGuard(this->inodeIndexLock);
+    uint32_t block = inumber/INODES_PER_BLOCK;
+    if (this->freeInodeCounts[block] != UNSCANNED){
+        this->freeInodes.set(inumber);
+        this->freeInodeCounts[block]++;
+    }
+    return true;
+}
+
+void FileSystem::release_tree(uint32_t block, uint32_t depth) {
+    if (!block){
+        return;
+    }
+
+    Block pointerBlock;
+    this->cache->read(block, pointerBlock.Data);
     for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++){
-        if (indirectBlock.Pointers[i]){
-            blockCounter++;
+        uint32_t pointer = pointerBlock.Pointers[i];
+        if (depth > 1){
+            release_tree(pointer, depth - 1);
+        }else if (pointer){
+            release_block(pointer);
         }
     }
-    
-    this->disk->write(inumber/INODES_PER_BLOCK+1, nodeBlock.Data);
-    
+    release_block(block);
+}
+
+// Inode stat ------------------------------------------------------------------
+
+ssize_t FileSystem::stat(size_t inumber) {
+    OpTimer    timer(&this->opStats.Stat);
+    TraceScope trace(this->tracer, Trace::STAT, inumber);
+
+    // Load inode information
+    if (inumber >= this->inodes){
+        return -1;
+    }
+
+    InodeGuard guard(inode_lock(inumber), false);
+    Inode statInode;
+    bool validInode = load_inode(inumber, &statInode);
+    if (!validInode){
+        return -1;
+    }
+
+    trace.set_result(statInode.Size);
+    return statInode.Size;
+}
+
+// Statistics ------------------------------------------------------------------
+
+void FileSystem::reset_stats() {
+    this->opStats.Mount.reset();
+    this->opStats.Create.reset();
+    this->opStats.Remove.reset();
+    this->opStats.Stat.reset();
+    this->opStats.Read.reset();
+    this->opStats.Write.reset();
+    this->opStats.Compress.reset();
+    this->opStats.Lookup.reset();
+    this->opStats.Link.reset();
+    this->opStats.Unlink.reset();
+    this->opStats.Mkdir.reset();
+    this->opStats.AllocSearch.reset();
+    if (this->cache){
+        this->cache->reset_stats();
+    }
+    if (this->checksums){
+        this->checksums->reset_stats();
+    }
+}
+
+// Fragmentation ---------------------------------------------------------------
+
+double FileSystem::fragmentation(size_t *files, size_t *blocks, size_t *extents) {
+    size_t totalFiles   = 0;
+    size_t totalBlocks  = 0;
+    size_t totalExtents = 0;
+
+    if (this->disk){
+        Block inodeBlock;
+        for (uint32_t i = 0; i < this->inodeHighWater; i++){
+            cache->read(i+1, inodeBlock.Data);
+            for (uint32_t j = 0; j < INODES_PER_BLOCK; j++){
+                Inode *node = &inodeBlock.Inodes[j];
+                if (!node->Valid){
+                    continue;
+                }
+                totalFiles++;
+                if (node->Valid & INODE_INLINE){
+                    continue;
+                }
+
+                // Walk data blocks in file order, skipping holes
+                Mapping  mapping;
+                uint32_t fileBlocks = mapped_blocks(*node);
+                uint32_t last = 0;
+                for (uint32_t index = 0; index < fileBlocks; index++){
+                    uint32_t block = lookup_block(node, index, &mapping);
+                    if (!block){
+                        continue;
+                    }
+                    if (!last || block != last + 1){
+                        totalExtents++;
+                    }
+                    totalBlocks++;
+                    last = block;
+                }
+            }
+        }
+    }
+
+    if (files)   *files   = totalFiles;
+    if (blocks)  *blocks  = totalBlocks;
+    if (extents) *extents = totalExtents;
+    return totalExtents ? (double)totalBlocks/totalExtents : 0.0;
+}
+
+// Read from inode -------------------------------------------------------------
+
+size_t FileSystem::max_file_blocks() const {
+    size_t blocks = direct_pointers() + POINTERS_PER_BLOCK;
+    if (this->version >= 2){
+        blocks += (size_t)POINTERS_PER_BLOCK*POINTERS_PER_BLOCK;
+    }
+    return blocks;
+}
+
+FileSystem::Block *FileSystem::load_map(MapBlock *map, uint32_t block) {
+    if (map->BlockNumber != block){
+        if (map->BlockNumber && map->Dirty){
+            cache->write(map->BlockNumber, map->Contents.Data, journaled());
+        }
+        cache->read(block, map->Contents.Data);
+        map->BlockNumber = block;
+        map->Dirty       = false;
+    }
+    return &map->Contents;
+}
+
+uint32_t FileSystem::allocate_map(MapBlock *map, Extent *extent) {
+    uint32_t block = take_block(extent);
+    if (!block){
+        return 0;
+    }
+
+    if (map->BlockNumber && map->Dirty){
+        cache->write(map->BlockNumber, map->Contents.Data, journaled());
+    }
+    if (this->checksums){
+        this->checksums->cover(block);
+    }
+    memset(map->Contents.Data, 0, Disk::BLOCK_SIZE);
+    map->BlockNumber = block;
+    map->Dirty       = true;
+    return block;
+}
+
+void FileSystem::flush_mapping(Mapping *mapping) {
+    MapBlock *maps[] = {&mapping->Indirect, &mapping->Double, &mapping->Second};
+    for (MapBlock *map : maps){
+        if (map->BlockNumber && map->Dirty){
+            cache->write(map->BlockNumber, map->Contents.Data, journaled());
+            map->Dirty = false;
+        }
+    }
+}
+
+uint32_t FileSystem::lookup_block(Inode *node, uint32_t index, Mapping *mapping) {
+    uint32_t direct = direct_pointers();
+    if (index < direct){
+        return node->Direct[index];
+    }
+
+    index -= direct;
+    if (index < POINTERS_PER_BLOCK){
+        if (!node->Indirect){
+            return 0;
+        }
+        return load_map(&mapping->Indirect, node->Indirect)->Pointers[index];
+    }
+
+    index -= POINTERS_PER_BLOCK;
+    if (this->version < 2 || index >= POINTERS_PER_BLOCK*POINTERS_PER_BLOCK || !node->Direct[direct]){
+        return 0;
+    }
+    uint32_t second = load_map(&mapping->Double, node->Direct[direct])->Pointers[index/POINTERS_PER_BLOCK];
+    if (!second){
+        return 0;
+    }
+    return load_map(&mapping->Second, second)->Pointers[index%POINTERS_PER_BLOCK];
+}
+
+void FileSystem::wait_all(std::deque<Disk::Request> &pending) {
+    // Wait for every request before reporting an error, since requests
+    // still in flight reference the caller's buffers
+    std::string error;
+    for (auto &request : pending){
+        try {
+            disk->wait(&request);
+        } catch (std::runtime_error &e) {
+            if (error.empty()){
+                error = e.what();
+            }
+        }
+    }
+    pending.clear();
+
+    if (!error.empty()){
+        throw std::runtime_error(error);
+    }
+}
+
+ssize_t FileSystem::read(size_t inumber, char *data, size_t length, size_t offset) {
+    struct iovec iov = {data, length};
+    return readv(inumber, &iov, 1, offset);
+}
+
+ssize_t FileSystem::readv(size_t inumber, const struct iovec *iov, int iovcnt, size_t offset) {
+    OpTimer    timer(&this->opStats.Read);
+    TraceScope trace(this->tracer, Trace::READ, inumber, iov_length(iov, iovcnt), offset);
+
+    if (inumber >= this->inodes){ 
+        return -1;
+    }
+
+    // Load inode information
+    InodeGuard guard(inode_lock(inumber), false);
+    Inode loadedInode;
+    bool validInode = load_inode(inumber, &loadedInode);
+    if (!validInode) { 
+        return -1; 
+    }
+
+    if (offset >= loadedInode.Size) { 
+        return -1; 
+    }
+
+    // Inline data came with the inode, so no block is read
+    if (loadedInode.Valid & INODE_INLINE) {
+        size_t position = offset;
+        for (int i = 0; i < iovcnt && position < loadedInode.Size; i++){
+            size_t length = std::min(iov[i].iov_len, loadedInode.Size - position);
+            memcpy(iov[i].iov_base, inline_data(&loadedInode) + position, length);
+            position += length;
+        }
+        timer.set_bytes(position - offset);
+        trace.set_result(position - offset);
+        return position - offset;
+    }
+
+    // Compressed clusters are decompressed whole, then copied from
+    if (loadedInode.Valid & INODE_COMPRESSED) {
+        Mapping mapping;
+        ssize_t result = read_compressed(&loadedInode, iov, iovcnt, offset, &mapping);
+        if (result < 0) {
+            return -1;
+        }
+        if (result > 0){
+            readahead(inumber, &loadedInode, offset/Disk::BLOCK_SIZE, (offset + result - 1)/Disk::BLOCK_SIZE, &mapping);
+        }
+        timer.set_bytes(result);
+        trace.set_result(result);
+        return result;
+    }
+
+    // Copy each block range straight from the cache into the caller's
+    // buffers, loading each pointer block at most once and keeping disk
+    // reads for uncached runs in flight until the end of the call
+    std::deque<Disk::Request> pending;
+    Mapping  mapping;
+    size_t   position = offset;
+    try {
+        for (int i = 0; i < iovcnt && position < loadedInode.Size; i++){
+            char * buffer = (char *)iov[i].iov_base;
+            size_t length = std::min(iov[i].iov_len, loadedInode.Size - position);
+            while (length > 0){
+                uint32_t startBlock = position/Disk::BLOCK_SIZE;
+                uint32_t startByte  = position%Disk::BLOCK_SIZE;
+                size_t   chunk      = std::min(length, Disk::BLOCK_SIZE - startByte);
+
+                uint32_t blockNumber = lookup_block(&loadedInode, startBlock, &mapping);
+                if (chunk == Disk::BLOCK_SIZE && blockNumber){
+                    // Coalesce whole blocks that are contiguous on disk
+                    size_t run = 1;
+                    while (length >= (run + 1)*Disk::BLOCK_SIZE &&
+                           lookup_block(&loadedInode, startBlock + run, &mapping) == blockNumber + run){
+                        run++;
+                    }
+                    chunk = run*Disk::BLOCK_SIZE;
+                    cache->read_blocks(blockNumber, run, buffer, &pending);
+                }else if (blockNumber){
+                    cache->read(blockNumber, buffer, startByte, chunk);
+                }else{
+                    memset(buffer, 0, chunk);
+                }
+
+                buffer   += chunk;
+                length   -= chunk;
+                position += chunk;
+            }
+        }
+    } catch (...) {
+        wait_all(pending);
+        throw;
+    }
+    wait_all(pending);
+
+    if (position > offset){
+        readahead(inumber, &loadedInode, offset/Disk::BLOCK_SIZE, (position - 1)/Disk::BLOCK_SIZE, &mapping);
+    }
+
+    timer.set_bytes(position - offset);
+    trace.set_result(position - offset);
+    return position - offset;
+}
+
+void FileSystem::readahead(size_t inumber, Inode *node, uint32_t first, uint32_t last, Mapping *mapping) {
+    // Reads that start at the beginning of a file or where the previous read
+    // ended grow the window; anything else turns read ahead off
+    uint32_t window;
+    {
+        std::lock_guard<std::mutex> streamGuard(this->streamLock);
+        auto it = this->streams.find(inumber);
+        if (it == this->streams.end()){
+            it = this->streams.insert(std::make_pair(inumber, Stream{0, 0})).first;
+        }
+        Stream &stream = it->second;
+        if (first == stream.NextBlock){
+            uint32_t limit = std::min<uint32_t>(MAX_READAHEAD, this->cacheBlocks/2);
+            stream.Window  = std::min(std::max(stream.Window*2, last - first + 1), limit);
+        }else{
+            stream.Window  = 0;
+        }
+        stream.NextBlock = last + 1;
+        window = stream.Window;
+    }
+
+    // Prefetch window, one request per run of blocks contiguous on disk
+    uint32_t fileBlocks = mapped_blocks(*node);
+    uint32_t end        = std::min(last + 1 + window, fileBlocks);
+    for (uint32_t index = last + 1; index < end; ){
+        uint32_t blockNumber = lookup_block(node, index, mapping);
+        if (!blockNumber){
+            index++;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while (index + run < end && lookup_block(node, index + run, mapping) == blockNumber + run){
+            run++;
+        }
+        cache->prefetch(blockNumber, run);
+        index += run;
+    }
+}
+
+// Write to inode --------------------------------------------------------------
+
+size_t FileSystem::allocate_free_block(size_t goal){
+    std::lock_guard<std::mutex> guard(this->allocLock);
+
+    // Take the first free block at or after goal, wrapping around
+    size_t block = this->freeBlocks.find_first(goal);
+    if (block == Bitmap::NPOS){
+        block = this->freeBlocks.find_first();
+    }
+    if (block == Bitmap::NPOS){
+        return 0;
+    }
+    this->opStats.AllocSearch.record(block >= goal ? block - goal : block + this->numBlocks - goal);
+    take_free_block(block);
+    return block;
+}
+
+void FileSystem::release_block(uint32_t block){
+    std::lock_guard<std::mutex> guard(this->allocLock);
+
+    // With a journal, its checksum is dropped once it is freed as well
+    if (this->journal && block < this->numBlocks){
+        this->journal->revoke(block);
+        this->cache->forget(block);
+        this->releasedBlocks.push_back(block);
+        return;
+    }
+    if (this->checksums){
+        this->checksums->forget(block, !this->dataChecksums);
+    }
+    free_block(block);
+}
+
+void FileSystem::free_released(size_t room){
+    // In block order, each bitmap and table block is counted once
+    std::sort(this->releasedBlocks.begin(), this->releasedBlocks.end());
+    size_t   changed = 0;
+    size_t   count   = 0;
+    uint32_t bitmap  = UINT32_MAX;
+    uint32_t table   = UINT32_MAX;
+    for (; count < this->releasedBlocks.size(); count++){
+        uint32_t block = this->releasedBlocks[count];
+        changed += block/BITS_PER_BLOCK != bitmap;
+        changed += this->checksums && block/Checksums::ENTRIES_PER_BLOCK != table;
+        if (changed > room){
+            break;
+        }
+        bitmap = block/BITS_PER_BLOCK;
+        table  = block/Checksums::ENTRIES_PER_BLOCK;
+
+        if (this->checksums){
+            this->checksums->forget(block, !this->dataChecksums);
+        }
+        free_block(block);
+    }
+    this->releasedBlocks.erase(this->releasedBlocks.begin(), this->releasedBlocks.begin() + count);
+}
+
+void FileSystem::free_block(uint32_t block){
+    if (block < this->numBlocks && !this->freeBlocks.test(block)){
+        this->freeBlocks.set(block);
+        this->regionFree[block/REGION_BLOCKS]++;
+        if (this->version >= 1 && !this->bitmapDirty[block/BITS_PER_BLOCK]){
+            this->bitmapDirty[block/BITS_PER_BLOCK] = true;
+            this->dirtyBitmapBlocks++;
+        }
+    }
+}
+
+void FileSystem::take_free_block(uint32_t block){
+    this->freeBlocks.clear(block);
+    this->regionFree[block/REGION_BLOCKS]--;
+    if (this->version >= 1 && !this->bitmapDirty[block/BITS_PER_BLOCK]){
+        this->bitmapDirty[block/BITS_PER_BLOCK] = true;
+        this->dirtyBitmapBlocks++;
+    }
+}
+
+uint32_t FileSystem::region_goal(){
+    // Compare free fractions so a short last region is not penalized
+    size_t totalFree = this->freeBlocks.count();
+    for (uint32_t i = 0; i < this->regionFree.size(); i++){
+        size_t regionSize = std::min(REGION_BLOCKS, this->numBlocks - i*REGION_BLOCKS);
+        if ((size_t)this->regionFree[i]*this->numBlocks >= totalFree*regionSize){
+            return i*REGION_BLOCKS;
+        }
+    }
+    return 0;
+}
+
+FileSystem::Extent FileSystem::reserve_extent(uint32_t goal, uint32_t count){
+    std::lock_guard<std::mutex> guard(this->allocLock);
+
+    if (!goal){
+        goal = region_goal();
+    }
+
+    size_t start = this->freeBlocks.find_run(goal, count);
+    if (start == Bitmap::NPOS){
+        start = this->freeBlocks.find_run(0, count);
+    }
+    if (start == Bitmap::NPOS){
+        return Extent{goal, goal};
+    }
+    this->opStats.AllocSearch.record(start >= goal ? start - goal : start + this->numBlocks - goal);
+
+    // Take the whole run now so concurrent writes cannot split it
+    for (size_t block = start; block < start + count; block++){
+        take_free_block(block);
+    }
+    return Extent{(uint32_t)start, (uint32_t)(start + count)};
+}
+
+uint32_t FileSystem::take_block(Extent *extent){
+    if (extent->Next < extent->End){
+        return extent->Next++;
+    }
+
+    uint32_t block = allocate_free_block(extent->Next);
+    if (block){
+        extent->Next = extent->End = block + 1;
+    }
+    return block;
+}
+
+void FileSystem::release_extent(Extent *extent){
+    // Blocks never handed out were never named, so they are free at once
+    std::lock_guard<std::mutex> guard(this->allocLock);
+    for (; extent->Next < extent->End; extent->Next++){
+        free_block(extent->Next);
+    }
+}
+
+ssize_t FileSystem::write(size_t inumber, char *data, size_t length, size_t offset) {
+    OpTimer    timer(&this->opStats.Write);
+    TraceScope trace(this->tracer, Trace::WRITE, inumber, length, offset);
+
+    if (inumber >= this->inodes){ 
+        return -1;
+    }
+
+    // A transaction covers one piece at a time, so a large write cannot
+    // outgrow the journal; pieces already written stay if a later one fails
+    size_t written = 0;
+    do {
+        size_t  piece  = std::min(length - written, WRITE_PIECE - (offset + written)%WRITE_PIECE);
+        ssize_t result = write_piece(inumber, data + written, piece, offset + written);
+        if (result < 0){
+            if (written == 0){
+                return -1;
+            }
+            break;
+        }
+        written += result;
+        if ((size_t)result < piece){
+            break;
+        }
+    } while (written < length);
+
+    timer.set_bytes(written);
+    trace.set_result(written);
+    return written;
+}
+
+ssize_t FileSystem::write_piece(size_t inumber, char *data, size_t length, size_t offset) {
+    // Load inode information
+    TransactionGuard transaction(this);
+    InodeGuard guard(inode_lock(inumber), true);
+    Inode loadedInode;
+    bool validInode = load_inode(inumber, &loadedInode);
+    if (!validInode) { 
+        return -1;
+    }
+
+    // Directories are only changed through link and unlink
+    if (loadedInode.Valid & INODE_DIRECTORY) {
+        return -1;
+    }
+
+    // Clamp request to the largest file an inode can map (and its 32-bit
+    // size can describe)
+    size_t maxSize = std::min(max_file_blocks()*Disk::BLOCK_SIZE, (size_t)UINT32_MAX);
+    if (offset >= maxSize) {
+        return 0;
+    }
+    length = std::min(length, maxSize - offset);
+    if (length == 0) {
+        return 0;
+    }
+
+    if (loadedInode.Valid & INODE_COMPRESSED) {
+        Mapping mapping;
+        size_t  written = write_compressed(&loadedInode, data, length, offset, &mapping);
+        loadedInode.Size = std::max((size_t)loadedInode.Size, offset + written);
+        if (!save_inode(inumber, &loadedInode)){
+            return -1;
+        }
+        return written;
+    }
+
+    // Data that fits in the pointer space of an inode without blocks is
+    // kept there, and moves to a block once the file outgrows it
+    bool inlined = loadedInode.Valid & INODE_INLINE;
+    if (!inlined && this->version >= 5 && loadedInode.Size == 0 && offset + length <= INLINE_SIZE){
+        inlined = true;
+        for (uint32_t i = 0; i < POINTERS_PER_INODE; i++){
+            inlined = inlined && !loadedInode.Direct[i];
+        }
+        inlined = inlined && !loadedInode.Indirect;
+        if (inlined){
+            loadedInode.Valid |= INODE_INLINE;
+        }
+    }
+    if (inlined && offset + length <= INLINE_SIZE){
+        memcpy(inline_data(&loadedInode) + offset, data, length);
+        loadedInode.Size = std::max((size_t)loadedInode.Size, offset + length);
+        save_inode(inumber, &loadedInode);
+        return length;
+    }
+    if (inlined && !migrate_inline(&loadedInode)){
+        return -1;
+    }
+
+    // Plan every block allocation for the range up front, stopping at the
+    // first block the disk cannot provide
+    uint32_t startBlock = offset/Disk::BLOCK_SIZE;
+    uint32_t endBlock   = (offset + length - 1)/Disk::BLOCK_SIZE;
+    std::vector<uint32_t> blocks;
+    std::vector<bool>     fresh;
+    Mapping  mapping;
+
+    // Count blocks the range needs so they can be taken from one free run
+    uint32_t needed = missing_maps(&loadedInode, startBlock, endBlock, &mapping);
+    for (uint32_t index = startBlock; index <= endBlock; index++){
+        if (!lookup_block(&loadedInode, index, &mapping)){
+            needed++;
+        }
+    }
+
+    // Continue after the file's previous block, or start new files in a
+    // region with room to grow
+    Extent extent = {0, 0};
+    if (needed){
+        uint32_t previous = startBlock ? lookup_block(&loadedInode, startBlock - 1, &mapping) : 0;
+        extent = reserve_extent(previous ? previous + 1 : 0, needed);
+    }
+
+    for (uint32_t index = startBlock; index <= endBlock; index++){
+        uint32_t block     = lookup_block(&loadedInode, index, &mapping);
+        bool     allocated = false;
+        if (!block){
+            block = allocate_block(&loadedInode, index, &mapping, &extent);
+            if (!block){
+                break;
+            }
+            allocated = true;
+        }
+        blocks.push_back(block);
+        fresh.push_back(allocated);
+    }
+    release_extent(&extent);
+
+    // Copy data into blocks: full blocks are written without being read,
+    // and only partially covered edge blocks are read first
+    std::deque<Disk::Request> pending;
+    size_t written = 0;
+    try {
+        for (size_t i = 0; i < blocks.size(); i++){
+            size_t startByte = (offset + written)%Disk::BLOCK_SIZE;
+            size_t chunk     = std::min(length - written, Disk::BLOCK_SIZE - startByte);
+            if (chunk == Disk::BLOCK_SIZE){
+                // Coalesce whole blocks that are contiguous on disk
+                size_t run = 1;
+                while (i + run < blocks.size() && blocks[i + run] == blocks[i] + run &&
+                       length - written >= (run + 1)*Disk::BLOCK_SIZE){
+                    run++;
+                }
+                cache->write_blocks(blocks[i], run, data + written, &pending);
+                chunk = run*Disk::BLOCK_SIZE;
+                i    += run - 1;
+            }else if (fresh[i]){
+                Block dataBlock;
+                memset(dataBlock.Data, 0, Disk::BLOCK_SIZE);
+                memcpy(dataBlock.Data + startByte, data + written, chunk);
+                cache->write(blocks[i], dataBlock.Data);
+            }else{
+                cache->write(blocks[i], data + written, startByte, chunk);
+            }
+            written += chunk;
+        }
+    } catch (...) {
+        wait_all(pending);
+        throw;
+    }
+    wait_all(pending);
+
+    // Persist pointer blocks and inode once
+    flush_mapping(&mapping);
+    loadedInode.Size = std::max((size_t)loadedInode.Size, offset + written);
+    if (!save_inode(inumber, &loadedInode)){
+        return -1;
+    }
+
+    return written;
+}
+
+void FileSystem::read_file_block(Inode *node, uint32_t index, Block *block, Mapping *mapping) {
+    uint32_t blockNumber = lookup_block(node, index, mapping);
+    if (blockNumber){
+        cache->read(blockNumber, block->Data);
+    }else{
+        memset(block->Data, 0, Disk::BLOCK_SIZE);
+    }
+}
+
+bool FileSystem::write_file_block(Inode *node, uint32_t index, Block *block, Mapping *mapping) {
+    if (index >= max_file_blocks()){
+        return false;
+    }
+
+    uint32_t blockNumber = lookup_block(node, index, mapping);
+    if (!blockNumber){
+        // Follow the file's previous block, as write does
+        uint32_t needed   = missing_maps(node, index, index, mapping) + 1;
+        uint32_t previous = index ? lookup_block(node, index - 1, mapping) : 0;
+        Extent	 extent	  = reserve_extent(previous ? previous + 1 : 0, needed);
+        blockNumber = allocate_block(node, index, mapping, &extent);
+        release_extent(&extent);
+        if (!blockNumber){
+            return false;
+        }
+    }
+
+    if (this->checksums && (node->Valid & INODE_DIRECTORY)){
+        this->checksums->cover(blockNumber);
+    }
+    cache->write(blockNumber, block->Data, journaled());
+    node->Size = std::max((size_t)node->Size, (size_t)(index + 1)*Disk::BLOCK_SIZE);
+    return true;
+}
+
+bool FileSystem::migrate_inline(Inode *node){
+    Inode saved = *node;
+    Block block;
+    memset(block.Data, 0, Disk::BLOCK_SIZE);
+    memcpy(block.Data, inline_data(node), std::min(node->Size, INLINE_SIZE));
+
+    memset(inline_data(node), 0, INLINE_SIZE);
+    node->Valid &= ~INODE_INLINE;
+    Mapping mapping;
+    if (!write_file_block(node, 0, &block, &mapping)){
+        *node = saved;
+        return false;
+    }
+    flush_mapping(&mapping);
+    node->Size = saved.Size;
+    return true;
+}
+
+// Compressed files -----------------------------------------------------------
+
+bool FileSystem::compress(size_t inumber) {
+    OpTimer    timer(&this->opStats.Compress);
+    TraceScope trace(this->tracer, Trace::COMPRESS, inumber);
+    if (inumber >= this->inodes || this->version < 7){
+        return false;
+    }
+
+    TransactionGuard transaction(this);
+    InodeGuard guard(inode_lock(inumber), true);
+    Inode node;
+    if (!load_inode(inumber, &node) || node.Size || (node.Valid & (INODE_DIRECTORY | INODE_INLINE))){
+        return false;
+    }
+    node.Valid |= INODE_COMPRESSED;
+    if (!save_inode(inumber, &node)){
+        return false;
+    }
+    trace.set_result(1);
+    return true;
+}
+
+ssize_t FileSystem::read_compressed(Inode *node, const struct iovec *iov, int iovcnt, size_t offset, Mapping *mapping) {
+    // A raw cluster is read a block at a time like any other file, so a
+    // small read of it moves only the blocks it needs
+    std::vector<char> cluster(CLUSTER_SIZE);
+    uint32_t loaded = (uint32_t)-1;
+    bool     raw    = false;
+    size_t   position = offset;
+    for (int i = 0; i < iovcnt && position < node->Size; i++){
+        char * buffer = (char *)iov[i].iov_base;
+        size_t length = std::min(iov[i].iov_len, node->Size - position);
+        while (length > 0){
+            uint32_t index = position/CLUSTER_SIZE;
+            if (index != loaded){
+                uint32_t blocks = raw_blocks(node->Size, index);
+                raw = lookup_block(node, index*CLUSTER_BLOCKS + blocks - 1, mapping) != 0;
+                if (!raw && !read_cluster(node, index, cluster.data(), mapping)){
+                    return -1;
+                }
+                loaded = index;
+            }
+
+            size_t chunk;
+            if (raw){
+                uint32_t startByte   = position%Disk::BLOCK_SIZE;
+                uint32_t blockNumber = lookup_block(node, position/Disk::BLOCK_SIZE, mapping);
+                chunk = std::min(length, Disk::BLOCK_SIZE - startByte);
+                if (blockNumber){
+                    cache->read(blockNumber, buffer, startByte, chunk);
+                }else{
+                    memset(buffer, 0, chunk);
+                }
+            }else{
+                chunk = std::min(length, CLUSTER_SIZE - position%CLUSTER_SIZE);
+                memcpy(buffer, cluster.data() + position%CLUSTER_SIZE, chunk);
+            }
+
+            buffer   += chunk;
+            length   -= chunk;
+            position += chunk;
+        }
+    }
+    return position - offset;
+}
+
+size_t FileSystem::write_compressed(Inode *node, char *data, size_t length, size_t offset, Mapping *mapping) {
+    // Clusters the range covers only in part are read back first; bytes
+    // past the end of the file are always stored as zeros
+    std::vector<char> cluster(CLUSTER_SIZE);
+    size_t size = std::max((size_t)node->Size, offset + length);
+
+    // A raw last cluster the file grows past without writing it needs all
+    // its blocks from now on
+    if (node->Size && size > node->Size){
+        uint32_t last = (node->Size - 1)/CLUSTER_SIZE;
+        if (last < offset/CLUSTER_SIZE && raw_blocks(node->Size, last) < CLUSTER_BLOCKS &&
+            (!read_cluster(node, last, cluster.data(), mapping) || !write_cluster(node, last, cluster.data(), mapping, size))){
+            flush_mapping(mapping);
+            return 0;
+        }
+    }
+
+    size_t written = 0;
+    while (written < length){
+        size_t   position  = offset + written;
+        uint32_t index     = position/CLUSTER_SIZE;
+        size_t   startByte = position%CLUSTER_SIZE;
+        size_t   chunk     = std::min(length - written, CLUSTER_SIZE - startByte);
+        if (chunk < CLUSTER_SIZE && !read_cluster(node, index, cluster.data(), mapping)){
+            break;
+        }
+        memcpy(cluster.data() + startByte, data + written, chunk);
+        if (!write_cluster(node, index, cluster.data(), mapping, size)){
+            break;
+        }
+        written += chunk;
+    }
+
+    flush_mapping(mapping);
+    return written;
+}
+
+bool FileSystem::read_cluster(Inode *node, uint32_t cluster, char *data, Mapping *mapping) {
+    uint32_t first = cluster*CLUSTER_BLOCKS;
+    uint32_t blocks[CLUSTER_BLOCKS];
+    for (uint32_t j = 0; j < CLUSTER_BLOCKS; j++){
+        blocks[j] = lookup_block(node, first + j, mapping);
+    }
+
+    // A cluster mapping every block its bytes need holds them raw
+    uint32_t raw = raw_blocks(node->Size, cluster);
+    if (raw && blocks[raw - 1]){
+        for (uint32_t j = 0; j < CLUSTER_BLOCKS; j++){
+            if (blocks[j]){
+                cache->read(blocks[j], data + j*Disk::BLOCK_SIZE);
+            }else{
+                memset(data + j*Disk::BLOCK_SIZE, 0, Disk::BLOCK_SIZE);
+            }
+        }
+        return true;
+    }
+    if (!blocks[0]){
+        memset(data, 0, CLUSTER_SIZE);
+        return true;
+    }
+
+    // Otherwise the first block starts with the length of the stream
+    char     stored[CLUSTER_SIZE];
+    uint32_t length;
+    cache->read(blocks[0], stored);
+    memcpy(&length, stored, sizeof(length));
+    uint32_t count = (sizeof(length) + (size_t)length + Disk::BLOCK_SIZE - 1)/Disk::BLOCK_SIZE;
+    if (count >= raw){
+        return false;
+    }
+    for (uint32_t j = 1; j < count; j++){
+        if (!blocks[j]){
+            return false;
+        }
+        cache->read(blocks[j], stored + j*Disk::BLOCK_SIZE);
+    }
+    return LZ::decompress(stored + sizeof(length), length, data, CLUSTER_SIZE) == CLUSTER_SIZE;
+}
+
+bool FileSystem::write_cluster(Inode *node, uint32_t cluster, char *data, Mapping *mapping, size_t size) {
+    // Raw bytes take the blocks the file needs after the write; the stream
+    // is kept only if it needs fewer blocks than the raw bytes before it
+    // too (a cluster the file has not reached yet has no size before)
+    uint32_t before = raw_blocks(node->Size, cluster);
+    uint32_t after  = raw_blocks(size, cluster);
+    uint32_t limit  = before ? before : after;
+    char     stored[CLUSTER_SIZE];
+    uint32_t length = 0;
+    if (limit > 1){
+        length = LZ::compress(data, CLUSTER_SIZE, stored + sizeof(length), (limit - 1)*Disk::BLOCK_SIZE - sizeof(length));
+    }
+    uint32_t count  = after;
+    char *   source = data;
+    if (length){
+        memcpy(stored, &length, sizeof(length));
+        count  = (sizeof(length) + length + Disk::BLOCK_SIZE - 1)/Disk::BLOCK_SIZE;
+        memset(stored + sizeof(length) + length, 0, count*Disk::BLOCK_SIZE - sizeof(length) - length);
+        source = stored;
+    }
+
+    // Count blocks the cluster still needs so they can be taken from one
+    // free run after the last block of the cluster before
+    uint32_t first  = cluster*CLUSTER_BLOCKS;
+    uint32_t blocks[CLUSTER_BLOCKS];
+    uint32_t needed = missing_maps(node, first, first + count - 1, mapping);
+    for (uint32_t j = 0; j < count; j++){
+        blocks[j] = lookup_block(node, first + j, mapping);
+        if (!blocks[j]){
+            needed++;
+        }
+    }
+
+    Extent extent = {0, 0};
+    if (needed){
+        uint32_t previous = 0;
+        for (uint32_t index = first; index > 0 && index + CLUSTER_BLOCKS > first && !previous; index--){
+            previous = lookup_block(node, index - 1, mapping);
+        }
+        extent = reserve_extent(previous ? previous + 1 : 0, needed);
+    }
+
+    bool fresh[CLUSTER_BLOCKS] = {false};
+    bool mapped = true;
+    for (uint32_t j = 0; j < count && mapped; j++){
+        if (!blocks[j]){
+            blocks[j] = allocate_block(node, first + j, mapping, &extent);
+            fresh[j]  = mapped = blocks[j] != 0;
+        }
+    }
+    release_extent(&extent);
+    if (!mapped){
+        // Unmap the blocks just taken, so the cluster reads as it did
+        for (uint32_t j = 0; j < count; j++){
+            if (fresh[j]){
+                release_block(unmap_block(node, first + j, mapping));
+            }
+        }
+        return false;
+    }
+
+    // Write runs of blocks contiguous on disk with one request each, then
+    // free the blocks a shorter stream no longer needs
+    for (uint32_t j = 0; j < count; ){
+        uint32_t run = 1;
+        while (j + run < count && blocks[j + run] == blocks[j] + run){
+            run++;
+        }
+        cache->write_blocks(blocks[j], run, source + j*Disk::BLOCK_SIZE);
+        j += run;
+    }
+    for (uint32_t j = count; j < CLUSTER_BLOCKS; j++){
+        uint32_t block = unmap_block(node, first + j, mapping);
+        if (block){
+            release_block(block);
+        }
+    }
+    return true;
+}
+
+uint32_t FileSystem::allocate_block(Inode *node, uint32_t index, Mapping *mapping, Extent *extent){
+    uint32_t direct = direct_pointers();
+    uint32_t *pointer;
+    MapBlock *parent = nullptr;
+    if (index < direct){
+        pointer = &node->Direct[index];
+    }else if (index - direct < POINTERS_PER_BLOCK){
+        if (!node->Indirect){
+            node->Indirect = allocate_map(&mapping->Indirect, extent);
+            if (!node->Indirect){
+                return 0;
+            }
+        }
+        parent  = &mapping->Indirect;
+        pointer = &load_map(parent, node->Indirect)->Pointers[index - direct];
+    }else{
+        // Pointer blocks come before the data blocks they map, so a file
+        // written sequentially stays in one ascending run
+        index -= direct + POINTERS_PER_BLOCK;
+        if (!node->Direct[direct]){
+            node->Direct[direct] = allocate_map(&mapping->Double, extent);
+            if (!node->Direct[direct]){
+                return 0;
+            }
+        }
+        Block *doubleBlock = load_map(&mapping->Double, node->Direct[direct]);
+        uint32_t *second   = &doubleBlock->Pointers[index/POINTERS_PER_BLOCK];
+        if (!*second){
+            uint32_t block = allocate_map(&mapping->Second, extent);
+            if (!block){
+                return 0;
+            }
+            *second = block;
+            mapping->Double.Dirty = true;
+        }
+        parent  = &mapping->Second;
+        pointer = &load_map(parent, *second)->Pointers[index%POINTERS_PER_BLOCK];
+    }
+
+    *pointer = take_block(extent);
+    if (!*pointer){
+        return 0;
+    }
+    if (parent){
+        parent->Dirty = true;
+    }
+    return *pointer;
+}
+
+uint32_t FileSystem::unmap_block(Inode *node, uint32_t index, Mapping *mapping){
+    uint32_t direct = direct_pointers();
+    uint32_t *pointer;
+    MapBlock *parent = nullptr;
+    if (index < direct){
+        pointer = &node->Direct[index];
+    }else if (index - direct < POINTERS_PER_BLOCK){
+        if (!node->Indirect){
+            return 0;
+        }
+        parent  = &mapping->Indirect;
+        pointer = &load_map(parent, node->Indirect)->Pointers[index - direct];
+    }else{
+        index -= direct + POINTERS_PER_BLOCK;
+        if (this->version < 2 || index >= POINTERS_PER_BLOCK*POINTERS_PER_BLOCK || !node->Direct[direct]){
+            return 0;
+        }
+        uint32_t second = load_map(&mapping->Double, node->Direct[direct])->Pointers[index/POINTERS_PER_BLOCK];
+        if (!second){
+            return 0;
+        }
+        parent  = &mapping->Second;
+        pointer = &load_map(parent, second)->Pointers[index%POINTERS_PER_BLOCK];
+    }
+
+    uint32_t block = *pointer;
+    if (block && parent){
+        parent->Dirty = true;
+    }
+    *pointer = 0;
+    return block;
+}
+
+uint32_t FileSystem::missing_maps(Inode *node, uint32_t first, uint32_t last, Mapping *mapping){
+    uint32_t direct  = direct_pointers();
+    uint32_t missing = 0;
+
+    // Indirect block covers blocks [direct, direct + POINTERS_PER_BLOCK)
+    if (last >= direct && first < direct + POINTERS_PER_BLOCK && !node->Indirect){
+        missing++;
+    }
+
+    // Double indirect block and one second level block per group of
+    // POINTERS_PER_BLOCK blocks after that
+    uint32_t base = direct + POINTERS_PER_BLOCK;
+    if (this->version < 2 || last < base){
+        return missing;
+    }
+    uint32_t firstGroup = (std::max(first, base) - base)/POINTERS_PER_BLOCK;
+    uint32_t lastGroup  = (last - base)/POINTERS_PER_BLOCK;
+    if (!node->Direct[direct]){
+        return missing + 1 + lastGroup - firstGroup + 1;
+    }
+    Block *doubleBlock = load_map(&mapping->Double, node->Direct[direct]);
+    for (uint32_t group = firstGroup; group <= lastGroup; group++){
+        if (!doubleBlock->Pointers[group]){
+            missing++;
+        }
+    }
+    return missing;
+}
+
+bool FileSystem::load_inode(size_t inumber, Inode *node) {
+    this->cache->read(inumber/INODES_PER_BLOCK+1, (char *)node, (inumber%INODES_PER_BLOCK)*sizeof(Inode), sizeof(Inode));
+    if (node->Valid) {
+        return true;
+    }
+    return false;
+}   
+
+bool FileSystem::save_inode(size_t inumber, Inode *node){
+    this->cache->write(inumber/INODES_PER_BLOCK+1, (char *)node, (inumber%INODES_PER_BLOCK)*sizeof(Inode), sizeof(Inode), journaled());
     if (node->Valid) {
         return true;
     }
     return false;
-} 
+}
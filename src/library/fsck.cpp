@@ -0,0 +1,630 @@
+// fsck.cpp: File system check
+
+#include "sfs/fs.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <string.h>
+
+// Checker ---------------------------------------------------------------------
+
+struct FileSystem::Checker {
+    struct Pending {		// Pointer block waiting to be read
+    	uint32_t BlockNumber;	// Pointer block
+    	uint32_t Depth;		// 1 if it points to data blocks, 2 if to pointer blocks
+    	uint32_t FirstIndex;	// Block index within file of first block it maps
+    	uint32_t FileBlocks;	// Number of blocks covered by file size
+    };
+
+    Disk *	Device;
+    SuperBlock	Super;
+    uint32_t	DataStart;	// First block after inode table, bitmap, journal
+    				// and checksum table
+    uint32_t	Direct;		// Direct pointers per inode
+    uint32_t	UsedBlocks;	// Inode blocks below the high-water mark
+
+    // Shared by all threads: a block is marked with one atomic OR, which
+    // also tells whether some other reference got there first
+    size_t	Words;
+    std::unique_ptr<std::atomic<uint64_t>[]> Seen;  // Blocks referenced at least once
+    std::unique_ptr<std::atomic<uint64_t>[]> Twice; // Blocks referenced more than once
+
+    std::atomic<size_t> Files;
+    std::atomic<size_t> OutOfRange;
+    std::atomic<size_t> PastEnd;
+
+    std::unique_ptr<Checksums> Sums;	// Checksum table (version 8 on)
+    std::mutex	BadLock;	// Guards Bad
+    std::vector<uint32_t> Bad;	// Blocks failing their checksum
+
+    std::vector<uint32_t> Valid;	// Valid word of every inode (0 if free)
+    std::mutex	DirectoryLock;	// Guards Directories
+    std::vector<Inode> Directories;	// Directory inodes
+
+    Checker(Disk *disk, const SuperBlock &super) : Device(disk), Super(super), Files(0), OutOfRange(0), PastEnd(0) {
+    	DataStart  = Super.InodeBlocks + 1 + (Super.Version >= 1 ? Super.BitmapBlocks : 0) +
+    		     (Super.Version >= 6 ? Super.JournalBlocks : 0) + (Super.Version >= 8 ? Super.ChecksumBlocks : 0);
+    	Direct     = Super.Version >= 2 ? POINTERS_PER_INODE - 1 : POINTERS_PER_INODE;
+    	UsedBlocks = Super.Version >= 3 ? Super.InodeHighWater : Super.InodeBlocks;
+    	Words      = (Super.Blocks + 63)/64;
+    	Valid.assign(Super.Inodes, 0);
+    	Seen.reset(new std::atomic<uint64_t>[Words]);
+    	Twice.reset(new std::atomic<uint64_t>[Words]);
+    	for (size_t i = 0; i < Words; i++) {
+    	    Seen[i]  = 0;
+    	    Twice[i] = 0;
+	}
+    }
+
+    // Load checksum table as the next mount would (empty unless a clean
+    // unmount or the journal kept it in step, and taking data blocks written
+    // since the last commit as they are)
+    void load_checksums() {
+    	if (Super.Version < 8) {
+    	    return;
+	}
+	Sums.reset(new Checksums(Device, DataStart - Super.ChecksumBlocks, Super.Blocks));
+	Sums->load();
+	if (Super.State != STATE_CLEAN && !Super.JournalBlocks) {
+	    Sums->clear();
+	} else if (Super.State != STATE_CLEAN) {
+	    Sums->recover();
+	}
+	Sums->cover(1, Super.InodeBlocks + Super.BitmapBlocks);
+    }
+
+    // Check blocks just read against their checksums
+    void verify(uint32_t block, size_t count, const char *data) {
+    	for (size_t i = 0; Sums && i < count; i++) {
+    	    if (!Sums->verify(block + i, 1, data + i*Disk::BLOCK_SIZE)) {
+    	    	std::lock_guard<std::mutex> guard(BadLock);
+    	    	Bad.push_back(block + i);
+	    }
+	}
+    }
+
+    // Write block repaired in place, with its new checksum
+    void write(uint32_t block, char *data) {
+    	if (Sums) {
+    	    Sums->update(block, 1, data);
+	}
+	Device->write(block, data);
+    }
+
+    bool in_range(uint32_t block) const {
+    	return block >= DataStart && block < Super.Blocks;
+    }
+
+    void mark(uint32_t block) {
+    	uint64_t bit = 1ULL << (block%64);
+    	if (Seen[block/64].fetch_or(bit) & bit) {
+    	    Twice[block/64].fetch_or(bit);
+	}
+    }
+
+    bool seen(uint32_t block) const {
+    	return (Seen[block/64].load() >> (block%64)) & 1;
+    }
+
+    static size_t count(const std::unique_ptr<std::atomic<uint64_t>[]> &words, size_t n) {
+    	size_t total = 0;
+    	for (size_t i = 0; i < n; i++) {
+    	    total += __builtin_popcountll(words[i].load());
+	}
+	return total;
+    }
+
+    // Check pointer to data block at given index of file, queueing the
+    // block to be verified if it has a checksum
+    void check_data(uint32_t block, uint32_t index, uint32_t fileBlocks, std::vector<uint32_t> *data) {
+    	if (!block) {
+    	    return;
+	}
+	if (!in_range(block)) {
+	    OutOfRange++;
+	    return;
+	}
+	mark(block);
+	if (index >= fileBlocks) {
+	    PastEnd++;
+	}
+	if (Sums && Sums->has(block)) {
+	    data->push_back(block);
+	}
+    }
+
+    // Check pointer to pointer block and queue it to be read
+    void check_tree(uint32_t block, uint32_t depth, uint32_t firstIndex, uint32_t fileBlocks, std::vector<Pending> *pending) {
+    	if (!block) {
+    	    return;
+	}
+	if (!in_range(block)) {
+	    OutOfRange++;
+	    return;
+	}
+	mark(block);
+	if (firstIndex >= fileBlocks) {
+	    PastEnd++;
+	}
+	pending->push_back(Pending{block, depth, firstIndex, fileBlocks});
+    }
+
+    // Read queued pointer blocks in block order, one request per run of
+    // consecutive blocks, until no level is left
+    void read_trees(std::vector<Pending> *pending, std::vector<uint32_t> *data) {
+    	std::vector<char> buffer;
+    	while (!pending->empty()) {
+    	    std::sort(pending->begin(), pending->end(), [](const Pending &a, const Pending &b) {
+    	    	return a.BlockNumber < b.BlockNumber;
+	    });
+
+	    std::vector<Pending> next;
+	    for (size_t i = 0; i < pending->size(); ) {
+	    	size_t run = 1;
+	    	while (i + run < pending->size() && run < SCAN_BATCH &&
+	    	       (*pending)[i + run].BlockNumber == (*pending)[i].BlockNumber + run) {
+	    	    run++;
+		}
+		buffer.resize(run*Disk::BLOCK_SIZE);
+		Device->read_blocks((*pending)[i].BlockNumber, run, buffer.data());
+		verify((*pending)[i].BlockNumber, run, buffer.data());
+
+		for (size_t r = 0; r < run; r++) {
+		    const Pending &entry = (*pending)[i + r];
+		    const Block *block = (const Block *)(buffer.data() + r*Disk::BLOCK_SIZE);
+		    for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
+		    	if (entry.Depth > 1) {
+		    	    check_tree(block->Pointers[k], entry.Depth - 1, entry.FirstIndex + k*POINTERS_PER_BLOCK, entry.FileBlocks, &next);
+			} else {
+			    check_data(block->Pointers[k], entry.FirstIndex + k, entry.FileBlocks, data);
+			}
+		    }
+		}
+		i += run;
+	    }
+	    pending->swap(next);
+	}
+    }
+
+    // Read queued data blocks in block order, one request per run of
+    // consecutive blocks, and verify them
+    void verify_data(std::vector<uint32_t> *data) {
+    	std::sort(data->begin(), data->end());
+    	data->erase(std::unique(data->begin(), data->end()), data->end());
+
+    	std::vector<char> buffer;
+    	for (size_t i = 0; i < data->size(); ) {
+    	    size_t run = 1;
+    	    while (i + run < data->size() && run < SCAN_BATCH && (*data)[i + run] == (*data)[i] + run) {
+    	    	run++;
+	    }
+	    buffer.resize(run*Disk::BLOCK_SIZE);
+	    Device->read_blocks((*data)[i], run, buffer.data());
+	    verify((*data)[i], run, buffer.data());
+	    i += run;
+	}
+	data->clear();
+    }
+
+    // Check inode blocks [first, last), a batch of inode blocks at a time
+    void check_inodes(uint32_t first, uint32_t last) {
+    	std::vector<Block>    inodeBlocks(SCAN_BATCH);
+    	std::vector<Pending>  pending;
+    	std::vector<uint32_t> data;
+    	for (uint32_t i = first; i < last; i += SCAN_BATCH) {
+    	    uint32_t count = std::min(SCAN_BATCH, last - i);
+    	    Device->read_blocks(i + 1, count, inodeBlocks[0].Data);
+    	    verify(i + 1, count, inodeBlocks[0].Data);
+
+    	    for (uint32_t b = 0; b < count; b++) {
+    	    	for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+    	    	    const Inode &node = inodeBlocks[b].Inodes[j];
+    	    	    if (!node.Valid) {
+    	    	    	continue;
+		    }
+		    Files++;
+		    Valid[(size_t)(i + b)*INODES_PER_BLOCK + j] = node.Valid;
+		    if (node.Valid & INODE_DIRECTORY) {
+		    	std::lock_guard<std::mutex> guard(DirectoryLock);
+		    	Directories.push_back(node);
+		    }
+		    if (node.Valid & INODE_INLINE) {
+		    	continue;
+		    }
+
+		    uint32_t fileBlocks = mapped_blocks(node);
+		    for (uint32_t k = 0; k < Direct; k++) {
+		    	check_data(node.Direct[k], k, fileBlocks, &data);
+		    }
+		    check_tree(node.Indirect, 1, Direct, fileBlocks, &pending);
+		    if (Super.Version >= 2) {
+		    	check_tree(node.Direct[Direct], 2, Direct + POINTERS_PER_BLOCK, fileBlocks, &pending);
+		    }
+		}
+	    }
+	    read_trees(&pending, &data);
+	    verify_data(&data);
+	}
+    }
+
+    // Compare saved free block bitmap with the blocks actually referenced
+    void check_bitmap(FsckReport *report) {
+    	Block bitmapBlock;
+    	for (uint32_t i = 0; i < Super.BitmapBlocks; i++) {
+    	    Device->read(Super.InodeBlocks + 1 + i, bitmapBlock.Data);
+    	    verify(Super.InodeBlocks + 1 + i, 1, bitmapBlock.Data);
+    	    for (uint32_t j = 0; j < BITS_PER_BLOCK; j++) {
+    	    	uint32_t block = i*BITS_PER_BLOCK + j;
+    	    	if (block < DataStart || block >= Super.Blocks) {
+    	    	    continue;
+		}
+		bool free = (bitmapBlock.Words[j/64] >> (j%64)) & 1;
+		if (!free && !seen(block)) {
+		    report->Leaked++;
+		} else if (free && seen(block)) {
+		    report->Unmarked++;
+		}
+	    }
+	}
+    }
+
+    struct PointerCache {	// Pointer blocks read last while walking a file
+    	uint32_t Loaded[2];	// Indirect or second level block, double indirect block
+    	Block	 Contents[2];
+
+    	PointerCache() { Loaded[0] = Loaded[1] = 0; }
+    };
+
+    // Return pointer k of pointer block, reading it unless it was the last
+    // one read at its level (0 if either is out of range)
+    uint32_t pointer(uint32_t block, uint32_t k, uint32_t level, PointerCache *cache) {
+    	if (!in_range(block)) {
+    	    return 0;
+	}
+	if (cache->Loaded[level] != block) {
+	    Device->read(block, cache->Contents[level].Data);
+	    cache->Loaded[level] = block;
+	}
+	uint32_t result = cache->Contents[level].Pointers[k];
+	return in_range(result) ? result : 0;
+    }
+
+    // Return disk block holding given block of file (0 if none)
+    uint32_t file_block(const Inode &node, uint32_t index, PointerCache *cache) {
+    	if (index < Direct) {
+    	    return in_range(node.Direct[index]) ? node.Direct[index] : 0;
+	}
+	index -= Direct;
+	if (index < POINTERS_PER_BLOCK) {
+	    return pointer(node.Indirect, index, 0, cache);
+	}
+	index -= POINTERS_PER_BLOCK;
+	if (Super.Version < 2 || index >= POINTERS_PER_BLOCK*POINTERS_PER_BLOCK) {
+	    return 0;
+	}
+	uint32_t second = pointer(node.Direct[Direct], index/POINTERS_PER_BLOCK, 1, cache);
+	return second ? pointer(second, index%POINTERS_PER_BLOCK, 0, cache) : 0;
+    }
+
+    // Count the names in a directory, one per entry naming a valid inode;
+    // with fix, drop the other entries and keep the header count in step
+    void walk_directory(const Inode &node, std::vector<uint32_t> *names, bool fix, size_t *badEntries) {
+    	PointerCache cache;
+    	uint32_t     headerBlock = file_block(node, 0, &cache);
+    	if (!headerBlock) {
+    	    return;
+	}
+	Block header;
+	Device->read(headerBlock, header.Data);
+
+	uint32_t buckets = std::min(header.Pointers[HEADER_BUCKETS], 1u << MAX_DEPTH);
+	uint32_t entries = 0;
+	Block	 bucket;
+	for (uint32_t b = 0; b < buckets; b++) {
+	    uint32_t block = file_block(node, BUCKET_START + b, &cache);
+	    if (!block) {
+	    	continue;
+	    }
+	    Device->read(block, bucket.Data);
+
+	    bool     dirty = false;
+	    uint32_t count = std::min(bucket.Names.Count, ENTRIES_PER_BUCKET);
+	    for (uint32_t i = 0; i < count; ) {
+	    	const Entry &entry = bucket.Names.Entries[i];
+	    	if (entry.Inumber < Super.Inodes && Valid[entry.Inumber] && entry.Length && entry.Length <= NAME_LENGTH) {
+	    	    (*names)[entry.Inumber]++;
+	    	    i++;
+	    	    continue;
+		}
+		(*badEntries)++;
+		if (!fix) {
+		    i++;
+		    continue;
+		}
+		bucket.Names.Entries[i] = bucket.Names.Entries[--count];
+		memset(&bucket.Names.Entries[count], 0, sizeof(Entry));
+		dirty = true;
+	    }
+	    entries += count;
+	    if (dirty) {
+	    	bucket.Names.Count = count;
+	    	write(block, bucket.Data);
+	    }
+	}
+
+	if (fix && header.Pointers[HEADER_ENTRIES] != entries) {
+	    header.Pointers[HEADER_ENTRIES] = entries;
+	    write(headerBlock, header.Data);
+	}
+    }
+
+    // Read valid words and directory inodes again, once repair has cleared
+    // pointers
+    void reload_inodes() {
+    	Block inodeBlock;
+    	Directories.clear();
+    	for (uint32_t i = 0; i < UsedBlocks; i++) {
+    	    Device->read(i + 1, inodeBlock.Data);
+    	    for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+    	    	const Inode &node = inodeBlock.Inodes[j];
+    	    	Valid[(size_t)i*INODES_PER_BLOCK + j] = node.Valid;
+    	    	if (node.Valid & INODE_DIRECTORY) {
+    	    	    Directories.push_back(node);
+		}
+	    }
+	}
+    }
+
+    // Walk every directory check_inodes found, counting the names of each
+    // inode, then compare the counts with the link counts inodes keep; with
+    // fix, drop entries naming no valid inode and set link counts to the
+    // names found
+    void check_names(bool fix, size_t *badEntries, size_t *linkCounts) {
+	std::vector<uint32_t> names(Super.Inodes, 0);
+	for (auto &node : Directories) {
+	    walk_directory(node, &names, fix, badEntries);
+	}
+
+	Block inodeBlock;
+	for (uint32_t i = 0; i < UsedBlocks; i++) {
+	    bool dirty = false;
+	    for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+	    	size_t	 inumber = (size_t)i*INODES_PER_BLOCK + j;
+	    	uint32_t found	 = names[inumber] < MAX_LINKS ? names[inumber] : MAX_LINKS;
+	    	if (!Valid[inumber] || Valid[inumber] >> LINK_SHIFT == found) {
+	    	    continue;
+		}
+		(*linkCounts)++;
+		if (fix) {
+		    if (!dirty) {
+		    	Device->read(i + 1, inodeBlock.Data);
+		    	dirty = true;
+		    }
+		    Inode *node = &inodeBlock.Inodes[j];
+		    node->Valid = (node->Valid & ((1u << LINK_SHIFT) - 1)) | (found << LINK_SHIFT);
+		}
+	    }
+	    if (dirty) {
+	    	write(i + 1, inodeBlock.Data);
+	    }
+	}
+    }
+
+    // Clear pointer if it is out of range, already claimed or not needed,
+    // otherwise claim the block it points to
+    bool fix_pointer(uint32_t *pointer, bool needed, Bitmap *claimed, FsckReport *report) {
+    	if (!*pointer) {
+    	    return false;
+	}
+	if (!needed || !in_range(*pointer) || claimed->test(*pointer)) {
+	    *pointer = 0;
+	    report->Cleared++;
+	    return true;
+	}
+	claimed->set(*pointer);
+	return false;
+    }
+
+    // Fix pointer to pointer block, then every pointer in it (returns
+    // whether or not the pointer itself was cleared)
+    bool fix_tree(uint32_t *pointer, uint32_t depth, uint32_t firstIndex, uint32_t fileBlocks, Bitmap *claimed, FsckReport *report) {
+    	if (fix_pointer(pointer, firstIndex < fileBlocks, claimed, report)) {
+    	    return true;
+	}
+	if (!*pointer) {
+	    return false;
+	}
+
+	Block block;
+	bool  dirty = false;
+	Device->read(*pointer, block.Data);
+	for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++) {
+	    if (depth > 1) {
+	    	if (fix_tree(&block.Pointers[k], depth - 1, firstIndex + k*POINTERS_PER_BLOCK, fileBlocks, claimed, report)) {
+	    	    dirty = true;
+		}
+	    } else if (fix_pointer(&block.Pointers[k], firstIndex + k < fileBlocks, claimed, report)) {
+	    	dirty = true;
+	    }
+	}
+	if (dirty) {
+	    write(*pointer, block.Data);
+	}
+	return false;
+    }
+
+    // Walk inode table in order, keeping the first reference to every block,
+    // then fix directory entries and link counts, and rewrite the free block
+    // bitmap from the blocks kept; a block that fails its checksum is kept
+    // as it is, with a new checksum
+    void repair(FsckReport *report) {
+    	Bitmap claimed(Super.Blocks, false);
+    	Block  inodeBlock;
+    	for (uint32_t block : Bad) {
+    	    Block contents;
+    	    Device->read(block, contents.Data);
+    	    Sums->update(block, 1, contents.Data);
+	}
+
+    	for (uint32_t i = 0; i < UsedBlocks; i++) {
+    	    Device->read(i + 1, inodeBlock.Data);
+    	    bool dirty = false;
+    	    for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
+    	    	Inode *node = &inodeBlock.Inodes[j];
+    	    	if (!node->Valid || (node->Valid & INODE_INLINE)) {
+    	    	    continue;
+		}
+
+		uint32_t fileBlocks = mapped_blocks(*node);
+		size_t   before     = report->Cleared;
+		for (uint32_t k = 0; k < Direct; k++) {
+		    fix_pointer(&node->Direct[k], k < fileBlocks, &claimed, report);
+		}
+		fix_tree(&node->Indirect, 1, Direct, fileBlocks, &claimed, report);
+		if (Super.Version >= 2) {
+		    fix_tree(&node->Direct[Direct], 2, Direct + POINTERS_PER_BLOCK, fileBlocks, &claimed, report);
+		}
+		dirty = dirty || report->Cleared != before;
+	    }
+	    if (dirty) {
+	    	write(i + 1, inodeBlock.Data);
+	    }
+	}
+
+	// Counted again, as clearing pointers may have dropped names
+	if (Super.Version >= 4) {
+	    size_t badEntries = 0, linkCounts = 0;
+	    reload_inodes();
+	    check_names(true, &badEntries, &linkCounts);
+	}
+
+	if (Super.Version < 1) {
+	    return;
+	}
+
+	Block bitmapBlock;
+	for (uint32_t i = 0; i < Super.BitmapBlocks; i++) {
+	    for (uint32_t j = 0; j < BITS_PER_BLOCK; j++) {
+	    	uint32_t block = i*BITS_PER_BLOCK + j;
+	    	bool     free  = block >= DataStart && block < Super.Blocks && !claimed.test(block);
+	    	if (j%64 == 0) {
+	    	    bitmapBlock.Words[j/64] = 0;
+		}
+		if (free) {
+		    bitmapBlock.Words[j/64] |= 1ULL << (j%64);
+		}
+	    }
+	    write(Super.InodeBlocks + 1 + i, bitmapBlock.Data);
+	}
+
+	if (Sums) {
+	    std::vector<uint32_t> blocks;
+	    std::vector<char>	  table;
+	    Sums->dirty_blocks(&blocks, &table);
+	    for (size_t i = 0; i < blocks.size(); i++) {
+	    	Device->write(blocks[i], table.data() + i*Disk::BLOCK_SIZE);
+	    }
+	    Sums->settle();
+	}
+
+	Block superBlock;
+	Device->read(0, superBlock.Data);
+	superBlock.Super.State = STATE_CLEAN;
+	Device->write(0, superBlock.Data);
+    }
+};
+
+// Check file system -----------------------------------------------------------
+
+bool FileSystem::fsck(Disk *disk, bool repair, FsckReport *report) {
+    if (disk->mounted()){
+        return false;
+    }
+
+    Block superBlock;
+    disk->read(0, superBlock.Data);
+    if (!valid_super(superBlock.Super, disk->size())){
+        return false;
+    }
+
+    memset(report, 0, sizeof(*report));
+
+    // Check the file system as the next mount would see it
+    uint32_t journalBlocks = superBlock.Super.Version >= 6 ? superBlock.Super.JournalBlocks : 0;
+    if (journalBlocks){
+        Journal journal(disk, 1 + superBlock.Super.InodeBlocks + superBlock.Super.BitmapBlocks, journalBlocks);
+        try {
+            report->Replayed = journal.recover();
+        } catch (std::runtime_error &) {
+            return false;
+        }
+    }
+    Checker checker(disk, superBlock.Super);
+    checker.load_checksums();
+
+    // One pass over the inode table, split across threads like the mount
+    // scan; each range reads its own pointer blocks in batches
+    uint32_t inodeBlocks = checker.UsedBlocks;
+    uint32_t threads     = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max(1u, std::min(threads, inodeBlocks/SCAN_MIN_BLOCKS));
+    uint32_t perThread   = (inodeBlocks + threads - 1)/threads;
+
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < threads; t++){
+        uint32_t first = std::min(t*perThread, inodeBlocks);
+        uint32_t last  = std::min(first + perThread, inodeBlocks);
+        auto check = [&checker, &errors, first, last, t]() {
+            try {
+                checker.check_inodes(first, last);
+            } catch (...) {
+                errors[t] = std::current_exception();
+            }
+        };
+        if (t + 1 < threads){
+            workers.emplace_back(check);
+        }else{
+            check();
+        }
+    }
+    for (auto &worker : workers){
+        worker.join();
+    }
+    for (auto &error : errors){
+        if (error){
+            std::rethrow_exception(error);
+        }
+    }
+
+    report->Files      = checker.Files;
+    report->Blocks     = Checker::count(checker.Seen, checker.Words);
+    report->OutOfRange = checker.OutOfRange;
+    report->Duplicates = Checker::count(checker.Twice, checker.Words);
+    report->PastEnd    = checker.PastEnd;
+
+    // Saved bitmap only describes the disk after a clean unmount, unless a
+    // journal kept it in step
+    if (superBlock.Super.Version >= 1 && (superBlock.Super.State == STATE_CLEAN || journalBlocks)){
+        checker.check_bitmap(report);
+    }
+    report->BadChecksums = checker.Bad.size();
+
+    // Directories (version 4 on) must name only valid inodes, and every
+    // inode must count the names it has
+    if (superBlock.Super.Version >= 4){
+        checker.check_names(false, &report->BadEntries, &report->LinkCounts);
+    }
+
+    if (repair && report->errors()){
+        checker.repair(report);
+        disk->flush();
+    }
+    return true;
+}
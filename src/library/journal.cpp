@@ -0,0 +1,194 @@
+// journal.cpp: Write-ahead journal of metadata blocks
+
+#include "sfs/journal.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <string.h>
+
+const uint32_t Journal::MAGIC_NUMBER;
+const uint32_t Journal::MIN_BLOCKS;
+const uint32_t Journal::MAX_BLOCKS;
+const uint32_t Journal::DESCRIPTOR_ENTRIES;
+
+uint32_t Journal::blocks_for(uint32_t blocks) {
+    uint32_t journal = std::min(blocks/32, MAX_BLOCKS);
+    return journal < MIN_BLOCKS ? 0 : journal;
+}
+
+void Journal::format(Disk *disk, uint32_t start, uint32_t blocks) {
+    Journal journal(disk, start, blocks);
+    journal.write_header(1, 1);
+}
+
+Journal::Journal(Disk *disk, uint32_t start, uint32_t blocks)
+    : Device(disk), Start(start), Size(blocks), Head(1), Sequence(1),
+      Commits(0), LoggedBlocks(0), Checkpoints(0), Replayed(0) {
+}
+
+uint32_t Journal::checksum(const Block &descriptor, const char *images, size_t count) {
+    // FNV-1a over the descriptor as written, then every image
+    Block copy = descriptor;
+    copy.Describe.Checksum = 0;
+
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < Disk::BLOCK_SIZE; i++) {
+    	hash = (hash ^ (unsigned char)copy.Data[i])*16777619u;
+    }
+    for (size_t i = 0; i < count*Disk::BLOCK_SIZE; i++) {
+    	hash = (hash ^ (unsigned char)images[i])*16777619u;
+    }
+    return hash;
+}
+
+void Journal::write_header(uint32_t offset, uint64_t sequence) {
+    Block header;
+    memset(header.Data, 0, Disk::BLOCK_SIZE);
+    header.Head.MagicNumber = MAGIC_NUMBER;
+    header.Head.Start	    = offset;
+    header.Head.Sequence    = sequence;
+    Device->write(Start, header.Data);
+}
+
+size_t Journal::recover() {
+    Block header;
+    Device->read(Start, header.Data);
+    if (header.Head.MagicNumber != MAGIC_NUMBER || header.Head.Start < 1 || header.Head.Start >= Size) {
+    	throw std::runtime_error("journal header is corrupt");
+    }
+
+    // Collect transactions in order until one is missing or torn
+    struct Transaction {
+    	uint64_t	  Sequence;
+    	std::vector<uint32_t> Targets;
+    	std::vector<char> Images;
+    };
+    std::vector<Transaction> transactions;
+    std::unordered_map<uint32_t, uint64_t> revoked;	// Block to last revoking transaction
+
+    uint32_t offset   = header.Head.Start;
+    uint64_t sequence = header.Head.Sequence;
+    while (offset + 1 < Size) {
+    	Block descriptor;
+    	Device->read(Start + offset, descriptor.Data);
+    	Descriptor &describe = descriptor.Describe;
+    	if (describe.MagicNumber != MAGIC_NUMBER || describe.Sequence != sequence ||
+    	    describe.Count + describe.Revoked > DESCRIPTOR_ENTRIES || offset + 1 + describe.Count > Size) {
+    	    break;
+	}
+
+	Transaction transaction;
+	transaction.Sequence = sequence;
+	transaction.Images.resize((size_t)describe.Count*Disk::BLOCK_SIZE);
+	if (describe.Count) {
+	    Device->read_blocks(Start + offset + 1, describe.Count, transaction.Images.data());
+	}
+	if (checksum(descriptor, transaction.Images.data(), describe.Count) != describe.Checksum) {
+	    break;
+	}
+
+	transaction.Targets.assign(describe.Blocks, describe.Blocks + describe.Count);
+	for (uint32_t i = 0; i < describe.Revoked; i++) {
+	    revoked[describe.Blocks[describe.Count + i]] = sequence;
+	}
+	transactions.push_back(std::move(transaction));
+	offset += 1 + describe.Count;
+	sequence++;
+    }
+
+    // Write images home in order, so the last one logged for a block wins;
+    // an image older than a revocation of its block is stale
+    for (auto &transaction : transactions) {
+    	for (size_t i = 0; i < transaction.Targets.size(); i++) {
+    	    auto it = revoked.find(transaction.Targets[i]);
+    	    if (it != revoked.end() && it->second >= transaction.Sequence) {
+    	    	continue;
+	    }
+	    Device->write(transaction.Targets[i], transaction.Images.data() + i*Disk::BLOCK_SIZE);
+	}
+    }
+    if (!transactions.empty() || header.Head.Start != 1) {
+    	Device->flush();
+    	write_header(1, sequence);
+    	Device->flush();
+    }
+
+    Head     = 1;
+    Sequence = sequence;
+    Logged.clear();
+    Revokes.clear();
+    Replayed = transactions.size();
+    return Replayed;
+}
+
+void Journal::commit(Cache *cache) {
+    std::vector<int>  targets;
+    std::vector<char> images;
+    cache->pinned_blocks(&targets, &images);
+    if (targets.empty() && Revokes.empty()) {
+    	return;
+    }
+
+    // File data goes home before the metadata that points at it commits
+    cache->sync(false);
+
+    // Written in place, the transaction would no longer be atomic
+    if (targets.size() > capacity()) {
+    	throw std::runtime_error("transaction does not fit in the journal");
+    }
+
+    // Start over once the transaction does not fit after the last one
+    if (Head + 1 + targets.size() > Size || targets.size() + Revokes.size() > DESCRIPTOR_ENTRIES) {
+    	checkpoint(cache);
+    }
+    Device->flush();
+
+    Block descriptor;
+    memset(descriptor.Data, 0, Disk::BLOCK_SIZE);
+    Descriptor &describe = descriptor.Describe;
+    describe.MagicNumber = MAGIC_NUMBER;
+    describe.Count	 = targets.size();
+    describe.Sequence	 = Sequence;
+    describe.Revoked	 = Revokes.size();
+    std::copy(targets.begin(), targets.end(), describe.Blocks);
+    std::copy(Revokes.begin(), Revokes.end(), describe.Blocks + targets.size());
+    describe.Checksum	 = checksum(descriptor, images.data(), targets.size());
+
+    // Descriptor and images go out as one sequential request
+    std::vector<char *> buffers;
+    buffers.push_back(descriptor.Data);
+    for (size_t i = 0; i < targets.size(); i++) {
+    	buffers.push_back(images.data() + i*Disk::BLOCK_SIZE);
+    }
+    Device->write_blocks(Start + Head, buffers.size(), buffers.data());
+    Device->flush();
+
+    cache->unpin(targets);
+    Logged.insert(targets.begin(), targets.end());
+    Revokes.clear();
+    Head += 1 + targets.size();
+    Sequence++;
+    Commits++;
+    LoggedBlocks += targets.size();
+}
+
+void Journal::checkpoint(Cache *cache) {
+    cache->sync();
+    Device->flush();
+
+    write_header(1, Sequence);
+    Device->flush();
+
+    Head = 1;
+    Logged.clear();
+    Revokes.clear();
+    Checkpoints++;
+}
+
+void Journal::revoke(uint32_t block) {
+    if (Logged.erase(block)) {
+    	Revokes.push_back(block);
+    }
+}
@@ -0,0 +1,164 @@
+// lz.cpp: Fast LZ77 compression of buffers
+
+#include "sfs/lz.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+const size_t LZ::MIN_MATCH;
+const size_t LZ::MAX_OFFSET;
+const size_t LZ::HASH_BITS;
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Append what is left of a length after the 15 its token holds: bytes of
+// 255, then one smaller byte
+static bool put_length(uint8_t **output, uint8_t *end, size_t length) {
+    for (; length >= 255; length -= 255) {
+    	if (*output == end) {
+    	    return false;
+	}
+	*(*output)++ = 255;
+    }
+    if (*output == end) {
+    	return false;
+    }
+    *(*output)++ = (uint8_t)length;
+    return true;
+}
+
+// Read length bytes written by put_length, adding them to length
+static bool get_length(const uint8_t **input, const uint8_t *end, size_t *length) {
+    uint8_t byte;
+    do {
+    	if (*input == end) {
+    	    return false;
+	}
+	byte	 = *(*input)++;
+	*length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Append one sequence (a match of 0 bytes ends the stream)
+static bool put_sequence(uint8_t **output, uint8_t *end, const uint8_t *literals, size_t count,
+			 size_t match, size_t offset) {
+    size_t matchCode = match ? match - LZ::MIN_MATCH : 0;
+    if (*output == end) {
+    	return false;
+    }
+    *(*output)++ = (uint8_t)((std::min(count, (size_t)15) << 4) | std::min(matchCode, (size_t)15));
+    if (count >= 15 && !put_length(output, end, count - 15)) {
+    	return false;
+    }
+    if ((size_t)(end - *output) < count) {
+    	return false;
+    }
+    memcpy(*output, literals, count);
+    *output += count;
+
+    if (!match) {
+    	return true;
+    }
+    if (end - *output < 2) {
+    	return false;
+    }
+    *(*output)++ = (uint8_t)offset;
+    *(*output)++ = (uint8_t)(offset >> 8);
+    return matchCode < 15 || put_length(output, end, matchCode - 15);
+}
+
+size_t LZ::compress(const char *source, size_t length, char *destination, size_t capacity) {
+    const uint8_t *input  = (const uint8_t *)source;
+    uint8_t	  *output = (uint8_t *)destination;
+    uint8_t	  *end	  = output + capacity;
+
+    // Last position of each hashed four byte sequence; stale entries are
+    // caught by comparing the bytes
+    uint32_t table[1 << HASH_BITS] = {0};
+    size_t   anchor   = 0;	// First byte not emitted yet
+    size_t   position = 0;
+    size_t   misses   = 0;
+    while (position + MIN_MATCH <= length) {
+    	uint32_t sequence  = read32(input + position);
+    	uint32_t hash	   = (sequence*2654435761u) >> (32 - HASH_BITS);
+    	size_t	 candidate = table[hash];
+    	table[hash] = position;
+    	if (candidate >= position || position - candidate > MAX_OFFSET || read32(input + candidate) != sequence) {
+    	    // Step faster through data that does not compress
+    	    position += 1 + (misses++ >> 5);
+    	    continue;
+	}
+	misses = 0;
+
+	size_t match = MIN_MATCH;
+	while (position + match < length && input[candidate + match] == input[position + match]) {
+	    match++;
+	}
+	if (!put_sequence(&output, end, input + anchor, position - anchor, match, position - candidate)) {
+	    return 0;
+	}
+	position += match;
+	anchor	  = position;
+    }
+
+    if (!put_sequence(&output, end, input + anchor, length - anchor, 0, 0)) {
+    	return 0;
+    }
+    return output - (uint8_t *)destination;
+}
+
+ssize_t LZ::decompress(const char *source, size_t length, char *destination, size_t capacity) {
+    const uint8_t *input = (const uint8_t *)source;
+    const uint8_t *end	 = input + length;
+    uint8_t	  *output = (uint8_t *)destination;
+    size_t	   produced = 0;
+
+    while (input < end) {
+    	uint8_t token	 = *input++;
+    	size_t	literals = token >> 4;
+    	if (literals == 15 && !get_length(&input, end, &literals)) {
+    	    return -1;
+	}
+	if (literals > (size_t)(end - input) || literals > capacity - produced) {
+	    return -1;
+	}
+	memcpy(output + produced, input, literals);
+	input	 += literals;
+	produced += literals;
+	if (input == end) {
+	    break;
+	}
+
+	if (end - input < 2) {
+	    return -1;
+	}
+	size_t offset = input[0] | (input[1] << 8);
+	size_t match  = token & 15;
+	input += 2;
+	if (match == 15 && !get_length(&input, end, &match)) {
+	    return -1;
+	}
+	match += MIN_MATCH;
+	if (!offset || offset > produced || match > capacity - produced) {
+	    return -1;
+	}
+
+	// Matches may overlap the bytes they produce, so copy forward
+	const uint8_t *from = output + produced - offset;
+	if (offset >= match) {
+	    memcpy(output + produced, from, match);
+	} else {
+	    for (size_t i = 0; i < match; i++) {
+	    	output[produced + i] = from[i];
+	    }
+	}
+	produced += match;
+    }
+    return produced;
+}
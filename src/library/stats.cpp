@@ -0,0 +1,67 @@
+// stats.cpp: Call counters and latency histograms
+
+#include "sfs/stats.h"
+
+#include <math.h>
+
+const size_t Histogram::BUCKETS;
+
+void Histogram::record(uint64_t value) {
+    size_t bucket = value ? 64 - __builtin_clzll(value) : 0;
+    if (bucket >= BUCKETS) {
+    	bucket = BUCKETS - 1;
+    }
+
+    Buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    Count.fetch_add(1, std::memory_order_relaxed);
+    Total.fetch_add(value, std::memory_order_relaxed);
+
+    uint64_t max = Max.load(std::memory_order_relaxed);
+    while (value > max && !Max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+void Histogram::reset() {
+    for (size_t i = 0; i < BUCKETS; i++) {
+    	Buckets[i].store(0, std::memory_order_relaxed);
+    }
+    Count.store(0, std::memory_order_relaxed);
+    Total.store(0, std::memory_order_relaxed);
+    Max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::percentile(double p) const {
+    uint64_t count = this->count();
+    if (count == 0) {
+    	return 0;
+    }
+    if (p >= 100) {
+    	return max();
+    }
+
+    // Rank of the value wanted, counting from 1
+    uint64_t rank = (uint64_t)ceil(p/100*count);
+    rank = rank < 1 ? 1 : rank;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+    	seen += bucket(i);
+    	if (seen >= rank) {
+    	    uint64_t bound = i ? (1ULL << i) - 1 : 0;
+    	    return bound < max() ? bound : max();
+	}
+    }
+    return max();
+}
+
+void OpStats::record(uint64_t nanoseconds, uint64_t bytes) {
+    Calls.fetch_add(1, std::memory_order_relaxed);
+    Bytes.fetch_add(bytes, std::memory_order_relaxed);
+    Latency.record(nanoseconds);
+}
+
+void OpStats::reset() {
+    Calls.store(0, std::memory_order_relaxed);
+    Bytes.store(0, std::memory_order_relaxed);
+    Latency.reset();
+}
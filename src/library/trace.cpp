@@ -0,0 +1,110 @@
+// trace.cpp: Binary trace of disk transfers and file system calls
+
+#include "sfs/trace.h"
+
+#include <stdexcept>
+
+#include <errno.h>
+#include <string.h>
+
+const uint32_t Trace::MAGIC_NUMBER;
+const uint32_t Trace::VERSION;
+
+void Trace::open(const char *path) {
+    close();
+
+    Stream = fopen(path, "wb");
+    if (!Stream) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
+    	throw std::runtime_error(what);
+    }
+
+    Header header = {MAGIC_NUMBER, VERSION, sizeof(TraceRecord), 0};
+    if (fwrite(&header, sizeof(header), 1, Stream) != 1) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to write %s: %s", path, strerror(errno));
+    	throw std::runtime_error(what);
+    }
+
+    Records = 0;
+    Start   = std::chrono::steady_clock::now();
+}
+
+void Trace::close() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    if (Stream) {
+    	fclose(Stream);
+    	Stream = nullptr;
+    }
+}
+
+uint64_t Trace::now() const {
+    auto elapsed = std::chrono::steady_clock::now() - Start;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+void Trace::record(const TraceRecord &record, const char *name) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    // Records are buffered by stdio, so tracing costs no syscall per call
+    if (!Stream || fwrite(&record, sizeof(record), 1, Stream) != 1) {
+    	return;
+    }
+    if (named(record.Type)) {
+    	static const char padding[8] = {0};
+    	fwrite(name, 1, record.Length, Stream);
+    	fwrite(padding, 1, (8 - record.Length%8)%8, Stream);
+    }
+    Records++;
+}
+
+const char *Trace::name(uint16_t type) {
+    static const char *names[TYPES] = {
+    	"unknown", "disk read", "disk write", "mount", "unmount", "sync",
+    	"create", "remove", "stat", "read", "write",
+    	"root", "lookup", "link", "unlink", "mkdir", "compress",
+    };
+    return type < TYPES ? names[type] : names[0];
+}
+
+void Trace::load(const char *path, std::vector<TraceRecord> *records, std::vector<std::string> *names) {
+    FILE *stream = fopen(path, "rb");
+    if (!stream) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
+    	throw std::runtime_error(what);
+    }
+
+    Header header;
+    if (fread(&header, sizeof(header), 1, stream) != 1 || header.MagicNumber != MAGIC_NUMBER ||
+    	header.Version < 1 || header.Version > VERSION || header.RecordSize != sizeof(TraceRecord)) {
+    	fclose(stream);
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "%s is not a trace", path);
+    	throw std::runtime_error(what);
+    }
+
+    records->clear();
+    if (names) {
+    	names->clear();
+    }
+    TraceRecord record;
+    std::string name;
+    while (fread(&record, sizeof(record), 1, stream) == 1) {
+    	name.clear();
+    	if (header.Version >= 2 && named(record.Type)) {
+    	    name.resize(record.Length + (8 - record.Length%8)%8);
+    	    if (fread(&name[0], 1, name.size(), stream) != name.size()) {
+    	    	break;
+	    }
+	    name.resize(record.Length);
+	}
+    	records->push_back(record);
+    	if (names) {
+    	    names->push_back(name);
+	}
+    }
+    fclose(stream);
+}
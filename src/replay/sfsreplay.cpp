@@ -0,0 +1,243 @@
+// sfsreplay.cpp: Replay a trace against a disk image
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+#include "sfs/stats.h"
+#include "sfs/trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Per kind of call comparison of recorded and replayed latencies
+
+struct Comparison {
+    Histogram Recorded;	    // Nanoseconds per recorded call
+    Histogram Replayed;	    // Nanoseconds per replayed call
+};
+
+// Functions
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-m] [-p] [-d] [-f] <tracefile> <diskfile> <nblocks>\n", program);
+    fprintf(stderr, "    -m	Use the mmap backend\n");
+    fprintf(stderr, "    -p	Keep the recorded pacing between calls\n");
+    fprintf(stderr, "    -d	Replay disk transfers instead of file system calls\n");
+    fprintf(stderr, "    -f	Format disk before replaying\n");
+}
+
+bool is_disk(const TraceRecord &record) {
+    return record.Type == Trace::DISK_READ || record.Type == Trace::DISK_WRITE;
+}
+
+// Return inode of the replay standing for an inode of the trace
+size_t replayed_inode(uint64_t inumber, std::unordered_map<uint32_t, ssize_t> &inodes) {
+    auto it = inodes.find(inumber);
+    return it != inodes.end() ? it->second : inumber;
+}
+
+// Replay one file system call, returning what it returned; inodes created
+// (or found by name) during the trace are mapped to the ones created (or
+// found) during the replay
+int64_t replay_call(FileSystem &fs, Disk &disk, const TraceRecord &record, const std::string &name,
+		    std::vector<char> &buffer, std::unordered_map<uint32_t, ssize_t> &inodes) {
+    size_t inumber = replayed_inode(record.Target, inodes);
+
+    switch (record.Type) {
+    	case Trace::MOUNT:
+    	    return fs.mount(&disk) ? 1 : -1;
+	case Trace::UNMOUNT:
+	    fs.unmount();
+	    return 0;
+	case Trace::SYNC:
+	    fs.sync();
+	    return 0;
+	case Trace::CREATE: {
+	    ssize_t result = fs.create();
+	    if (record.Result >= 0 && result >= 0) {
+	    	inodes[record.Result] = result;
+	    }
+	    return result;
+	}
+	case Trace::REMOVE:
+	    return fs.remove(inumber) ? 1 : -1;
+	case Trace::STAT:
+	    return fs.stat(inumber);
+	case Trace::READ:
+	    return fs.read(inumber, buffer.data(), record.Length, record.Offset);
+	case Trace::WRITE:
+	    return fs.write(inumber, buffer.data(), record.Length, record.Offset);
+	case Trace::COMPRESS:
+	    return fs.compress(inumber) ? 1 : -1;
+	case Trace::LINK:
+	    return fs.link(inumber, name.c_str(), replayed_inode(record.Offset, inodes)) ? 1 : -1;
+	case Trace::UNLINK:
+	    return fs.unlink(inumber, name.c_str()) ? 1 : -1;
+	case Trace::ROOT:
+	case Trace::LOOKUP:
+	case Trace::MKDIR: {
+	    ssize_t result = record.Type == Trace::ROOT   ? fs.root(record.Target) :
+			     record.Type == Trace::LOOKUP ? fs.lookup(inumber, name.c_str()) :
+							    fs.mkdir(inumber, name.c_str());
+	    if (record.Result >= 0 && result >= 0) {
+	    	inodes[record.Result] = result;
+	    }
+	    return result;
+	}
+    }
+    return -1;
+}
+
+// Replay one disk transfer, returning number of blocks moved
+int64_t replay_transfer(Disk &disk, const TraceRecord &record, std::vector<char> &buffer) {
+    try {
+    	if (record.Type == Trace::DISK_WRITE) {
+    	    disk.write_blocks(record.Target, record.Length, buffer.data());
+	} else {
+	    disk.read_blocks(record.Target, record.Length, buffer.data());
+	}
+    } catch (std::exception &e) {
+    	return -1;
+    }
+    return record.Length;
+}
+
+double microseconds(uint64_t nanoseconds) {
+    return nanoseconds/1000.0;
+}
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+    Disk::Backend backend   = Disk::BACKEND_FILE;
+    bool	  paced	    = false;
+    bool	  transfers = false;
+    bool	  format    = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "mpdf")) != -1) {
+    	switch (option) {
+    	    case 'm': backend   = Disk::BACKEND_MMAP; break;
+    	    case 'p': paced	= true; break;
+    	    case 'd': transfers = true; break;
+    	    case 'f': format	= true; break;
+	    default:
+	    	usage(argv[0]);
+	    	return EXIT_FAILURE;
+	}
+    }
+
+    if (argc - optind != 3) {
+    	usage(argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    // Keep only the calls of the layer being replayed, in order of start
+    // (ordering indices, so each record keeps its name)
+    std::vector<TraceRecord> records;
+    std::vector<std::string> names;
+    try {
+    	Trace::load(argv[optind], &records, &names);
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "Unable to load trace: %s\n", e.what());
+    	return EXIT_FAILURE;
+    }
+    std::vector<size_t> order;
+    for (size_t i = 0; i < records.size(); i++) {
+    	if (is_disk(records[i]) == transfers) {
+    	    order.push_back(i);
+	}
+    }
+    std::stable_sort(order.begin(), order.end(), [&records](size_t a, size_t b) {
+    	return records[a].Time < records[b].Time;
+    });
+
+    Disk disk;
+    try {
+    	disk.open(argv[optind + 1], strtoul(argv[optind + 2], NULL, 10), backend);
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[optind + 1], e.what());
+    	return EXIT_FAILURE;
+    }
+    if (format && !FileSystem::format(&disk)) {
+    	fprintf(stderr, "Unable to format %s\n", argv[optind + 1]);
+    	return EXIT_FAILURE;
+    }
+
+    size_t bufferSize = 0;
+    for (size_t i : order) {
+    	const TraceRecord &record = records[i];
+    	if (Trace::named(record.Type)) {
+    	    continue;
+	}
+    	bufferSize = std::max(bufferSize, transfers ? record.Length*Disk::BLOCK_SIZE : record.Length);
+    }
+    std::vector<char> buffer(bufferSize);
+    for (size_t i = 0; i < buffer.size(); i++) {
+    	buffer[i] = (char)(i*7 + i/Disk::BLOCK_SIZE);
+    }
+
+    FileSystem				  fs;
+    std::unordered_map<uint32_t, ssize_t> inodes;
+    std::vector<Comparison>		  comparisons(Trace::TYPES);
+    size_t    mismatches     = 0;
+    uint64_t  bytes	     = 0;
+    uint64_t  recordedBusy   = 0;
+    uint64_t  replayedBusy   = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i : order) {
+    	const TraceRecord &record = records[i];
+    	if (paced) {
+    	    std::this_thread::sleep_until(start + std::chrono::nanoseconds(record.Time - records[order.front()].Time));
+	}
+
+	auto	callStart = std::chrono::steady_clock::now();
+	int64_t result	  = transfers ? replay_transfer(disk, record, buffer)
+				      : replay_call(fs, disk, record, names[i], buffer, inodes);
+	uint64_t elapsed  = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - callStart).count();
+
+	// A call that failed in only one of the runs means the image differs
+	if ((result < 0) != (record.Result < 0)) {
+	    mismatches++;
+	}
+	if (result > 0 && (transfers || record.Type == Trace::READ || record.Type == Trace::WRITE)) {
+	    bytes += transfers ? result*Disk::BLOCK_SIZE : result;
+	}
+
+	uint16_t type = record.Type < Trace::TYPES ? record.Type : 0;
+	comparisons[type].Recorded.record(record.Duration);
+	comparisons[type].Replayed.record(elapsed);
+	recordedBusy += record.Duration;
+	replayedBusy += elapsed;
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fs.unmount();
+
+    printf("%-12s %8s %12s %12s %12s %12s\n", "operation", "calls", "rec p50 us", "rep p50 us", "rec p99 us", "rep p99 us");
+    for (uint16_t type = 0; type < Trace::TYPES; type++) {
+    	Comparison &comparison = comparisons[type];
+    	if (!comparison.Recorded.count()) {
+    	    continue;
+	}
+	printf("%-12s %8lu %12.1f %12.1f %12.1f %12.1f\n", Trace::name(type), comparison.Recorded.count(),
+	    microseconds(comparison.Recorded.percentile(50)), microseconds(comparison.Replayed.percentile(50)),
+	    microseconds(comparison.Recorded.percentile(99)), microseconds(comparison.Replayed.percentile(99)));
+    }
+
+    wall = wall > 0 ? wall : 1e-9;
+    printf("recorded busy %.6f s, replayed busy %.6f s (%.2fx)\n", recordedBusy/1e9, replayedBusy/1e9,
+    	replayedBusy ? (double)recordedBusy/replayedBusy : 0.0);
+    printf("replayed in %.6f s: %.1f calls/s, %.2f MB/s\n", wall, order.size()/wall, bytes/wall/(1 << 20));
+    printf("%lu calls, %lu mismatched results\n", order.size(), mismatches);
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
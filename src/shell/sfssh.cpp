@@ -3,225 +3,738 @@
 #include "sfs/disk.h"
 #include "sfs/fs.h"
 
+#include <algorithm>
 #include <sstream>
 #include <string>
 #include <stdexcept>
+#include <vector>
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 // Macros
 
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
+// Command statuses (a batch exits with the worst one)
+
+enum {
+    STATUS_OK	  = 0,	    // Command succeeded
+    STATUS_FAILED = 1,	    // Command ran but failed
+    STATUS_USAGE  = 2,	    // Command was unknown or malformed
+};
+
 // Command prototypes
 
-void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_create(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_remove(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
-void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+int do_debug(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_format(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_mount(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_unmount(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_commit(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_cat(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_copyout(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_create(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_compress(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_remove(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_stat(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_copyin(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_frag(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_fsck(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_stats(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_mkdir(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_ls(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_lookup(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_link(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_unlink(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+int do_help(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
 
 bool copyout(FileSystem &fs, size_t inumber, const char *path);
-bool copyin(FileSystem &fs, const char *path, size_t inumber);
+bool copyin(FileSystem &fs, FILE *stream, size_t inumber);
+
+ssize_t resolve(FileSystem &fs, const char *arg);
+ssize_t split_path(FileSystem &fs, const char *path, std::string *name);
+
+// Command table
+
+struct Command {
+    const char *Name;
+    int (*Function)(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2);
+};
+
+const Command COMMANDS[] = {
+    {"debug",	do_debug},
+    {"format",	do_format},
+    {"mount",	do_mount},
+    {"unmount",	do_unmount},
+    {"commit",	do_commit},
+    {"cat",	do_cat},
+    {"copyout",	do_copyout},
+    {"create",	do_create},
+    {"compress",do_compress},
+    {"remove",	do_remove},
+    {"stat",	do_stat},
+    {"copyin",	do_copyin},
+    {"frag",	do_frag},
+    {"fsck",	do_fsck},
+    {"stats",	do_stats},
+    {"mkdir",	do_mkdir},
+    {"ls",	do_ls},
+    {"lookup",	do_lookup},
+    {"link",	do_link},
+    {"unlink",	do_unlink},
+    {"help",	do_help},
+};
+
+// Shell state
+
+struct Shell {
+    bool	Batch;	    // Whether or not commands come from a script
+    bool	Stop;	    // Whether or not to stop at the first failed command
+    bool	Quit;	    // Set by quit or exit
+    int		Status;	    // Worst status of any command so far
+};
+
+// Functions
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-m] [-t tracefile] [-e] [-c commands | -f script] <diskfile> <nblocks>\n", program);
+    fprintf(stderr, "    -m	Use the mmap backend\n");
+    fprintf(stderr, "    -t	Record a trace of every call\n");
+    fprintf(stderr, "    -e	Stop a batch at the first command that fails\n");
+    fprintf(stderr, "    -c	Run commands separated by ';' or newlines, without prompting\n");
+    fprintf(stderr, "    -f	Run commands from script ('-' for stdin), without prompting\n");
+}
+
+// Run one line of input, returning its status; blank lines and comments
+// starting with '#' do nothing
+int run_line(Disk &disk, FileSystem &fs, Shell &shell, const char *line, size_t number) {
+    std::istringstream	     stream(line);
+    std::vector<std::string> words;
+    std::string		     word;
+    while (stream >> word) {
+    	words.push_back(word);
+    }
+    if (words.empty() || words[0][0] == '#') {
+    	return STATUS_OK;
+    }
+
+    const std::string &cmd = words[0];
+    if (cmd == "exit" || cmd == "quit") {
+    	shell.Quit = true;
+    	return STATUS_OK;
+    }
+
+    int	 args	= words.size();
+    int	 status = STATUS_USAGE;
+    bool found	= false;
+    for (auto &command : COMMANDS) {
+    	if (cmd == command.Name) {
+    	    // A failed disk request (or a block failing its checksum) fails the
+    	    // command rather than the shell
+    	    try {
+    	    	status = command.Function(disk, fs, args,
+    	    	    args > 1 ? words[1].c_str() : "", args > 2 ? words[2].c_str() : "");
+	    } catch (std::runtime_error &e) {
+	    	printf("%s failed: %s\n", cmd.c_str(), e.what());
+	    	status = STATUS_FAILED;
+	    }
+    	    found  = true;
+    	    break;
+	}
+    }
+    if (!found) {
+    	printf("Unknown command: %s\n", cmd.c_str());
+    	printf("Type 'help' for a list of commands.\n");
+    }
+
+    if (status != STATUS_OK && shell.Batch) {
+    	fflush(stdout);
+    	fprintf(stderr, "line %lu: %s: %s\n", number, cmd.c_str(), status == STATUS_USAGE ? "usage" : "failed");
+    }
+    shell.Status = std::max(shell.Status, status);
+    return status;
+}
+
+// Run every line of stream, prompting for each one unless in batch mode
+void run_stream(Disk &disk, FileSystem &fs, Shell &shell, FILE *stream) {
+    char *  line	= nullptr;
+    size_t  capacity	= 0;
+    size_t  number	= 0;
+
+    while (!shell.Quit) {
+    	if (!shell.Batch) {
+    	    fprintf(stderr, "sfs> ");
+    	    fflush(stderr);
+	}
+
+    	if (getline(&line, &capacity, stream) < 0) {
+    	    break;
+	}
+
+	if (run_line(disk, fs, shell, line, ++number) != STATUS_OK && shell.Batch && shell.Stop) {
+	    break;
+	}
+    }
+    free(line);
+}
 
 // Main execution
 
 int main(int argc, char *argv[]) {
-    Disk	disk;
-    FileSystem	fs;
+    Trace	  trace;    // Declared first so it outlives the final unmount
+    Disk	  disk;
+    FileSystem	  fs;
+    Disk::Backend backend = Disk::BACKEND_FILE;
+    const char *  tracePath = nullptr;
+    const char *  commands  = nullptr;
+    const char *  script    = nullptr;
+    bool	  stop	    = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "mt:ec:f:")) != -1) {
+    	switch (option) {
+    	    case 'm':
+    	    	backend = Disk::BACKEND_MMAP;
+    	    	break;
+    	    case 't':
+    	    	tracePath = optarg;
+    	    	break;
+    	    case 'e':
+    	    	stop = true;
+    	    	break;
+    	    case 'c':
+    	    	commands = optarg;
+    	    	break;
+    	    case 'f':
+    	    	script = optarg;
+    	    	break;
+	    default:
+	    	usage(argv[0]);
+	    	return EXIT_FAILURE;
+	}
+    }
 
-    if (argc != 3) {
-    	fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+    if (argc - optind != 2 || (commands && script)) {
+    	usage(argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    // Open the script before the disk, so a bad path changes nothing
+    std::string text;
+    FILE *	stream = stdin;
+    if (commands) {
+    	text = commands;
+    	std::replace(text.begin(), text.end(), ';', '\n');
+    	stream = fmemopen(&text[0], text.size(), "r");
+    } else if (script && !streq(script, "-")) {
+    	stream = fopen(script, "r");
+    }
+    if (!stream) {
+    	fprintf(stderr, "Unable to open script %s: %s\n", script ? script : "-c", strerror(errno));
     	return EXIT_FAILURE;
     }
 
     try {
-    	disk.open(argv[1], atoi(argv[2]));
+    	disk.open(argv[optind], atoi(argv[optind + 1]), backend);
     } catch (std::runtime_error &e) {
-    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[1], e.what());
+    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[optind], e.what());
     	return EXIT_FAILURE;
     }
 
-    while (true) {
-	char line[BUFSIZ], cmd[BUFSIZ], arg1[BUFSIZ], arg2[BUFSIZ];
-
-    	fprintf(stderr, "sfs> ");
-    	fflush(stderr);
-
-    	if (fgets(line, BUFSIZ, stdin) == NULL) {
-    	    break;
-    	}
-
-    	int args = sscanf(line, "%s %s %s", cmd, arg1, arg2);
-    	if (args == 0) {
-    	    continue;
+    if (tracePath) {
+    	try {
+    	    trace.open(tracePath);
+	} catch (std::runtime_error &e) {
+	    fprintf(stderr, "Unable to open trace %s: %s\n", tracePath, e.what());
+	    return EXIT_FAILURE;
 	}
+	disk.set_trace(&trace);
+	fs.set_trace(&trace);
+    }
 
-	if (streq(cmd, "debug")) {
-	    do_debug(disk, fs, args, arg1, arg2);
-	} else if (streq(cmd, "format")) {
-	    do_format(disk, fs, args, arg1, arg2);
-	} else if (streq(cmd, "mount")) {
-	    do_mount(disk, fs, args, arg1, arg2);
-	} else if (streq(cmd, "cat")) {
-	    do_cat(disk, fs, args, arg1, arg2);
-	} else if (streq(cmd, "copyout")) {
-	    do_copyout(disk, fs, args, arg1, arg2);
-	} else if (streq(cmd, "create")) {
-	    do_create(disk, fs, args, arg1, arg2);
-	} else if (streq(cmd, "remove")) {
-	    do_remove(disk, fs, args, arg1, arg2);
-	} else if (streq(cmd, "stat")) {
-	    do_stat(disk, fs, args, arg1, arg2);
-	} else if (streq(cmd, "copyin")) {
-	    do_copyin(disk, fs, args, arg1, arg2);
-	} else if (streq(cmd, "help")) {
-	    do_help(disk, fs, args, arg1, arg2);
-	} else if (streq(cmd, "exit") || streq(cmd, "quit")) {
-	    break;
-	} else {
-	    printf("Unknown command: %s", line);
-	    printf("Type 'help' for a list of commands.\n");
-	}
+    Shell shell = {commands || script, stop, false, STATUS_OK};
+    run_stream(disk, fs, shell, stream);
+    if (stream != stdin) {
+    	fclose(stream);
+    }
+
+    if (!shell.Batch) {
+    	return EXIT_SUCCESS;
     }
 
-    return EXIT_SUCCESS;
+    // A batch leaves its metadata in the cache and writes it out once here,
+    // rather than once per command
+    if (disk.mounted()) {
+    	fs.sync();
+    	disk.flush();
+    }
+    return shell.Status;
 }
 
 // Command functions
 
-void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+int do_debug(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
     if (args != 1) {
     	printf("Usage: debug\n");
-    	return;
+    	return STATUS_USAGE;
     }
 
+    fs.sync();
     fs.debug(&disk);
+    return STATUS_OK;
 }
 
-void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-    	printf("Usage: format\n");
-    	return;
+int do_format(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
+    bool lazy  = false;
+    bool data  = false;
+    bool valid = args <= 3;
+    for (int i = 1; i < args && valid; i++) {
+    	const char *option = i == 1 ? arg1 : arg2;
+    	if (streq(option, "lazy") && !lazy) {
+    	    lazy = true;
+	} else if (streq(option, "datasums") && !data) {
+	    data = true;
+	} else {
+	    valid = false;
+	}
+    }
+    if (!valid) {
+    	printf("Usage: format [lazy] [datasums]\n");
+    	return STATUS_USAGE;
     }
 
-    if (fs.format(&disk)) {
+    if (fs.format(&disk, lazy, data)) {
     	printf("disk formatted.\n");
-    } else {
-    	printf("format failed!\n");
+    	return STATUS_OK;
     }
+
+    printf("format failed!\n");
+    return STATUS_FAILED;
 }
 
-void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+int do_mount(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
     if (args != 1) {
     	printf("Usage: mount\n");
-    	return;
+    	return STATUS_USAGE;
     }
 
     if (fs.mount(&disk)) {
     	printf("disk mounted.\n");
-    } else {
-    	printf("mount failed!\n");
+    	return STATUS_OK;
+    }
+
+    printf("mount failed!\n");
+    return STATUS_FAILED;
+}
+
+int do_unmount(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
+    if (args != 1) {
+    	printf("Usage: unmount\n");
+    	return STATUS_USAGE;
+    }
+
+    if (disk.mounted()) {
+    	fs.unmount();
+    	printf("disk unmounted.\n");
+    	return STATUS_OK;
+    }
+
+    printf("unmount failed!\n");
+    return STATUS_FAILED;
+}
+
+int do_commit(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
+    if (args != 1) {
+    	printf("Usage: commit\n");
+    	return STATUS_USAGE;
+    }
+
+    if (disk.mounted()) {
+    	fs.commit();
+    	printf("transaction committed.\n");
+    	return STATUS_OK;
     }
+
+    printf("commit failed!\n");
+    return STATUS_FAILED;
 }
 
-void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+int do_cat(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
     if (args != 2) {
-    	printf("Usage: cat <inode>\n");
-    	return;
+    	printf("Usage: cat <inode|path>\n");
+    	return STATUS_USAGE;
     }
 
-    if (!copyout(fs, atoi(arg1), "/dev/stdout")) {
+    ssize_t inumber = resolve(fs, arg1);
+    if (inumber < 0 || !copyout(fs, inumber, "/dev/stdout")) {
     	printf("cat failed!\n");
+    	return STATUS_FAILED;
     }
+    return STATUS_OK;
 }
 
-void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+int do_copyout(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
     if (args != 3) {
-    	printf("Usage: copyout <inode> <file>\n");
-    	return;
+    	printf("Usage: copyout <inode|path> <file>\n");
+    	return STATUS_USAGE;
     }
 
-    if (!copyout(fs, atoi(arg1), arg2)) {
+    ssize_t inumber = resolve(fs, arg1);
+    if (inumber < 0 || !copyout(fs, inumber, arg2)) {
     	printf("copyout failed!\n");
+    	return STATUS_FAILED;
     }
+    return STATUS_OK;
 }
 
-void do_create(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+int do_create(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
     if (args != 1) {
     	printf("Usage: create\n");
-    	return;
+    	return STATUS_USAGE;
     }
 
     ssize_t inumber = fs.create();
     if (inumber >= 0) {
     	printf("created inode %ld.\n", inumber);
-    } else {
-    	printf("create failed!\n");
+    	return STATUS_OK;
     }
+
+    printf("create failed!\n");
+    return STATUS_FAILED;
 }
 
-void do_remove(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+int do_compress(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
     if (args != 2) {
-    	printf("Usage: remove <inode>\n");
-    	return;
+    	printf("Usage: compress <inode|path>\n");
+    	return STATUS_USAGE;
     }
 
-    ssize_t inumber = atoi(arg1);
-    if (fs.remove(inumber)) {
-    	printf("removed inode %ld.\n", inumber);
+    ssize_t inumber = resolve(fs, arg1);
+    if (inumber >= 0 && fs.compress(inumber)) {
+    	printf("inode %ld is compressed.\n", inumber);
+    	return STATUS_OK;
+    }
+
+    printf("compress failed!\n");
+    return STATUS_FAILED;
+}
+
+int do_remove(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
+    if (args != 2) {
+    	printf("Usage: remove <inode|path>\n");
+    	return STATUS_USAGE;
+    }
+
+    // A path removes its name, and the inode along with its last name
+    ssize_t	inumber = resolve(fs, arg1);
+    std::string name;
+    bool	removed;
+    if (arg1[0] == '/') {
+    	ssize_t dir = split_path(fs, arg1, &name);
+    	removed = inumber >= 0 && dir >= 0 && fs.unlink(dir, name.c_str());
     } else {
-    	printf("remove failed!\n");
+    	removed = fs.remove(inumber);
     }
+    if (removed) {
+    	printf("removed inode %ld.\n", inumber);
+    	return STATUS_OK;
+    }
+
+    printf("remove failed!\n");
+    return STATUS_FAILED;
 }
 
-void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+int do_stat(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
     if (args != 2) {
-    	printf("Usage: stat <inode>\n");
-    	return;
+    	printf("Usage: stat <inode|path>\n");
+    	return STATUS_USAGE;
     }
 
-    ssize_t inumber = atoi(arg1);
+    ssize_t inumber = resolve(fs, arg1);
     ssize_t bytes   = fs.stat(inumber);
     if (bytes >= 0) {
     	printf("inode %ld has size %ld bytes.\n", inumber, bytes);
-    } else {
-    	printf("stat failed!\n");
+    	return STATUS_OK;
     }
+
+    printf("stat failed!\n");
+    return STATUS_FAILED;
 }
 
-void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+int do_copyin(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
     if (args != 3) {
-    	printf("Usage: copyin <inode> <file>\n");
-    	return;
+    	printf("Usage: copyin <file> <inode|path>\n");
+    	return STATUS_USAGE;
     }
 
-    if (!copyin(fs, arg1, atoi(arg2))) {
+    // Open the source first, so a missing one leaves no empty file behind
+    FILE *stream = fopen(arg1, "r");
+    if (stream == nullptr) {
+    	fprintf(stderr, "Unable to open %s: %s\n", arg1, strerror(errno));
     	printf("copyin failed!\n");
+    	return STATUS_FAILED;
     }
+
+    // Copying to a path that does not exist yet creates the file
+    ssize_t inumber = resolve(fs, arg2);
+    if (inumber < 0 && arg2[0] == '/') {
+    	std::string name;
+    	ssize_t	    dir = split_path(fs, arg2, &name);
+    	inumber = dir >= 0 ? fs.create() : -1;
+    	if (inumber >= 0 && !fs.link(dir, name.c_str(), inumber)) {
+    	    fs.remove(inumber);
+    	    inumber = -1;
+	}
+    }
+    bool copied = inumber >= 0 && copyin(fs, stream, inumber);
+    fclose(stream);
+    if (!copied) {
+    	printf("copyin failed!\n");
+    	return STATUS_FAILED;
+    }
+    return STATUS_OK;
+}
+
+int do_frag(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
+    if (args != 1) {
+    	printf("Usage: frag\n");
+    	return STATUS_USAGE;
+    }
+
+    if (!disk.mounted()) {
+    	printf("frag failed!\n");
+    	return STATUS_FAILED;
+    }
+
+    size_t files, blocks, extents;
+    double average = fs.fragmentation(&files, &blocks, &extents);
+    printf("%lu files, %lu blocks, %lu extents, %.2f blocks per extent\n", files, blocks, extents, average);
+    return STATUS_OK;
+}
+
+int do_fsck(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
+    if (args > 2 || (args == 2 && !streq(arg1, "repair"))) {
+    	printf("Usage: fsck [repair]\n");
+    	return STATUS_USAGE;
+    }
+
+    FileSystem::FsckReport report;
+    if (!fs.fsck(&disk, args == 2, &report)) {
+    	printf("fsck failed!\n");
+    	return STATUS_FAILED;
+    }
+
+    if (report.Replayed) {
+    	printf("%lu journal transactions replayed\n", report.Replayed);
+    }
+    printf("%lu files, %lu blocks in use\n", report.Files, report.Blocks);
+    printf("%lu out of range pointers\n", report.OutOfRange);
+    printf("%lu duplicate blocks\n", report.Duplicates);
+    printf("%lu blocks past end of file\n", report.PastEnd);
+    printf("%lu leaked blocks\n", report.Leaked);
+    printf("%lu unmarked blocks\n", report.Unmarked);
+    if (report.BadChecksums) {
+    	printf("%lu blocks failing their checksum\n", report.BadChecksums);
+    }
+    if (report.BadEntries) {
+    	printf("%lu bad directory entries\n", report.BadEntries);
+    }
+    if (report.LinkCounts) {
+    	printf("%lu wrong link counts\n", report.LinkCounts);
+    }
+    if (report.Cleared) {
+    	printf("%lu pointers cleared\n", report.Cleared);
+    }
+    if (!report.errors()) {
+    	printf("disk is clean.\n");
+    } else if (args == 2) {
+    	printf("disk repaired.\n");
+    } else {
+    	printf("disk has %lu errors.\n", report.errors());
+    	return STATUS_FAILED;
+    }
+    return STATUS_OK;
+}
+
+void print_op_stats(const char *name, const OpStats &stats) {
+    const Histogram &latency = stats.Latency;
+    printf("%-12s %8lu %12lu %10.1f %10.1f %10.1f\n", name, stats.Calls.load(), stats.Bytes.load(),
+    	latency.percentile(50)/1000.0, latency.percentile(99)/1000.0, latency.max()/1000.0);
+}
+
+int do_stats(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
+    if (args > 2 || (args == 2 && !streq(arg1, "reset"))) {
+    	printf("Usage: stats [reset]\n");
+    	return STATUS_USAGE;
+    }
+
+    if (args == 2) {
+    	fs.reset_stats();
+    	disk.reset_stats();
+    	printf("stats reset.\n");
+    	return STATUS_OK;
+    }
+
+    const FileSystem::Stats &stats = fs.stats();
+    printf("%-12s %8s %12s %10s %10s %10s\n", "operation", "calls", "bytes", "p50 us", "p99 us", "max us");
+    print_op_stats("mount",  stats.Mount);
+    print_op_stats("create", stats.Create);
+    print_op_stats("remove", stats.Remove);
+    print_op_stats("stat",   stats.Stat);
+    print_op_stats("read",   stats.Read);
+    print_op_stats("write",  stats.Write);
+    print_op_stats("compress", stats.Compress);
+    print_op_stats("lookup", stats.Lookup);
+    print_op_stats("link",   stats.Link);
+    print_op_stats("unlink", stats.Unlink);
+    print_op_stats("mkdir",  stats.Mkdir);
+    print_op_stats("disk read",  disk.stats().Read);
+    print_op_stats("disk write", disk.stats().Write);
+
+    const Histogram &search = stats.AllocSearch;
+    printf("%lu allocations, searched p50 %lu p99 %lu max %lu blocks\n", search.count(),
+    	search.percentile(50), search.percentile(99), search.max());
+
+    const Cache *cache = fs.block_cache();
+    if (cache) {
+    	printf("%lu cache hits, %lu misses, %lu evictions, %lu readahead hits, %lu readahead wasted\n",
+    	    cache->hits(), cache->misses(), cache->evictions(), cache->readahead_hits(), cache->readahead_wasted());
+    }
+
+    const Journal *journal = fs.metadata_journal();
+    if (journal) {
+    	printf("%lu journal commits, %lu blocks logged, %lu checkpoints\n",
+    	    journal->commits(), journal->logged_blocks(), journal->checkpoints());
+    }
+
+    const Checksums *checksums = fs.checksum_table();
+    if (checksums) {
+    	printf("%lu blocks verified, %lu checksum mismatches, %lu checksums updated\n",
+    	    checksums->verified(), checksums->mismatches(), checksums->updated());
+    }
+    return STATUS_OK;
 }
 
-void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+int do_mkdir(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
+    if (args != 2 || arg1[0] != '/') {
+    	printf("Usage: mkdir <path>\n");
+    	return STATUS_USAGE;
+    }
+
+    std::string name;
+    ssize_t	dir	= split_path(fs, arg1, &name);
+    ssize_t	inumber = dir >= 0 ? fs.mkdir(dir, name.c_str()) : -1;
+    if (inumber >= 0) {
+    	printf("created directory inode %ld.\n", inumber);
+    	return STATUS_OK;
+    }
+
+    printf("mkdir failed!\n");
+    return STATUS_FAILED;
+}
+
+int do_ls(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
+    if (args > 2) {
+    	printf("Usage: ls [inode|path]\n");
+    	return STATUS_USAGE;
+    }
+
+    std::vector<FileSystem::Link> links;
+    ssize_t dir = resolve(fs, args == 2 ? arg1 : "/");
+    if (dir < 0 || !fs.readdir(dir, &links)) {
+    	printf("ls failed!\n");
+    	return STATUS_FAILED;
+    }
+
+    std::sort(links.begin(), links.end(), [](const FileSystem::Link &a, const FileSystem::Link &b) {
+    	return a.Name < b.Name;
+    });
+    for (auto &link : links) {
+    	printf("%6lu %s%s\n", link.Inumber, link.Name.c_str(), fs.is_directory(link.Inumber) ? "/" : "");
+    }
+    return STATUS_OK;
+}
+
+int do_lookup(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
+    if (args != 2 || arg1[0] != '/') {
+    	printf("Usage: lookup <path>\n");
+    	return STATUS_USAGE;
+    }
+
+    ssize_t inumber = resolve(fs, arg1);
+    if (inumber >= 0) {
+    	printf("%s is inode %ld.\n", arg1, inumber);
+    	return STATUS_OK;
+    }
+
+    printf("lookup failed!\n");
+    return STATUS_FAILED;
+}
+
+int do_link(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
+    if (args != 3 || arg2[0] != '/') {
+    	printf("Usage: link <inode|path> <path>\n");
+    	return STATUS_USAGE;
+    }
+
+    std::string name;
+    ssize_t	inumber = resolve(fs, arg1);
+    ssize_t	dir	= split_path(fs, arg2, &name);
+    if (inumber >= 0 && dir >= 0 && fs.link(dir, name.c_str(), inumber)) {
+    	printf("linked inode %ld.\n", inumber);
+    	return STATUS_OK;
+    }
+
+    printf("link failed!\n");
+    return STATUS_FAILED;
+}
+
+int do_unlink(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
+    if (args != 2 || arg1[0] != '/') {
+    	printf("Usage: unlink <path>\n");
+    	return STATUS_USAGE;
+    }
+
+    std::string name;
+    ssize_t	dir = split_path(fs, arg1, &name);
+    if (dir >= 0 && fs.unlink(dir, name.c_str())) {
+    	printf("unlinked %s.\n", arg1);
+    	return STATUS_OK;
+    }
+
+    printf("unlink failed!\n");
+    return STATUS_FAILED;
+}
+
+int do_help(Disk &disk, FileSystem &fs, int args, const char *arg1, const char *arg2) {
     printf("Commands are:\n");
-    printf("    format\n");
+    printf("    format  [lazy] [datasums]\n");
     printf("    mount\n");
+    printf("    unmount\n");
+    printf("    commit\n");
     printf("    debug\n");
     printf("    create\n");
-    printf("    remove  <inode>\n");
-    printf("    cat     <inode>\n");
-    printf("    stat    <inode>\n");
-    printf("    copyin  <file> <inode>\n");
-    printf("    copyout <inode> <file>\n");
+    printf("    compress <inode|path>\n");
+    printf("    remove  <inode|path>\n");
+    printf("    cat     <inode|path>\n");
+    printf("    stat    <inode|path>\n");
+    printf("    copyin  <file> <inode|path>\n");
+    printf("    copyout <inode|path> <file>\n");
+    printf("    mkdir   <path>\n");
+    printf("    ls      [inode|path]\n");
+    printf("    lookup  <path>\n");
+    printf("    link    <inode|path> <path>\n");
+    printf("    unlink  <path>\n");
+    printf("    frag\n");
+    printf("    fsck    [repair]\n");
+    printf("    stats   [reset]\n");
     printf("    help\n");
     printf("    quit\n");
     printf("    exit\n");
+    return STATUS_OK;
 }
 
 bool copyout(FileSystem &fs, size_t inumber, const char *path) {
@@ -247,15 +760,10 @@ bool copyout(FileSystem &fs, size_t inumber, const char *path) {
     return true;
 }
 
-bool copyin(FileSystem &fs, const char *path, size_t inumber) {
-    FILE *stream = fopen(path, "r");
-    if (stream == nullptr) {
-    	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
-    	return false;
-    }
-
+bool copyin(FileSystem &fs, FILE *stream, size_t inumber) {
     char buffer[4*BUFSIZ] = {0};
-    size_t offset = 0;
+    size_t offset   = 0;
+    bool   complete = true;
     while (true) {
     	ssize_t result = fread(buffer, 1, sizeof(buffer), stream);
     	if (result <= 0) {
@@ -265,16 +773,53 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber) {
 	ssize_t actual = fs.write(inumber, buffer, result, offset);
 	if (actual < 0) {
 	    fprintf(stderr, "fs.write returned invalid result %ld\n", actual);
+	    complete = false;
 	    break;
 	}
 	offset += actual;
 	if (actual != result) {
 	    fprintf(stderr, "fs.write only wrote %ld bytes, not %ld bytes\n", actual, result);
+	    complete = false;
 	    break;
 	}
     }
 
     printf("%lu bytes copied\n", offset);
-    fclose(stream);
-    return true;
+    return complete;
+}
+
+// Return inode named by argument: an inode number, or a path from the root
+// (-1 if it does not exist)
+ssize_t resolve(FileSystem &fs, const char *arg) {
+    if (arg[0] != '/') {
+    	return atoi(arg);
+    }
+
+    ssize_t		inumber = fs.root();
+    std::istringstream	stream(arg);
+    std::string		name;
+    while (inumber >= 0 && std::getline(stream, name, '/')) {
+    	if (!name.empty()) {
+    	    inumber = fs.lookup(inumber, name.c_str());
+	}
+    }
+    return inumber;
+}
+
+// Return directory holding last name of path, making the root directory if
+// there is none yet (-1 if the directory does not exist)
+ssize_t split_path(FileSystem &fs, const char *path, std::string *name) {
+    std::string full(path);
+    while (full.size() > 1 && full.back() == '/') {
+    	full.pop_back();
+    }
+
+    size_t slash = full.rfind('/');
+    if (slash == std::string::npos || slash + 1 == full.size()) {
+    	return -1;
+    }
+    *name = full.substr(slash + 1);
+
+    std::string parent = full.substr(0, slash);
+    return parent.empty() ? fs.root(true) : resolve(fs, parent.c_str());
 }
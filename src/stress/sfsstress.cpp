@@ -0,0 +1,204 @@
+// sfsstress.cpp: Multi-threaded file system stress test
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Constants
+
+const size_t FILES_PER_THREAD = 4;		    // Files each worker owns
+const size_t MAX_FILE_SIZE    = 64*Disk::BLOCK_SIZE; // Largest offset written
+const size_t MAX_IO_SIZE      = 3*Disk::BLOCK_SIZE;  // Largest single read or write
+const size_t SHARED_SIZE      = 40*Disk::BLOCK_SIZE; // Size of file read by every worker
+
+// Expected contents of a file
+
+struct Model {
+    ssize_t	      Inumber;	// Inode holding file
+    std::vector<char> Data;	// Bytes the file should contain
+};
+
+// Globals
+
+std::atomic<size_t> Operations(0);
+std::atomic<size_t> Errors(0);
+
+// Functions
+
+char pattern(size_t seed, size_t position) {
+    return (char)((seed*131 + position*7 + position/Disk::BLOCK_SIZE) & 0xff);
+}
+
+void fail(const char *message, ssize_t inumber, size_t offset) {
+    fprintf(stderr, "%s (inode %ld, offset %lu)\n", message, inumber, offset);
+    Errors++;
+}
+
+bool verify(FileSystem &fs, const Model &model, size_t offset, size_t length) {
+    if (length == 0) {
+    	return true;
+    }
+
+    std::vector<char> buffer(length);
+    ssize_t result = fs.read(model.Inumber, buffer.data(), length, offset);
+    if (result != (ssize_t)length) {
+    	fail("short read", model.Inumber, offset);
+    	return false;
+    }
+    if (memcmp(buffer.data(), model.Data.data() + offset, length) != 0) {
+    	fail("data mismatch", model.Inumber, offset);
+    	return false;
+    }
+    return true;
+}
+
+void worker(FileSystem &fs, const Model &shared, std::vector<Model> &files, size_t id, size_t rounds) {
+    std::mt19937 random(id);
+
+    files.resize(FILES_PER_THREAD);
+    for (auto &file : files) {
+    	file.Inumber = fs.create();
+    	if (file.Inumber < 0) {
+    	    fail("create failed", -1, 0);
+    	    return;
+	}
+    }
+
+    std::vector<char> buffer(MAX_IO_SIZE);
+    for (size_t round = 0; round < rounds; round++) {
+    	Model &file = files[random() % files.size()];
+    	switch (random() % 8) {
+    	    case 0: case 1: case 2: {	    // Write random range of own file
+    	    	size_t offset = random() % MAX_FILE_SIZE;
+    	    	size_t length = 1 + random() % MAX_IO_SIZE;
+    	    	size_t seed   = id*rounds + round;
+    	    	for (size_t i = 0; i < length; i++) {
+    	    	    buffer[i] = pattern(seed, offset + i);
+		}
+
+		ssize_t result = fs.write(file.Inumber, buffer.data(), length, offset);
+		if (result < 0) {
+		    fail("write failed", file.Inumber, offset);
+		    break;
+		}
+		if (file.Data.size() < offset + result) {
+		    file.Data.resize(offset + result, 0);
+		}
+		memcpy(file.Data.data() + offset, buffer.data(), result);
+		break;
+	    }
+	    case 3: case 4: {		    // Read back random range of own file
+	    	if (file.Data.empty()) {
+	    	    break;
+		}
+		size_t offset = random() % file.Data.size();
+		size_t length = std::min(1 + random() % MAX_IO_SIZE, file.Data.size() - offset);
+		verify(fs, file, offset, length);
+		break;
+	    }
+	    case 5: case 6: {		    // Read random range of shared file
+		size_t offset = random() % shared.Data.size();
+		size_t length = std::min(1 + random() % MAX_IO_SIZE, shared.Data.size() - offset);
+		verify(fs, shared, offset, length);
+		break;
+	    }
+	    case 7: {			    // Replace own file with a new one
+	    	if (!fs.remove(file.Inumber)) {
+	    	    fail("remove failed", file.Inumber, 0);
+		}
+		file.Inumber = fs.create();
+		file.Data.clear();
+		if (file.Inumber < 0) {
+		    fail("create failed", -1, 0);
+		    return;
+		}
+		break;
+	    }
+	}
+	Operations++;
+    }
+
+    // Check whole files while other workers are still running
+    for (auto &file : files) {
+    	if ((size_t)fs.stat(file.Inumber) != file.Data.size()) {
+    	    fail("size mismatch", file.Inumber, 0);
+	}
+	verify(fs, file, 0, file.Data.size());
+    }
+}
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+    if (argc != 5) {
+    	fprintf(stderr, "Usage: %s <diskfile> <nblocks> <threads> <rounds>\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    size_t nthreads = strtoul(argv[3], NULL, 10);
+    size_t rounds   = strtoul(argv[4], NULL, 10);
+
+    Disk disk;
+    try {
+    	disk.open(argv[1], strtoul(argv[2], NULL, 10));
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[1], e.what());
+    	return EXIT_FAILURE;
+    }
+
+    FileSystem fs;
+    if (!FileSystem::format(&disk) || !fs.mount(&disk)) {
+    	fprintf(stderr, "Unable to format and mount %s\n", argv[1]);
+    	return EXIT_FAILURE;
+    }
+
+    // Shared file is written up front and only read by workers
+    Model shared;
+    shared.Inumber = fs.create();
+    shared.Data.resize(SHARED_SIZE);
+    for (size_t i = 0; i < SHARED_SIZE; i++) {
+    	shared.Data[i] = pattern(0, i);
+    }
+    if (fs.write(shared.Inumber, shared.Data.data(), SHARED_SIZE, 0) != (ssize_t)SHARED_SIZE) {
+    	fail("shared write failed", shared.Inumber, 0);
+    }
+
+    std::vector<std::vector<Model>> models(nthreads);
+    std::vector<std::thread> threads;
+    for (size_t id = 0; id < nthreads; id++) {
+    	threads.emplace_back(worker, std::ref(fs), std::cref(shared), std::ref(models[id]), id + 1, rounds);
+    }
+    for (auto &thread : threads) {
+    	thread.join();
+    }
+
+    // Files must also survive a remount from the saved bitmap
+    fs.unmount();
+    if (!fs.mount(&disk)) {
+    	fail("remount failed", -1, 0);
+    } else {
+    	verify(fs, shared, 0, SHARED_SIZE);
+    	for (auto &files : models) {
+    	    for (auto &file : files) {
+    	    	if (file.Inumber >= 0) {
+    	    	    verify(fs, file, 0, file.Data.size());
+		}
+	    }
+	}
+    	fs.unmount();
+    }
+
+    printf("%lu threads, %lu operations, %lu errors\n", nthreads, Operations.load(), Errors.load());
+    return Errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,95 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: batch mode runs -c commands and -f scripts without prompting, and
+# exits with the worst status of any command
+
+batch-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+8893 bytes copied
+inode 0 has size 8893 bytes.
+3 cache hits
+4 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+5 disk block reads
+210 disk block writes
+EOF2
+}
+
+fsck-output() {
+    cat <<EOF2
+101 files, 303 blocks in use
+0 out of range pointers
+0 duplicate blocks
+0 blocks past end of file
+0 leaked blocks
+0 unmarked blocks
+disk is clean.
+disk mounted.
+inode 100 has size 8893 bytes.
+0 cache hits
+1 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+0 journal commits
+0 journal blocks
+14 disk block reads
+4 disk block writes
+EOF2
+}
+
+seq 1 2000 > $SCRATCH/small.txt
+
+echo -n "Testing batch -c on $SCRATCH/image.200 ... "
+if ./bin/sfssh -c "format; mount; create; copyin $SCRATCH/small.txt 0; stat 0" $SCRATCH/image.200 200 > $SCRATCH/test.out 2> $SCRATCH/test.err &&
+    diff -u $SCRATCH/test.out <(batch-output) > $SCRATCH/test.log && ! [ -s $SCRATCH/test.err ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log $SCRATCH/test.err
+fi
+
+echo -n "Testing batch -f bulk load on $SCRATCH/image.1000 ... "
+(
+    echo "# bulk load 101 files"
+    echo format
+    echo mount
+    for i in $(seq 0 100); do
+	echo create
+	echo copyin $SCRATCH/small.txt $i
+    done
+) > $SCRATCH/load.sfs
+if ./bin/sfssh -f $SCRATCH/load.sfs $SCRATCH/image.1000 1000 > /dev/null 2> $SCRATCH/test.err &&
+    ./bin/sfssh -c "fsck; mount; stat 100" $SCRATCH/image.1000 1000 2> /dev/null | diff -u - <(fsck-output) > $SCRATCH/test.log &&
+    ! [ -s $SCRATCH/test.err ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log $SCRATCH/test.err
+fi
+
+echo -n "Testing batch -f - exit statuses on $SCRATCH/image.200 ... "
+printf "mount\nstat 0\nstat 9\n" | ./bin/sfssh -f - $SCRATCH/image.200 200 > /dev/null 2> $SCRATCH/failed.err
+FAILED=$?
+printf "mount\nbogus\nstat 0\n" | ./bin/sfssh -f - $SCRATCH/image.200 200 > /dev/null 2> $SCRATCH/usage.err
+USAGE=$?
+./bin/sfssh -e -c "mount; stat 0; stat 7; debug" $SCRATCH/image.200 200 > $SCRATCH/stop.out 2> $SCRATCH/stop.err
+STOP=$?
+if [ $FAILED -eq 1 ] && [ "$(cat $SCRATCH/failed.err)" = "line 3: stat: failed" ] &&
+   [ $USAGE -eq 2 ] && [ "$(cat $SCRATCH/usage.err)" = "line 2: bogus: usage" ] &&
+   [ $STOP -eq 1 ] && [ "$(cat $SCRATCH/stop.err)" = "line 3: stat: failed" ] &&
+   ! grep -q SuperBlock $SCRATCH/stop.out; then
+    echo "Success"
+else
+    echo "Failure"
+    echo "failed $FAILED, usage $USAGE, stop $STOP"
+    cat $SCRATCH/failed.err $SCRATCH/usage.err $SCRATCH/stop.err
+fi
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: quick benchmark pass runs every benchmark and reports it as JSON
+
+BENCHMARKS="create stat remove write_seq_4k read_seq_4k write_rand_4k read_rand_4k
+write_seq_64k read_seq_64k write_rand_64k read_rand_64k write_seq_1024k read_seq_1024k
+write_tiny read_tiny alloc_fragmented link lookup unlink create_small
+write_text_plain read_text_plain read_rand_text_plain write_text_lz read_text_lz read_rand_text_lz
+write_sums_meta read_sums_meta read_rand_sums_meta write_sums_data read_sums_data read_rand_sums_data crc32c_4k
+mount_clean_1024 mount_scan_1024 mount_clean_4096 mount_scan_4096"
+
+echo -n "Testing bench on $SCRATCH ... "
+status=0
+./bin/sfsbench -q $SCRATCH > $SCRATCH/bench.json 2> $SCRATCH/test.log || status=1
+grep -q '"errors": 0,' $SCRATCH/bench.json || status=1
+for name in $BENCHMARKS; do
+    grep -q "{\"name\": \"$name\", \"ops\": [1-9]" $SCRATCH/bench.json || status=1
+done
+if [ $(ls $SCRATCH | grep -c '\.img$') -ne 0 ]; then
+    status=1
+fi
+
+if [ $status -eq 0 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log $SCRATCH/bench.json
+fi
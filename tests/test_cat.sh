@@ -10,8 +10,13 @@ image-5-output() {
 
 
 
+0 cache evictions
 0 disk block writes
-5 disk block reads
+0 readahead hits
+0 readahead wasted
+1 cache hits
+2 cache misses
+4 disk block reads
 965 bytes copied
 All mimsy were the borogoves,
 All mimsy were the borogoves,
@@ -218,9 +223,14 @@ image-20-output() {
 
 
 0 bytes copied
+0 cache evictions
 0 disk block writes
-21 disk block reads
+0 readahead hits
+0 readahead wasted
+12 cache misses
+16 disk block reads
 27160 bytes copied
+4 cache hits
 9546 bytes copied
    Abraham Clark
 Abr Baldwin
@@ -0,0 +1,80 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: with data checksums, a file reads back intact until one of its blocks
+# is corrupted behind the file system's back, then the read fails and fsck
+# finds the block, while a crash in the middle of an overwrite is no error
+
+seq 1 3000 > $SCRATCH/small.txt
+
+echo -n "Testing checksums on $SCRATCH/image.200 ... "
+
+./bin/sfssh -c "format datasums; mount; create; copyin $SCRATCH/small.txt 0" $SCRATCH/image.200 200 > /dev/null 2>&1
+./bin/sfssh -c "mount; copyout 0 $SCRATCH/small.out" $SCRATCH/image.200 200 > /dev/null 2>&1
+
+# Flip a byte in the second block of the file (blocks 24 to 27)
+printf 'X' | dd of=$SCRATCH/image.200 bs=1 seek=$((25*4096 + 10)) conv=notrunc 2> /dev/null
+
+if cmp -s $SCRATCH/small.txt $SCRATCH/small.out &&
+   ./bin/sfssh -c "mount; copyout 0 $SCRATCH/bad.out" $SCRATCH/image.200 200 2> /dev/null |
+    grep -q '^copyout failed: Checksum mismatch in block 25$'; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+
+echo -n "Testing fsck of data checksums on $SCRATCH/image.200 ... "
+if ./bin/sfssh -c "fsck" $SCRATCH/image.200 200 2> /dev/null | grep -q '^1 blocks failing their checksum$' &&
+   ./bin/sfssh -c "fsck repair" $SCRATCH/image.200 200 2> /dev/null | grep -q '^disk repaired.$' &&
+   ./bin/sfssh -c "fsck" $SCRATCH/image.200 200 2> /dev/null | grep -q '^disk is clean.$' &&
+   ./bin/sfssh -c "mount; copyout 0 $SCRATCH/bad.out" $SCRATCH/image.200 200 2> /dev/null | grep -q '^13893 bytes copied$'; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+
+# Overwrite a committed file in place and kill the shell before the next
+# commit: its blocks went home without their new checksums, and must read
+# back as they are rather than fail the old ones
+seq 1 200000 > $SCRATCH/old.txt
+seq 1 200000 | rev > $SCRATCH/new.txt
+
+echo -n "Testing data checksums after a crash on $SCRATCH/image.2000 ... "
+mkfifo $SCRATCH/commands
+stdbuf -oL ./bin/sfssh $SCRATCH/image.2000 2000 < $SCRATCH/commands > $SCRATCH/crash.out 2> /dev/null &
+SHELL_PID=$!
+exec 3> $SCRATCH/commands
+printf "format datasums\nmount\ncreate\ncopyin $SCRATCH/old.txt 0\ncommit\ncopyin $SCRATCH/new.txt 0\nstat 0\n" >&3
+for i in $(seq 1 100); do
+    grep -q 'inode 0 has size' $SCRATCH/crash.out && break
+    sleep 0.1
+done
+{ kill -9 $SHELL_PID; wait $SHELL_PID; } 2> /dev/null
+exec 3>&-
+
+if ./bin/sfssh -c "fsck" $SCRATCH/image.2000 2000 2> /dev/null | grep -q '^disk is clean.$' &&
+   ./bin/sfssh -c "mount; copyout 0 $SCRATCH/crash.txt" $SCRATCH/image.2000 2000 2> /dev/null | grep -q '^1288895 bytes copied$' &&
+   ./bin/sfssh -c "fsck" $SCRATCH/image.2000 2000 2> /dev/null | grep -q '^disk is clean.$'; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+
+# Corrupt an inode block and the bitmap, so mount has to rebuild the bitmap
+# from inodes it cannot trust: it must refuse rather than take the blocks of
+# the bad inode block for free ones
+echo -n "Testing checksums of scanned inodes on $SCRATCH/image.200 ... "
+./bin/sfssh -c "format; mount; create; copyin $SCRATCH/small.txt 0" $SCRATCH/image.200 200 > /dev/null 2>&1
+printf 'X' | dd of=$SCRATCH/image.200 bs=1 seek=$((2*4096 - 1)) conv=notrunc 2> /dev/null
+printf 'X' | dd of=$SCRATCH/image.200 bs=1 seek=$((22*4096 - 1)) conv=notrunc 2> /dev/null
+
+if ./bin/sfssh -c "mount" $SCRATCH/image.200 200 2> /dev/null | grep -q '^mount failed!$' &&
+   ./bin/sfssh -c "fsck" $SCRATCH/image.200 200 2> /dev/null | grep -q '^2 blocks failing their checksum$' &&
+   ./bin/sfssh -c "fsck repair" $SCRATCH/image.200 200 2> /dev/null | grep -q '^disk repaired.$' &&
+   ./bin/sfssh -c "mount; copyout 0 $SCRATCH/bad.out" $SCRATCH/image.200 200 2> /dev/null | grep -q '^13893 bytes copied$'; then
+    echo "Success"
+else
+    echo "Failure"
+fi
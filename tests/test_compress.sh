@@ -0,0 +1,122 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: compressed files read back what was written, also after a partial
+# overwrite and a remount, and use fewer blocks than plain ones
+
+compress-input() {
+    cat <<EOF2
+format
+mount
+create
+compress 0
+copyin $SCRATCH/large.txt 0
+copyin $SCRATCH/small.txt 0
+create
+copyin $SCRATCH/large.txt 1
+compress 1
+unmount
+mount
+stat 0
+copyout 0 $SCRATCH/large.out
+copyout 1 $SCRATCH/plain.out
+debug
+EOF2
+}
+
+compress-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+inode 0 is compressed.
+144000 bytes copied
+8893 bytes copied
+created inode 1.
+144000 bytes copied
+compress failed!
+42 cache hits
+7 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+disk unmounted.
+disk mounted.
+inode 0 has size 144000 bytes.
+144000 bytes copied
+144000 bytes copied
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    2 checksum blocks
+Inode 0:
+    size: 144000 bytes
+    compressed clusters
+    direct blocks: 24 34
+    indirect block: 25
+    indirect data blocks: 26 27 28 29 30 31 32 33
+Inode 1:
+    size: 144000 bytes
+    direct blocks: 35 36 37 38
+    indirect block: 39
+    indirect data blocks: 40 41 42 43 44 45 46 47 48 49 50 51 52 53 54 55 56 57 58 59 60 61 62 63 64 65 66 67 68 69 70 71
+55 cache hits
+15 cache misses
+0 cache evictions
+35 readahead hits
+0 readahead wasted
+63 disk block reads
+259 disk block writes
+EOF2
+}
+
+seq 1 2000 > $SCRATCH/small.txt
+yes 'a line of text that compresses well' | head -n 4000 > $SCRATCH/large.txt
+cp $SCRATCH/large.txt $SCRATCH/expected.txt
+dd if=$SCRATCH/small.txt of=$SCRATCH/expected.txt conv=notrunc 2> /dev/null
+
+echo -n "Testing compressed files on $SCRATCH/image.200 ... "
+if diff -u <(compress-input | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null) <(compress-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/expected.txt $SCRATCH/large.out && cmp -s $SCRATCH/large.txt $SCRATCH/plain.out &&
+   ./bin/sfssh -c fsck $SCRATCH/image.200 200 2> /dev/null | grep -q '^disk is clean.$'; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: a compressed file that does not compress stores its tail cluster in
+# the blocks its bytes need
+
+raw-input() {
+    cat <<EOF2
+format
+mount
+create
+compress 0
+copyin $SCRATCH/random.5000 0
+create
+compress 1
+copyin $SCRATCH/random.20000 1
+unmount
+EOF2
+}
+
+head -c 5000 /dev/urandom > $SCRATCH/random.5000
+head -c 20000 /dev/urandom > $SCRATCH/random.20000
+
+echo -n "Testing incompressible files on $SCRATCH/image.raw ... "
+if raw-input | ./bin/sfssh $SCRATCH/image.raw 200 > /dev/null 2>&1 &&
+   ./bin/sfssh -c "mount; copyout 0 $SCRATCH/random.5000.out; copyout 1 $SCRATCH/random.20000.out" $SCRATCH/image.raw 200 > /dev/null 2>&1 &&
+   cmp -s $SCRATCH/random.5000 $SCRATCH/random.5000.out && cmp -s $SCRATCH/random.20000 $SCRATCH/random.20000.out &&
+   ./bin/sfssh -c fsck $SCRATCH/image.raw 200 2> /dev/null > $SCRATCH/test.log &&
+   grep -q '^2 files, 8 blocks in use$' $SCRATCH/test.log && grep -q '^disk is clean.$' $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -537,8 +537,13 @@ Inode 126:
 Inode 127:
     size: 0 bytes
     direct blocks:
-261 disk block reads
-127 disk block writes
+126 cache hits
+1 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+7 disk block reads
+1 disk block writes
 EOF
 }
 
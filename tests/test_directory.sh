@@ -0,0 +1,124 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: paths name inodes through directories, and a directory large enough
+# to split its buckets many times still finds every name
+
+directory-input() {
+    cat <<EOF2
+format
+mount
+ls
+mkdir /etc
+mkdir /etc
+copyin $SCRATCH/small.txt /etc/conf
+ls
+ls /etc
+lookup /etc/conf
+stat /etc/conf
+link /etc/conf /alias
+unlink /etc/conf
+lookup /etc/conf
+copyout /alias $SCRATCH/alias.txt
+unlink /etc/missing
+remove /etc
+ls
+remove /alias
+stat 2
+EOF2
+}
+
+directory-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+ls failed!
+created directory inode 1.
+mkdir failed!
+8893 bytes copied
+     1 etc/
+     2 conf
+/etc/conf is inode 2.
+inode 2 has size 8893 bytes.
+linked inode 2.
+unlinked /etc/conf.
+lookup failed!
+8893 bytes copied
+unlink failed!
+removed inode 1.
+     2 alias
+removed inode 2.
+stat failed!
+188 cache hits
+12 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+7 disk block reads
+217 disk block writes
+EOF2
+}
+
+seq 1 2000 > $SCRATCH/small.txt
+
+echo -n "Testing directory paths on $SCRATCH/image.200 ... "
+if diff -u <(directory-input | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null) <(directory-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/small.txt $SCRATCH/alias.txt; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+echo -n "Testing directory of 3000 names on $SCRATCH/image.1000 ... "
+(
+    echo format
+    echo mount
+    echo mkdir /big
+    for i in $(seq 1 3000); do
+	echo copyin /dev/null /big/name.$i
+    done
+    for i in $(seq 1 2 3000); do
+	echo unlink /big/name.$i
+    done
+) > $SCRATCH/load.sfs
+if ./bin/sfssh -f $SCRATCH/load.sfs $SCRATCH/image.1000 1000 > /dev/null &&
+   [ "$(./bin/sfssh -c "mount; ls /big" $SCRATCH/image.1000 1000 2> /dev/null | grep -c ' name\.')" = 1500 ] &&
+   ./bin/sfssh -c "mount; lookup /big/name.3000; lookup /big/name.2999" $SCRATCH/image.1000 1000 2> /dev/null | grep -q '^/big/name.3000 is inode' &&
+   ./bin/sfssh -c "fsck" $SCRATCH/image.1000 1000 2> /dev/null | grep -q '^disk is clean.$'; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+
+echo -n "Testing remove of named inodes on $SCRATCH/image.200 ... "
+if ./bin/sfssh -c "format; mount; mkdir /d; copyin $SCRATCH/small.txt /d/f; remove 2; remove 1; create; ls /d; stat /d/f" $SCRATCH/image.200 200 2> /dev/null |
+    sed -n '5,9p' | diff -u - <(printf 'remove failed!\nremove failed!\ncreated inode 3.\n     2 f\ninode 2 has size 8893 bytes.\n') > $SCRATCH/test.log &&
+   ./bin/sfssh -c "fsck" $SCRATCH/image.200 200 2> /dev/null | grep -q '^disk is clean.$'; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+echo -n "Testing link of a directory on $SCRATCH/image.200 ... "
+if ./bin/sfssh -c "format; mount; mkdir /d; link /d /d/self; link 1 /other; ls /d; ls" $SCRATCH/image.200 200 2> /dev/null |
+    sed -n '4,6p' | diff -u - <(printf 'link failed!\nlink failed!\n     1 d/\n') > $SCRATCH/test.log &&
+   ./bin/sfssh -c "fsck" $SCRATCH/image.200 200 2> /dev/null | grep -q '^disk is clean.$'; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+echo -n "Testing copyin of a missing file on $SCRATCH/image.200 ... "
+if ./bin/sfssh -c "format; mount; mkdir /d; copyin $SCRATCH/missing.txt /d/f; ls /d; stat /d/f; create" $SCRATCH/image.200 200 2> /dev/null |
+    sed -n '4,6p' | diff -u - <(printf 'copyin failed!\nstat failed!\ncreated inode 2.\n') > $SCRATCH/test.log &&
+   ./bin/sfssh -c "fsck" $SCRATCH/image.200 200 2> /dev/null | grep -q '^disk is clean.$'; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
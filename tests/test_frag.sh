@@ -0,0 +1,77 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: file written after a remove goes to one free run instead of filling
+# the hole left behind
+
+frag-input() {
+    cat <<EOF
+format
+mount
+create
+create
+create
+copyin $SCRATCH/small.txt 0
+copyin $SCRATCH/small.txt 1
+copyin $SCRATCH/small.txt 2
+remove 1
+create
+copyin $SCRATCH/large.txt 1
+frag
+debug
+EOF
+}
+
+frag-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+created inode 1.
+created inode 2.
+8893 bytes copied
+8893 bytes copied
+8893 bytes copied
+removed inode 1.
+created inode 1.
+38893 bytes copied
+3 files, 16 blocks, 4 extents, 4.00 blocks per extent
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    2 checksum blocks
+Inode 0:
+    size: 8893 bytes
+    direct blocks: 24 25 26
+Inode 1:
+    size: 38893 bytes
+    direct blocks: 33 34 35 36
+    indirect block: 37
+    indirect data blocks: 38 39 40 41 42 43
+Inode 2:
+    size: 8893 bytes
+    direct blocks: 30 31 32
+19 cache hits
+8 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+8 disk block reads
+227 disk block writes
+EOF
+}
+
+seq 1 2000 > $SCRATCH/small.txt
+seq 1 8000 > $SCRATCH/large.txt
+
+echo -n "Testing frag on $SCRATCH/image.200 ... "
+if diff -u <(frag-input | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null) <(frag-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,178 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: fsck finds bad pointers in inodes and repair clears them
+
+pointers-input() {
+    cat <<EOF
+mount
+fsck
+unmount
+fsck
+fsck repair
+fsck
+mount
+debug
+EOF
+}
+
+pointers-output() {
+    cat <<EOF
+disk mounted.
+fsck failed!
+0 cache hits
+0 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+disk unmounted.
+2 files, 11 blocks in use
+1 out of range pointers
+1 duplicate blocks
+1 blocks past end of file
+0 leaked blocks
+0 unmarked blocks
+disk has 3 errors.
+2 files, 11 blocks in use
+1 out of range pointers
+1 duplicate blocks
+1 blocks past end of file
+0 leaked blocks
+0 unmarked blocks
+2 pointers cleared
+disk repaired.
+2 files, 11 blocks in use
+0 out of range pointers
+0 duplicate blocks
+0 blocks past end of file
+0 leaked blocks
+0 unmarked blocks
+disk is clean.
+disk mounted.
+SuperBlock:
+    magic number is valid
+    20 blocks
+    2 inode blocks
+    256 inodes
+Inode 2:
+    size: 27160 bytes
+    direct blocks: 4 5 6 7 8
+    indirect block: 9
+    indirect data blocks: 13 14
+Inode 3:
+    size: 9546 bytes
+    direct blocks: 10 11 12
+0 cache hits
+0 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+27 disk block reads
+1 disk block writes
+EOF
+}
+
+# Test: fsck finds blocks the saved bitmap marks used but no file references
+# (the bitmap block then fails its checksum too)
+
+bitmap-input() {
+    cat <<EOF
+fsck
+fsck repair
+fsck
+EOF
+}
+
+bitmap-output() {
+    cat <<EOF
+1 files, 3 blocks in use
+0 out of range pointers
+0 duplicate blocks
+0 blocks past end of file
+1 leaked blocks
+0 unmarked blocks
+1 blocks failing their checksum
+disk has 2 errors.
+1 files, 3 blocks in use
+0 out of range pointers
+0 duplicate blocks
+0 blocks past end of file
+1 leaked blocks
+0 unmarked blocks
+1 blocks failing their checksum
+disk repaired.
+1 files, 3 blocks in use
+0 out of range pointers
+0 duplicate blocks
+0 blocks past end of file
+0 leaked blocks
+0 unmarked blocks
+disk is clean.
+19 disk block reads
+3 disk block writes
+EOF
+}
+
+# Inode 3 of image.20 owns blocks 10 11 12: point its fourth direct pointer
+# at block 5 (owned by inode 2) and its fifth past the end of the disk
+cp data/image.20 $SCRATCH/image.20
+printf '\x05\x00\x00\x00\x63\x00\x00\x00' | dd of=$SCRATCH/image.20 bs=1 seek=4212 conv=notrunc 2> /dev/null
+
+echo -n "Testing fsck on $SCRATCH/image.20 ... "
+if diff -u <(pointers-input | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null) <(pointers-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Mark free block 199 as used in the saved bitmap (block 21)
+seq 1 2000 > $SCRATCH/input.txt
+printf "format\nmount\ncreate\ncopyin $SCRATCH/input.txt 0\nunmount\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+printf '\x7f' | dd of=$SCRATCH/image.200 bs=1 seek=$((21*4096 + 24)) conv=notrunc 2> /dev/null
+
+echo -n "Testing fsck on $SCRATCH/image.200 ... "
+if diff -u <(bitmap-input | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null) <(bitmap-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: fsck finds directory entries naming free inodes and link counts that
+# differ from the names found, and repair drops the entries and fixes the
+# counts (the inode block then fails its checksum too)
+
+names-output() {
+    cat <<EOF
+1 bad directory entries
+1 wrong link counts
+disk has 6 errors.
+1 bad directory entries
+1 wrong link counts
+disk repaired.
+disk is clean.
+disk mounted.
+     3 g
+unlinked /d/g.
+unlinked /d.
+EOF
+}
+
+# Root is inode 0, /d inode 1, /d/f inode 2 and /d/g inode 3: free inode 2
+# and give inode 3 five names
+printf "format\nmount\nmkdir /d\ncopyin $SCRATCH/input.txt /d/f\ncopyin $SCRATCH/input.txt /d/g\nunmount\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+printf '\x00\x00\x00\x00' | dd of=$SCRATCH/image.200 bs=1 seek=$((4096 + 64)) conv=notrunc 2> /dev/null
+printf '\x01\x00\x05\x00' | dd of=$SCRATCH/image.200 bs=1 seek=$((4096 + 96)) conv=notrunc 2> /dev/null
+
+echo -n "Testing fsck of names on $SCRATCH/image.200 ... "
+if ./bin/sfssh -c "fsck; fsck repair; fsck; mount; ls /d; unlink /d/g; unlink /d" $SCRATCH/image.200 200 2> /dev/null |
+    grep -E '(entries|counts|^disk [^b]|^ |unlinked)' | diff -u - <(names-output) > $SCRATCH/test.log &&
+   ./bin/sfssh -c "fsck" $SCRATCH/image.200 200 2> /dev/null | grep -q '^disk is clean.$'; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
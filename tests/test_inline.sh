@@ -0,0 +1,108 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: files that fit in an inode keep their data there, survive a remount,
+# and move to a data block when they grow
+
+inline-input() {
+    cat <<EOF2
+format
+mount
+create
+copyin $SCRATCH/tiny.txt 0
+create
+copyin $SCRATCH/tiny.txt 1
+debug
+unmount
+mount
+stat 0
+copyout 0 $SCRATCH/tiny.out
+copyin $SCRATCH/small.txt 1
+copyout 1 $SCRATCH/small.out
+debug
+remove 0
+remove 1
+create
+debug
+EOF2
+}
+
+inline-output() {
+    cat <<EOF2
+disk formatted.
+disk mounted.
+created inode 0.
+13 bytes copied
+created inode 1.
+13 bytes copied
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    2 checksum blocks
+Inode 0:
+    size: 13 bytes
+    inline data
+Inode 1:
+    size: 13 bytes
+    inline data
+5 cache hits
+3 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+disk unmounted.
+disk mounted.
+inode 0 has size 13 bytes.
+13 bytes copied
+8893 bytes copied
+8893 bytes copied
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    2 checksum blocks
+Inode 0:
+    size: 13 bytes
+    inline data
+Inode 1:
+    size: 8893 bytes
+    direct blocks: 24 25 26
+removed inode 0.
+removed inode 1.
+created inode 0.
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    2 checksum blocks
+Inode 0:
+    size: 0 bytes
+    direct blocks:
+14 cache hits
+6 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+17 disk block reads
+216 disk block writes
+EOF2
+}
+
+printf 'hello, world\n' > $SCRATCH/tiny.txt
+seq 1 2000 > $SCRATCH/small.txt
+
+echo -n "Testing inline data on $SCRATCH/image.200 ... "
+if diff -u <(inline-input | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null) <(inline-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/tiny.txt $SCRATCH/tiny.out && cmp -s $SCRATCH/small.txt $SCRATCH/small.out &&
+   ./bin/sfssh -c fsck $SCRATCH/image.200 200 2> /dev/null | grep -q '^disk is clean.$'; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,73 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: after a crash, mount and fsck replay committed transactions and drop
+# the rest, leaving a consistent file system
+
+fsck-output() {
+    cat <<EOF2
+1 journal transactions replayed
+21 files, 63 blocks in use
+0 out of range pointers
+0 duplicate blocks
+0 blocks past end of file
+0 leaked blocks
+0 unmarked blocks
+disk is clean.
+disk mounted.
+inode 20 has size 8893 bytes.
+8893 bytes copied
+EOF2
+}
+
+seq 1 2000 > $SCRATCH/small.txt
+
+echo -n "Testing journal recovery on $SCRATCH/image.2000 ... "
+
+# Commit 21 files, then create 10 more and remove one of the first without
+# committing, and kill the shell once it has done so
+mkfifo $SCRATCH/commands
+stdbuf -oL ./bin/sfssh $SCRATCH/image.2000 2000 < $SCRATCH/commands > $SCRATCH/crash.out 2> /dev/null &
+SHELL_PID=$!
+exec 3> $SCRATCH/commands
+printf 'format\nmount\n' >&3
+for i in $(seq 0 20); do
+    printf "create\ncopyin $SCRATCH/small.txt $i\n" >&3
+done
+printf 'commit\n' >&3
+for i in $(seq 21 30); do
+    printf "create\ncopyin $SCRATCH/small.txt $i\n" >&3
+done
+printf 'remove 0\nstat 30\n' >&3
+for i in $(seq 1 100); do
+    grep -q 'inode 30 has size' $SCRATCH/crash.out && break
+    sleep 0.1
+done
+{ kill -9 $SHELL_PID; wait $SHELL_PID; } 2> /dev/null
+exec 3>&-
+
+if ./bin/sfssh -c "fsck; mount; stat 20; copyout 0 $SCRATCH/small.out" $SCRATCH/image.2000 2000 2> /dev/null |
+    head -n 11 | diff -u - <(fsck-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/small.txt $SCRATCH/small.out &&
+   ! ./bin/sfssh -c "mount; stat 21" $SCRATCH/image.2000 2000 > /dev/null 2>&1 &&
+   ./bin/sfssh -c fsck $SCRATCH/image.2000 2000 2> /dev/null | grep -q '^disk is clean.$'; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: many threads on a small journal commit before their transaction
+# outgrows it (the journal refuses one that does not fit)
+
+echo -n "Testing journal capacity on $SCRATCH/image.600 ... "
+if ./bin/sfsstress $SCRATCH/image.600 600 32 300 > $SCRATCH/test.log 2>&1 &&
+   grep -q "^32 threads, 9600 operations, 0 errors$" $SCRATCH/test.log &&
+   ./bin/sfssh -c fsck $SCRATCH/image.600 600 2> /dev/null | grep -q '^disk is clean.$'; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
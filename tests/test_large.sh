@@ -0,0 +1,66 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: files past the indirect block are mapped through the double
+# indirect block and survive a remount
+
+large-input() {
+    cat <<EOF
+format
+mount
+create
+copyin $SCRATCH/input.txt 0
+stat 0
+frag
+unmount
+mount
+copyout 0 $SCRATCH/input.copy
+remove 0
+frag
+EOF
+}
+
+large-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+6188895 bytes copied
+inode 0 has size 6188895 bytes.
+1 files, 1511 blocks, 4 extents, 377.75 blocks per extent
+819 cache hits
+8 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+1 journal commits
+7 journal blocks
+disk unmounted.
+disk mounted.
+6188895 bytes copied
+removed inode 0.
+0 files, 0 blocks, 0 extents, 0.00 blocks per extent
+1953 cache hits
+16 cache misses
+1444 cache evictions
+1503 readahead hits
+0 readahead wasted
+1 journal commits
+4 journal blocks
+1531 disk block reads
+3544 disk block writes
+EOF
+}
+
+seq 1 900000 > $SCRATCH/input.txt
+
+echo -n "Testing large file on $SCRATCH/image.2000 ... "
+if diff -u <(large-input | ./bin/sfssh $SCRATCH/image.2000 2000 2> /dev/null) <(large-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/input.txt $SCRATCH/input.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,103 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: lazy format releases old contents instead of rewriting them, and
+# inode blocks are initialized as creates reach them
+
+lazy-input() {
+    cat <<EOF
+format lazy
+debug
+mount
+EOF
+    for i in $(seq 1 130); do
+    	echo create
+    done
+    cat <<EOF
+copyin $SCRATCH/small.txt 129
+unmount
+fsck
+mount
+debug
+EOF
+}
+
+lazy-output() {
+    cat <<EOF
+disk formatted.
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    2 checksum blocks
+disk mounted.
+EOF
+    for i in $(seq 0 129); do
+    	echo "created inode $i."
+    done
+    cat <<EOF
+8893 bytes copied
+130 cache hits
+5 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+disk unmounted.
+130 files, 3 blocks in use
+0 out of range pointers
+0 duplicate blocks
+0 blocks past end of file
+0 leaked blocks
+0 unmarked blocks
+disk is clean.
+disk mounted.
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    2 checksum blocks
+EOF
+    for i in $(seq 0 128); do
+    	echo "Inode $i:"
+    	echo "    size: 0 bytes"
+    	echo "    direct blocks:"
+    done
+    cat <<EOF
+Inode 129:
+    size: 8893 bytes
+    direct blocks: 24 25 26
+0 cache hits
+1 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+20 disk block reads
+18 disk block writes
+EOF
+}
+
+seq 1 2000 > $SCRATCH/small.txt
+cp data/image.200 $SCRATCH/image.200
+
+echo -n "Testing lazy format on $SCRATCH/image.200 ... "
+if diff -u <(lazy-input | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null) <(lazy-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Only the superblock and free block bitmap should take up space
+yes | head -c $((2000*4096)) > $SCRATCH/image.2000
+echo -n "Testing lazy format space on $SCRATCH/image.2000 ... "
+echo "format lazy" | ./bin/sfssh $SCRATCH/image.2000 2000 > /dev/null 2>&1
+if [ $(du -k $SCRATCH/image.2000 | cut -f 1) -le 64 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    du -k $SCRATCH/image.2000
+fi
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: mmap backend produces the same output and image as the file backend
+
+test-input() {
+    cat <<EOF
+debug
+mount
+copyout 1 $SCRATCH/$1.1.txt
+copyout 2 $SCRATCH/$1.2.txt
+create
+copyin $SCRATCH/$1.1.txt 0
+create
+copyin $SCRATCH/$1.2.txt 3
+remove 1
+debug
+cat 3
+EOF
+}
+
+cp data/image.200 $SCRATCH/image.200.file
+cp data/image.200 $SCRATCH/image.200.mmap
+
+echo -n "Testing mmap backend on $SCRATCH/image.200.mmap ... "
+if diff -u <(test-input file | ./bin/sfssh $SCRATCH/image.200.file 200 2> /dev/null) \
+	   <(test-input mmap | ./bin/sfssh -m $SCRATCH/image.200.mmap 200 2> /dev/null) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/image.200.file $SCRATCH/image.200.mmap; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
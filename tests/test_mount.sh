@@ -11,6 +11,11 @@ EOF
 mount-output() {
     cat <<EOF
 disk mounted.
+0 cache hits
+0 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
 2 disk block reads
 0 disk block writes
 EOF
@@ -27,6 +32,11 @@ mount-mount-output() {
     cat <<EOF
 disk mounted.
 mount failed!
+0 cache hits
+0 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
 2 disk block reads
 0 disk block writes
 EOF
@@ -43,6 +53,11 @@ mount-format-output() {
     cat <<EOF
 disk mounted.
 format failed!
+0 cache hits
+0 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
 2 disk block reads
 0 disk block writes
 EOF
@@ -0,0 +1,57 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: sequential copyout is served from read ahead blocks
+
+test-input() {
+    cat <<EOF
+format
+mount
+create
+copyin $SCRATCH/input.txt 0
+unmount
+mount
+copyout 0 $SCRATCH/input.copy
+EOF
+}
+
+test-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+2688895 bytes copied
+330 cache hits
+5 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+1 journal commits
+4 journal blocks
+disk unmounted.
+disk mounted.
+2688895 bytes copied
+814 cache hits
+10 cache misses
+587 cache evictions
+649 readahead hits
+0 readahead wasted
+0 journal commits
+0 journal blocks
+672 disk block reads
+1675 disk block writes
+EOF
+}
+
+seq 1 400000 > $SCRATCH/input.txt
+
+echo -n "Testing readahead on $SCRATCH/image.1000 ... "
+if diff -u <(test-input | ./bin/sfssh $SCRATCH/image.1000 1000 2> /dev/null) <(test-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/input.txt $SCRATCH/input.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -62,8 +62,13 @@ SuperBlock:
 Inode 2:
     size: 0 bytes
     direct blocks:
-25 disk block reads
-8 disk block writes
+12 cache hits
+1 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+9 disk block reads
+2 disk block writes
 EOF
 }
 
@@ -156,8 +161,13 @@ Inode 1:
 Inode 2:
     size: 965 bytes
     direct blocks: 4
-27 disk block reads
-10 disk block writes
+13 cache hits
+4 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+12 disk block reads
+6 disk block writes
 EOF
 }
 
@@ -230,8 +240,13 @@ Inode 2:
     direct blocks: 4 5 6 7 8
     indirect block: 9
     indirect data blocks: 13 14
-41 disk block reads
-18 disk block writes
+6 cache hits
+11 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+26 disk block reads
+10 disk block writes
 EOF
 }
 
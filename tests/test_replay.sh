@@ -0,0 +1,84 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: a traced session replayed on a fresh image builds the same files, and
+# its disk transfers replay without errors
+
+session-input() {
+    cat <<EOF
+format
+mount
+create
+create
+copyin $SCRATCH/large.txt 0
+copyin $SCRATCH/small.txt 1
+remove 0
+create
+copyin $SCRATCH/small.txt 0
+cat 1
+stat 1
+unmount
+EOF
+}
+
+seq 1 2000  > $SCRATCH/small.txt
+seq 1 20000 > $SCRATCH/large.txt
+
+session-input | ./bin/sfssh -t $SCRATCH/trace $SCRATCH/image.500 500 > /dev/null 2>&1
+
+echo -n "Testing replay on $SCRATCH/replay.500 ... "
+if ./bin/sfsreplay -f $SCRATCH/trace $SCRATCH/replay.500 500 > $SCRATCH/test.log 2>&1 &&
+   grep -q "^15 calls, 0 mismatched results$" $SCRATCH/test.log &&
+   diff <(echo debug | ./bin/sfssh $SCRATCH/image.500 500 2> /dev/null) \
+   	<(echo debug | ./bin/sfssh $SCRATCH/replay.500 500 2> /dev/null) >> $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+echo -n "Testing paced disk replay on $SCRATCH/disk.500 ... "
+if ./bin/sfsreplay -d -p -m $SCRATCH/trace $SCRATCH/disk.500 500 > $SCRATCH/test.log 2>&1 &&
+   grep -q "^disk write " $SCRATCH/test.log &&
+   grep -q " calls, 0 mismatched results$" $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: names, directories and compressed files replay too (replayed writes
+# carry other bytes, so only names and sizes are compared)
+
+names-input() {
+    cat <<EOF
+format
+mount
+mkdir /d
+mkdir /d/e
+create
+compress 3
+copyin $SCRATCH/large.txt 3
+link 3 /d/e/f
+copyin $SCRATCH/small.txt /d/g
+lookup /d/g
+unlink /d/g
+unmount
+EOF
+}
+
+names-input | ./bin/sfssh -t $SCRATCH/names $SCRATCH/names.500 500 > /dev/null 2>&1
+
+echo -n "Testing replay of names on $SCRATCH/replay.500 ... "
+if ./bin/sfsreplay -f $SCRATCH/names $SCRATCH/replay.500 500 > $SCRATCH/test.log 2>&1 &&
+   grep -q "^mkdir " $SCRATCH/test.log && grep -q "^compress " $SCRATCH/test.log &&
+   grep -q " calls, 0 mismatched results$" $SCRATCH/test.log &&
+   diff <(printf 'mount\nls /d/e\nls /d\nstat /d/e/f\n' | ./bin/sfssh $SCRATCH/names.500 500 2> /dev/null) \
+   	<(printf 'mount\nls /d/e\nls /d\nstat /d/e/f\n' | ./bin/sfssh $SCRATCH/replay.500 500 2> /dev/null) >> $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,96 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: stats counts calls, bytes and allocations, and stats reset clears them
+# (latencies vary between runs, so they are masked)
+
+stats-input() {
+    cat <<EOF
+format
+mount
+create
+copyin $SCRATCH/small.txt 0
+stat 0
+remove 0
+create
+compress 0
+mkdir /d
+link 0 /d/f
+lookup /d/f
+unlink /d/f
+stats
+stats reset
+stats
+EOF
+}
+
+stats-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+8893 bytes copied
+inode 0 has size 8893 bytes.
+removed inode 0.
+created inode 0.
+inode 0 is compressed.
+created directory inode 2.
+linked inode 0.
+/d/f is inode 0.
+unlinked /d/f.
+operation       calls        bytes     p50 us     p99 us     max us
+mount               1            0 ...
+create              2            0 ...
+remove              1            0 ...
+stat                1            0 ...
+read                0            0 ...
+write               1         8893 ...
+compress            1            0 ...
+lookup              4            0 ...
+link                1            0 ...
+unlink              1            0 ...
+mkdir               1            0 ...
+disk read           5        20480 ...
+disk write          9       843776 ...
+5 allocations, searched p50 28 p99 28 max 28 blocks
+71 cache hits, 7 misses, 0 evictions, 0 readahead hits, 0 readahead wasted
+1 blocks verified, 0 checksum mismatches, 1 checksums updated
+stats reset.
+operation       calls        bytes     p50 us     p99 us     max us
+mount               0            0 ...
+create              0            0 ...
+remove              0            0 ...
+stat                0            0 ...
+read                0            0 ...
+write               0            0 ...
+compress            0            0 ...
+lookup              0            0 ...
+link                0            0 ...
+unlink              0            0 ...
+mkdir               0            0 ...
+disk read           0            0 ...
+disk write          0            0 ...
+0 allocations, searched p50 0 p99 0 max 0 blocks
+0 cache hits, 0 misses, 0 evictions, 0 readahead hits, 0 readahead wasted
+0 blocks verified, 0 checksum mismatches, 0 checksums updated
+0 cache hits
+2 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+5 disk block reads
+216 disk block writes
+EOF
+}
+
+seq 1 2000 > $SCRATCH/small.txt
+
+echo -n "Testing stats on $SCRATCH/image.200 ... "
+if diff -u <(stats-input | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | sed -E 's/( +[0-9]+\.[0-9]){3}$/ .../') <(stats-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
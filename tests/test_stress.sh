@@ -0,0 +1,15 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: concurrent creates, removes, reads and writes keep every file intact
+
+echo -n "Testing stress on $SCRATCH/image.4000 ... "
+if ./bin/sfsstress $SCRATCH/image.4000 4000 8 2000 > $SCRATCH/test.log 2>&1 &&
+   grep -q "^8 threads, 16000 operations, 0 errors$" $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,100 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: unmount persists free block bitmap so next mount skips inode scan
+
+first-input() {
+    cat <<EOF
+format
+mount
+create
+create
+copyin $SCRATCH/input.txt 1
+unmount
+unmount
+EOF
+}
+
+first-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+created inode 1.
+8893 bytes copied
+3 cache hits
+4 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+disk unmounted.
+unmount failed!
+5 disk block reads
+30 disk block writes
+EOF
+}
+
+second-input() {
+    cat <<EOF
+mount
+stat 0
+stat 1
+copyout 1 $SCRATCH/input.copy
+create
+debug
+EOF
+}
+
+second-output() {
+    cat <<EOF
+disk mounted.
+inode 0 has size 0 bytes.
+inode 1 has size 8893 bytes.
+8893 bytes copied
+created inode 2.
+SuperBlock:
+    magic number is valid
+    20 blocks
+    2 inode blocks
+    256 inodes
+    2 checksum blocks
+Inode 0:
+    size: 0 bytes
+    direct blocks:
+Inode 1:
+    size: 8893 bytes
+    direct blocks: 6 7 8
+Inode 2:
+    size: 0 bytes
+    direct blocks:
+5 cache hits
+6 cache misses
+0 cache evictions
+0 readahead hits
+0 readahead wasted
+10 disk block reads
+5 disk block writes
+EOF
+}
+
+seq 1 2000 > $SCRATCH/input.txt
+cp data/image.20 $SCRATCH/image.20
+
+echo -n "Testing unmount on $SCRATCH/image.20 ... "
+if diff -u <(first-input | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null) <(first-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+echo -n "Testing clean mount on $SCRATCH/image.20 ... "
+if diff -u <(second-input | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null) <(second-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/input.txt $SCRATCH/input.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi